@@ -1,6 +1,8 @@
 #include "pch.h"
 #include "apu.h"
 
+#include <cmath>
+
 namespace nes
 {
     length_counter_t::length_counter_t()
@@ -72,6 +74,19 @@ namespace nes
         sweep.is_pulse2 = is_pulse2;
     }
 
+    void pulse_channel_t::serialize(state_t& state)
+    {
+        state.value(sweep);
+        state.value(constant_volume);
+        state.value(volume);
+        state.value(duty);
+        state.value(sequencer);
+        state.value(timer_period);
+        state.value(timer);
+        state.value(length_counter);
+        state.value(envelope);
+    }
+
     void pulse_channel_t::clock()
     {
         timer--;
@@ -138,7 +153,7 @@ namespace nes
 
     uint8_t pulse_channel_t::get_sample() const
     {
-        if (!debug.enabled ||
+        if ((DEBUG_ENABLED && !debug.enabled) ||
             length_counter.value == 0 ||
             is_sweeper_muting() ||
             !SEQUENCE_LUT[duty][sequencer])
@@ -196,6 +211,18 @@ namespace nes
     {
     }
 
+    void triangle_channel_t::serialize(state_t& state)
+    {
+        state.value(reload_flag);
+        state.value(control_flag);
+        state.value(linear_counter);
+        state.value(linear_counter_reload);
+        state.value(timer_period);
+        state.value(timer);
+        state.value(sequencer);
+        state.value(length_counter);
+    }
+
     void triangle_channel_t::clock()
     {
         timer--;
@@ -232,7 +259,7 @@ namespace nes
 
     uint8_t triangle_channel_t::get_sample() const
     {
-        if (!is_running() && debug.output_zero_when_stopped)
+        if (!is_running() && DEBUG_ENABLED && debug.output_zero_when_stopped)
         {
             return 0;
         }
@@ -244,7 +271,7 @@ namespace nes
 
     bool triangle_channel_t::is_running() const
     {
-        return debug.enabled && timer_period >= 2 && linear_counter > 0 && length_counter.value > 0;
+        return (!DEBUG_ENABLED || debug.enabled) && timer_period >= 2 && linear_counter > 0 && length_counter.value > 0;
     }
 
     noise_channel_t::noise_channel_t()
@@ -257,6 +284,18 @@ namespace nes
     {
     }
 
+    void noise_channel_t::serialize(state_t& state)
+    {
+        state.value(shift_register);
+        state.value(mode);
+        state.value(constant_volume);
+        state.value(volume);
+        state.value(timer_period);
+        state.value(timer);
+        state.value(length_counter);
+        state.value(envelope);
+    }
+
     void noise_channel_t::clock()
     {
         timer--;
@@ -291,7 +330,7 @@ namespace nes
 
     uint8_t noise_channel_t::get_sample() const
     {
-        if (!debug.enabled ||
+        if ((DEBUG_ENABLED && !debug.enabled) ||
             length_counter.value == 0 ||
             (shift_register & 1))
         {
@@ -327,6 +366,25 @@ namespace nes
     {
     }
 
+    void dmc_channel_t::serialize(state_t& state)
+    {
+        state.value(sample_buffer_full);
+        state.value(sample_buffer);
+        state.value(sample_address);
+        state.value(sample_length);
+        state.value(loop);
+        state.value(interrupt_enabled);
+        state.value(dma_addr);
+        state.value(dma_remaining);
+        state.value(shift_register);
+        state.value(shift_register_bit_count);
+        state.value(silence_flag);
+        state.value(output_level);
+        state.value(timer_period);
+        state.value(timer);
+        state.value(irq);
+    }
+
     void dmc_channel_t::clock()
     {
         timer--;
@@ -416,10 +474,10 @@ namespace nes
 
     uint8_t dmc_channel_t::get_sample() const
     {
-        return debug.enabled ? output_level : 0;
+        return !DEBUG_ENABLED || debug.enabled ? output_level : 0;
     }
 
-    apu_t::apu_t(bus_t& cpu_bus)
+    apu_t::apu_t(bus_t& cpu_bus, scheduler_t& scheduler)
         : pulse1(false),
           pulse2(true),
           dmc(cpu_bus),
@@ -432,7 +490,11 @@ namespace nes
           frame_counter_interrupt_inhibit(false),
           frame_counter_sequence_mode(false),
           frame_irq(false),
-          cpu_bus(&cpu_bus)
+          cpu_bus(&cpu_bus),
+          scheduler(&scheduler),
+          audio_output(nullptr),
+          dots_per_sample(0.0),
+          sample_time(0.0)
     {
     }
 
@@ -444,13 +506,37 @@ namespace nes
         auto noise_debug = noise.debug.enabled;
         auto dmc_debug = dmc.debug.enabled;
         auto apu_debug = debug;
-        *this = apu_t(*cpu_bus);
+        auto output = audio_output;
+        auto period = dots_per_sample;
+        *this = apu_t(*cpu_bus, *scheduler);
         pulse1.debug.enabled = pulse1_debug;
         pulse2.debug.enabled = pulse2_debug;
         triangle.debug.enabled = triangle_debug;
         noise.debug.enabled = noise_debug;
         dmc.debug.enabled = dmc_debug;
         debug = apu_debug;
+        audio_output = output;
+        dots_per_sample = period;
+        schedule_events();
+    }
+
+    // Events are not part of the state; call schedule_events() after loading
+    void apu_t::serialize(state_t& state)
+    {
+        pulse1.serialize(state);
+        pulse2.serialize(state);
+        triangle.serialize(state);
+        noise.serialize(state);
+        dmc.serialize(state);
+        state.value(pulse1_enabled);
+        state.value(pulse2_enabled);
+        state.value(triangle_enabled);
+        state.value(noise_enabled);
+        state.value(even_clock);
+        state.value(clock_sequencer);
+        state.value(frame_counter_interrupt_inhibit);
+        state.value(frame_counter_sequence_mode);
+        state.value(frame_irq);
     }
 
     bool apu_t::read(uint16_t addr, uint8_t& value, bool allow_side_effects)
@@ -530,6 +616,7 @@ namespace nes
             {
                 frame_irq = false;
             }
+            schedule_frame_counter();
             return true;
         default:
             return false;
@@ -546,38 +633,82 @@ namespace nes
             pulse2.clock();
             noise.clock();
             dmc.clock();
-
             clock_sequencer++;
-            if (clock_sequencer == 3728)
-            {
-                clock_quarter_frame();
-            }
-            else if (clock_sequencer == 7456)
-            {
-                clock_quarter_frame();
-                clock_half_frame();
-            }
-            else if (clock_sequencer == 11185)
-            {
-                clock_quarter_frame();
-            }
-            else if (frame_counter_sequence_mode == 0 && clock_sequencer >= 14914)
-            {
-                clock_quarter_frame();
-                clock_half_frame();
-                clock_sequencer = 0xFFFF;
-                if (!frame_counter_interrupt_inhibit)
-                {
-                    frame_irq = true;
-                }
-            }
-            else if (frame_counter_sequence_mode == 1 && clock_sequencer >= 18640)
+        }
+    }
+
+    // Runs the frame counter step that clock_sequencer has just reached.
+    // Called by the scheduler at the time set by schedule_frame_counter().
+    void apu_t::clock_frame_counter()
+    {
+        if (clock_sequencer == 3728)
+        {
+            clock_quarter_frame();
+        }
+        else if (clock_sequencer == 7456)
+        {
+            clock_quarter_frame();
+            clock_half_frame();
+        }
+        else if (clock_sequencer == 11185)
+        {
+            clock_quarter_frame();
+        }
+        else if (frame_counter_sequence_mode == 0 && clock_sequencer >= 14914)
+        {
+            clock_quarter_frame();
+            clock_half_frame();
+            clock_sequencer = 0xFFFF;
+            if (!frame_counter_interrupt_inhibit)
             {
-                clock_quarter_frame();
-                clock_half_frame();
-                clock_sequencer = 0xFFFF;
+                frame_irq = true;
             }
         }
+        else if (frame_counter_sequence_mode == 1 && clock_sequencer >= 18640)
+        {
+            clock_quarter_frame();
+            clock_half_frame();
+            clock_sequencer = 0xFFFF;
+        }
+        schedule_frame_counter();
+    }
+
+    // Works out when clock_sequencer will next reach a frame counter step.
+    // The APU is clocked on every CPU cycle, which is every third dot, and
+    // the sequencer advances on every other APU clock.
+    void apu_t::schedule_frame_counter()
+    {
+        uint16_t last_step = frame_counter_sequence_mode ? 18640 : 14914;
+        uint16_t next = clock_sequencer + 1;
+        uint16_t step;
+        if (next >= last_step)
+        {
+            step = next;
+        }
+        else if (next <= 3728)
+        {
+            step = 3728;
+        }
+        else if (next <= 7456)
+        {
+            step = 7456;
+        }
+        else if (next <= 11185)
+        {
+            step = 11185;
+        }
+        else
+        {
+            step = last_step;
+        }
+
+        uint16_t even_clocks = step - clock_sequencer;
+        uint64_t clocks = even_clock ? even_clocks * 2 : even_clocks * 2 - 1;
+        uint64_t first_clock = (scheduler->time + 2) / 3 * 3;
+        // Due straight after the dot on which the APU is clocked
+        scheduler->schedule(
+            event_t::apu_frame_counter,
+            first_clock + (clocks - 1) * 3 + 1);
     }
 
     void apu_t::clock_quarter_frame()
@@ -610,9 +741,79 @@ namespace nes
         noise.length_counter.clock();
     }
 
+    // Samples are taken every dots_per_sample master clock dots. Changing
+    // the rate of an active output keeps the time of the last sample.
+    void apu_t::set_audio_output(audio_output_t* output, double dots_per_sample)
+    {
+        if (audio_output == nullptr)
+        {
+            sample_time = (double)scheduler->time;
+        }
+        audio_output = output;
+        this->dots_per_sample = dots_per_sample;
+        schedule_sample();
+    }
+
+    // Reschedules the frame counter and audio sampling from the current
+    // time, e.g. after a reset or loading a state
+    void apu_t::schedule_events()
+    {
+        schedule_frame_counter();
+        sample_time = (double)scheduler->time;
+        schedule_sample();
+    }
+
+    void apu_t::schedule_sample()
+    {
+        if (audio_output == nullptr || dots_per_sample <= 0.0)
+        {
+            audio_output = nullptr;
+            scheduler->cancel(event_t::audio_sample);
+            return;
+        }
+        scheduler->schedule(
+            event_t::audio_sample,
+            (uint64_t)std::ceil(sample_time + dots_per_sample));
+    }
+
+    void apu_t::clock_sample()
+    {
+        sample_time += dots_per_sample;
+        size_t i = audio_output->count;
+        if (i < audio_output->capacity)
+        {
+            if (audio_output->mixed)
+            {
+                audio_output->mixed[i] = get_mixed_sample();
+            }
+            if (audio_output->pulse1)
+            {
+                audio_output->pulse1[i] = pulse1.get_sample();
+            }
+            if (audio_output->pulse2)
+            {
+                audio_output->pulse2[i] = pulse2.get_sample();
+            }
+            if (audio_output->triangle)
+            {
+                audio_output->triangle[i] = triangle.get_sample();
+            }
+            if (audio_output->noise)
+            {
+                audio_output->noise[i] = noise.get_sample();
+            }
+            if (audio_output->dmc)
+            {
+                audio_output->dmc[i] = dmc.get_sample();
+            }
+            audio_output->count++;
+        }
+        schedule_sample();
+    }
+
     float apu_t::get_mixed_sample() const
     {
-        if (!debug.enabled)
+        if (DEBUG_ENABLED && !debug.enabled)
         {
             return 0.0f;
         }
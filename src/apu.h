@@ -1,6 +1,8 @@
 #pragma once
 #include "pch.h"
 #include "cpu.h"
+#include "scheduler.h"
+#include "debug.h"
 
 namespace nes
 {
@@ -41,6 +43,7 @@ namespace nes
         };
 
         pulse_channel_t(bool is_pulse2);
+        void serialize(state_t& state);
         void clock();
         void clock_sweep();
         void write(uint16_t addr, uint8_t value);
@@ -83,6 +86,7 @@ namespace nes
         };
 
         triangle_channel_t();
+        void serialize(state_t& state);
         void clock();
         void write(uint16_t addr, uint8_t value);
         uint8_t get_sample() const;
@@ -112,6 +116,7 @@ namespace nes
         };
 
         noise_channel_t();
+        void serialize(state_t& state);
         void clock();
         void write(uint16_t addr, uint8_t value);
         uint8_t get_sample() const;
@@ -139,6 +144,7 @@ namespace nes
         };
 
         dmc_channel_t(bus_t& cpu_bus);
+        void serialize(state_t& state);
         void clock();
         void write(uint16_t addr, uint8_t value);
         void start();
@@ -169,15 +175,37 @@ namespace nes
         bus_t* cpu_bus;
     };
 
+    // Caller-owned buffers that the APU writes samples into at the
+    // configured sample rate. Any of the buffers may be null. Samples are
+    // dropped once count reaches capacity, so the caller should consume
+    // them and set count back to 0 regularly.
+    struct audio_output_t
+    {
+        float* mixed = nullptr;
+        uint8_t* pulse1 = nullptr;
+        uint8_t* pulse2 = nullptr;
+        uint8_t* triangle = nullptr;
+        uint8_t* noise = nullptr;
+        uint8_t* dmc = nullptr;
+        size_t capacity = 0;
+        size_t count = 0;
+    };
+
     struct apu_t
     {
-        apu_t(bus_t& cpu_bus);
+        apu_t(bus_t& cpu_bus, scheduler_t& scheduler);
         void reset();
+        void serialize(state_t& state);
         bool read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         bool write(uint16_t addr, uint8_t value);
         void clock();
+        void clock_frame_counter();
+        void schedule_frame_counter();
+        void schedule_events();
         void clock_quarter_frame();
         void clock_half_frame();
+        void set_audio_output(audio_output_t* output, double dots_per_sample);
+        void clock_sample();
         float get_mixed_sample() const;
 
         pulse_channel_t pulse1;
@@ -202,6 +230,12 @@ namespace nes
         } debug;
 
     private:
+        void schedule_sample();
+
         bus_t* cpu_bus;
+        scheduler_t* scheduler;
+        audio_output_t* audio_output;
+        double dots_per_sample;
+        double sample_time;
     };
 }
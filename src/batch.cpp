@@ -0,0 +1,149 @@
+#include "pch.h"
+#include "batch.h"
+
+#include <algorithm>
+
+namespace nes
+{
+    batch_t::batch_t(size_t thread_count)
+        : generation(0),
+          tasks_remaining(0),
+          frames_per_task(0),
+          stopping(false)
+    {
+        if (thread_count == 0)
+        {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            queues.push_back(std::make_unique<worker_queue_t>());
+        }
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            threads.emplace_back(&batch_t::worker_main, this, i);
+        }
+    }
+
+    batch_t::~batch_t()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // Returns null if the ROM cannot be loaded. Instances loaded from the
+    // same image share it.
+    batch_t::instance_t* batch_t::add(std::shared_ptr<const std::vector<uint8_t>> rom)
+    {
+        auto cart = cart_t::load(std::move(rom));
+        if (!cart)
+        {
+            return nullptr;
+        }
+        auto instance = std::make_unique<instance_t>();
+        instance->nes = std::make_unique<nes_t>();
+        instance->nes->load_cart(std::move(cart));
+        memcpy(instance->screen_buffer, instance->nes->screen_buffer, sizeof(instance->screen_buffer));
+        memcpy(instance->ram, instance->nes->ram.data, sizeof(instance->ram));
+        instances.push_back(std::move(instance));
+        return instances.back().get();
+    }
+
+    // Runs every instance for the given number of frames and blocks until
+    // they have all finished
+    void batch_t::run_frames(int frames)
+    {
+        if (instances.empty())
+        {
+            return;
+        }
+        // Workers still finishing the previous run may pick up tasks as
+        // soon as they are queued, so the count must be set first
+        std::unique_lock lock(mutex);
+        frames_per_task = frames;
+        tasks_remaining = instances.size();
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            auto& queue = *queues[i % queues.size()];
+            std::lock_guard queue_lock(queue.mutex);
+            queue.tasks.push_back(i);
+        }
+        generation++;
+        work_ready.notify_all();
+        work_done.wait(lock, [this] { return tasks_remaining == 0; });
+    }
+
+    void batch_t::worker_main(size_t worker)
+    {
+        uint64_t seen_generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock lock(mutex);
+                work_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen_generation = generation;
+            }
+
+            size_t task;
+            while (take_task(worker, task))
+            {
+                run_task(task);
+                std::lock_guard lock(mutex);
+                if (--tasks_remaining == 0)
+                {
+                    work_done.notify_one();
+                }
+            }
+        }
+    }
+
+    // Takes the newest task from the worker's own queue, or failing that
+    // the oldest task from another worker's queue
+    bool batch_t::take_task(size_t worker, size_t& task)
+    {
+        {
+            auto& queue = *queues[worker];
+            std::lock_guard lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            auto& queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void batch_t::run_task(size_t task)
+    {
+        auto& instance = *instances[task];
+        for (int i = 0; i < frames_per_task; i++)
+        {
+            instance.nes->clock_frame();
+        }
+        memcpy(instance.screen_buffer, instance.nes->screen_buffer, sizeof(instance.screen_buffer));
+        memcpy(instance.ram, instance.nes->ram.data, sizeof(instance.ram));
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "pch.h"
+#include "nes.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nes
+{
+    // Runs many independent NES instances on a pool of worker threads.
+    // Each call to run_frames() gives every instance one task; workers take
+    // tasks from their own queue and steal from the others when it runs
+    // dry, so slow games do not hold up a whole thread's share.
+    struct batch_t
+    {
+        struct instance_t
+        {
+            std::unique_ptr<nes_t> nes;
+            // Copied from the instance at the end of each run
+            uint8_t screen_buffer[ppu_t::SCREEN_WIDTH * ppu_t::SCREEN_HEIGHT];
+            uint8_t ram[ram_t::RAM_SIZE];
+        };
+
+        batch_t(size_t thread_count = 0);
+        ~batch_t();
+        batch_t(const batch_t&) = delete;
+        batch_t& operator=(const batch_t&) = delete;
+
+        instance_t* add(std::shared_ptr<const std::vector<uint8_t>> rom);
+        void run_frames(int frames);
+
+        // Only touch instances between calls to run_frames()
+        std::vector<std::unique_ptr<instance_t>> instances;
+
+    private:
+        struct worker_queue_t
+        {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        void worker_main(size_t worker);
+        bool take_task(size_t worker, size_t& task);
+        void run_task(size_t task);
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<worker_queue_t>> queues;
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable work_done;
+        uint64_t generation;
+        size_t tasks_remaining;
+        int frames_per_task;
+        bool stopping;
+    };
+}
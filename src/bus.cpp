@@ -1,71 +1,155 @@
 #include "pch.h"
 #include "bus.h"
+#include <algorithm>
 
 namespace nes
 {
     bus_t::bus_t(uint16_t mask, std::string name)
-        : last_read(0xAA),
+        : read_pages((mask / PAGE_SIZE) + 1, page_t{}),
+          write_pages((mask / PAGE_SIZE) + 1, page_t{}),
+          counters{},
+          open_bus_unreported(0),
+          map_generation(0),
+          last_read(0xAA),
           mask(mask),
           name(std::move(name))
     {
+        if constexpr (COUNTERS_ENABLED)
+        {
+            counters.page_reads.resize(read_pages.size());
+            counters.page_writes.resize(write_pages.size());
+        }
     }
 
     void bus_t::disconnect_read(void* obj)
     {
-        for (auto it = readers.begin(); it != readers.end(); ++it)
+        size_t count = std::erase_if(readers, [obj](const auto& reader)
         {
-            if (it->ctx == obj)
-            {
-                readers.erase(it);
-                return;
-            }
+            return reader.ctx == obj;
+        });
+        if (count == 0)
+        {
+            SPDLOG_ERROR("bus_t::disconnect_read failed");
+            return;
         }
-        SPDLOG_ERROR("bus_t::disconnect_read failed");
+        rebuild_read_pages();
     }
 
     void bus_t::disconnect_write(void* obj)
     {
-        for (auto it = writers.begin(); it != writers.end(); ++it)
+        size_t count = std::erase_if(writers, [obj](const auto& writer)
         {
-            if (it->ctx == obj)
-            {
-                writers.erase(it);
-                return;
-            }
+            return writer.ctx == obj;
+        });
+        if (count == 0)
+        {
+            SPDLOG_ERROR("bus_t::disconnect_write failed");
+            return;
+        }
+        rebuild_write_pages();
+    }
+
+    void bus_t::map_memory(uint16_t begin, uint16_t end, uint8_t* data, bool writable)
+    {
+        for (size_t page = begin / PAGE_SIZE; page <= end / PAGE_SIZE; page++)
+        {
+            read_pages[page].memory = data;
+            write_pages[page].memory = writable ? data : nullptr;
+            data += PAGE_SIZE;
+        }
+        map_generation++;
+    }
+
+    void bus_t::unmap_memory(uint16_t begin, uint16_t end)
+    {
+        for (size_t page = begin / PAGE_SIZE; page <= end / PAGE_SIZE; page++)
+        {
+            read_pages[page].memory = nullptr;
+            write_pages[page].memory = nullptr;
+        }
+        map_generation++;
+    }
+
+    // Only the open bus value is machine state; connections and mappings
+    // belong to whoever set up the bus
+    void bus_t::serialize(state_t& state)
+    {
+        state.value(last_read);
+    }
+
+    const std::vector<bus_t::open_bus_t>& bus_t::get_open_bus() const
+    {
+        return open_bus;
+    }
+
+    const bus_t::counters_t& bus_t::get_counters() const
+    {
+        return counters;
+    }
+
+    void bus_t::reset_counters()
+    {
+        std::ranges::fill(counters.page_reads, 0);
+        std::ranges::fill(counters.page_writes, 0);
+        for (auto& handler : counters.read_handlers)
+        {
+            handler.count = 0;
+        }
+        for (auto& handler : counters.write_handlers)
+        {
+            handler.count = 0;
         }
-        SPDLOG_ERROR("bus_t::disconnect_write failed");
+        counters.open_bus_reads = 0;
+        counters.unhandled_writes = 0;
     }
 
     uint8_t bus_t::read(uint16_t addr, bool allow_side_effects)
     {
         addr &= mask;
+        const page_t& page = read_pages[addr / PAGE_SIZE];
+        if constexpr (COUNTERS_ENABLED)
+        {
+            if (allow_side_effects)
+            {
+                counters.page_reads[addr / PAGE_SIZE]++;
+            }
+        }
+        if (page.memory)
+        {
+            uint8_t value = page.memory[addr % PAGE_SIZE];
+            if (allow_side_effects)
+            {
+                last_read = value;
+            }
+            return value;
+        }
         if (allow_side_effects)
         {
-            for (const auto& reader : readers)
+            for (uint16_t i = page.first; i < page.last; i++)
             {
+                const auto& reader = read_dispatch[i];
                 if (reader.callback(addr, last_read, allow_side_effects, reader.ctx))
                 {
+                    if constexpr (COUNTERS_ENABLED)
+                    {
+                        counters.read_handlers[reader.index].count++;
+                    }
                     return last_read;
                 }
             }
-            if (addr >= 0xFFFA)
+            if constexpr (COUNTERS_ENABLED)
             {
-                SPDLOG_WARN(
-                    "({}) No read handler *{:04X} (No cartridge loaded?)",
-                    name,
-                    addr);
-            }
-            else
-            {
-                SPDLOG_WARN("({}) No read handler *{:04X}", name, addr);
+                counters.open_bus_reads++;
             }
+            report_open_bus(addr, false, 0);
             return last_read;
         }
         else
         {
             uint8_t read;
-            for (const auto& reader : readers)
+            for (uint16_t i = page.first; i < page.last; i++)
             {
+                const auto& reader = read_dispatch[i];
                 if (reader.callback(addr, read, allow_side_effects, reader.ctx))
                 {
                     return read;
@@ -78,17 +162,147 @@ namespace nes
     void bus_t::write(uint16_t addr, uint8_t value)
     {
         addr &= mask;
-        for (const auto& writer : writers)
+        const page_t& page = write_pages[addr / PAGE_SIZE];
+        if constexpr (COUNTERS_ENABLED)
+        {
+            counters.page_writes[addr / PAGE_SIZE]++;
+        }
+        if (page.memory)
+        {
+            page.memory[addr % PAGE_SIZE] = value;
+            return;
+        }
+        for (uint16_t i = page.first; i < page.last; i++)
         {
+            const auto& writer = write_dispatch[i];
             if (writer.callback(addr, value, writer.ctx))
             {
+                if constexpr (COUNTERS_ENABLED)
+                {
+                    counters.write_handlers[writer.index].count++;
+                }
                 return;
             }
         }
+        if constexpr (COUNTERS_ENABLED)
+        {
+            counters.unhandled_writes++;
+        }
+        report_open_bus(addr, true, value);
+    }
+
+    // Kept out of read() and write() since games can hit open bus in a
+    // tight loop. Each address is logged the first time it is accessed,
+    // then the rest are summarised at most once per report interval. Known
+    // addresses are found through a table indexed by address, and the clock
+    // is only read every OPEN_BUS_CLOCK_CHECK accesses.
+    void bus_t::report_open_bus(uint16_t addr, bool write, uint8_t value)
+    {
+        if (open_bus_slots.empty())
+        {
+            open_bus_slots.resize((size_t)mask + 1, 0);
+        }
+        uint8_t slot = open_bus_slots[addr];
+        if (slot != 0)
+        {
+            open_bus_t& entry = open_bus[slot - 1];
+            (write ? entry.writes : entry.reads)++;
+        }
+        else if (open_bus.size() < MAX_OPEN_BUS_ADDRS)
+        {
+            open_bus.push_back(open_bus_t{addr, write ? 0u : 1u, write ? 1u : 0u});
+            open_bus_slots[addr] = (uint8_t)open_bus.size();
+            if (write)
+            {
+                SPDLOG_WARN("({}) No write handler *{:04X} = {:02X}", name, addr, value);
+            }
+            else if (addr >= 0xFFFA)
+            {
+                SPDLOG_WARN("({}) No read handler *{:04X} (No cartridge loaded?)", name, addr);
+            }
+            else
+            {
+                SPDLOG_WARN("({}) No read handler *{:04X}", name, addr);
+            }
+            if (open_bus.size() == MAX_OPEN_BUS_ADDRS)
+            {
+                SPDLOG_WARN("({}) Too many open bus addresses, no longer logging new ones", name);
+            }
+            if (open_bus_unreported == 0)
+            {
+                next_open_bus_report = std::chrono::steady_clock::now() + OPEN_BUS_REPORT_INTERVAL;
+            }
+            return;
+        }
+
+        if (++open_bus_unreported % OPEN_BUS_CLOCK_CHECK != 0)
+        {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_open_bus_report)
+        {
+            return;
+        }
+        auto busiest = std::ranges::max_element(open_bus, {}, [](const open_bus_t& entry)
+        {
+            return entry.reads + entry.writes;
+        });
         SPDLOG_WARN(
-            "({}) No write handler *{:04X} = {:02X}",
+            "({}) {} more open bus accesses, busiest *{:04X} ({} reads, {} writes in total)",
             name,
-            addr,
-            value);
+            open_bus_unreported,
+            busiest->addr,
+            busiest->reads,
+            busiest->writes);
+        open_bus_unreported = 0;
+        next_open_bus_report = now + OPEN_BUS_REPORT_INTERVAL;
+    }
+
+    template <typename Callback>
+    void bus_t::rebuild_pages(
+        const std::vector<connection_t<Callback>>& connections,
+        std::vector<connection_t<Callback>>& dispatch,
+        std::vector<page_t>& pages,
+        std::vector<counters_t::handler_t>& handler_counters)
+    {
+        // Each page gets the connections overlapping it, in connection order
+        dispatch.clear();
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            uint16_t page_begin = (uint16_t)(i * PAGE_SIZE);
+            uint16_t page_end = (uint16_t)(page_begin + PAGE_SIZE - 1);
+            pages[i].first = (uint16_t)dispatch.size();
+            for (size_t j = 0; j < connections.size(); j++)
+            {
+                const auto& connection = connections[j];
+                if (connection.begin <= page_end && connection.end >= page_begin)
+                {
+                    dispatch.push_back(connection);
+                    dispatch.back().index = (uint16_t)j;
+                }
+            }
+            pages[i].last = (uint16_t)dispatch.size();
+        }
+
+        // Handler counts restart whenever the connections change
+        if constexpr (COUNTERS_ENABLED)
+        {
+            handler_counters.clear();
+            for (const auto& connection : connections)
+            {
+                handler_counters.push_back({connection.begin, connection.end, 0});
+            }
+        }
+    }
+
+    void bus_t::rebuild_read_pages()
+    {
+        rebuild_pages(readers, read_dispatch, read_pages, counters.read_handlers);
+    }
+
+    void bus_t::rebuild_write_pages()
+    {
+        rebuild_pages(writers, write_dispatch, write_pages, counters.write_handlers);
     }
 }
@@ -1,17 +1,25 @@
 #pragma once
 #include "pch.h"
+#include "state.h"
+#include "debug.h"
 #include <vector>
 #include <string>
 #include <span>
+#include <chrono>
 
 namespace nes
 {
     struct bus_t
     {
+        static constexpr int PAGE_SIZE = 0x100;
+
         bus_t(uint16_t mask, std::string name);
 
+        // Handlers are only dispatched for addresses in [begin, end].
+        // A handler may still decline an address inside its range by
+        // returning false, in which case the next handler is tried.
         template <auto /* bool (T::*)(uint16_t, uint8_t&) */ Read, typename T>
-        void connect_read(T* obj)
+        void connect_read(T* obj, uint16_t begin = 0x0000, uint16_t end = 0xFFFF)
         {
             readers.push_back(connection_t<bus_read_t>{
                 .callback = [](
@@ -24,11 +32,15 @@ namespace nes
                     return (typed_ctx->*Read)(addr, value, allow_side_effects);
                 },
                 .ctx = obj,
+                .begin = begin,
+                .end = end,
+                .index = 0,
             });
+            rebuild_read_pages();
         }
 
         template <auto /* bool (T::*)(uint16_t, uint8_t) */ Write, typename T>
-        void connect_write(T* obj)
+        void connect_write(T* obj, uint16_t begin = 0x0000, uint16_t end = 0xFFFF)
         {
             writers.push_back(connection_t<bus_write_t>{
                 .callback = [](uint16_t addr, uint8_t value, void* ctx)
@@ -37,15 +49,100 @@ namespace nes
                     return (typed_ctx->*Write)(addr, value);
                 },
                 .ctx = obj,
+                .begin = begin,
+                .end = end,
+                .index = 0,
             });
+            rebuild_write_pages();
         }
 
         void disconnect_read(void* obj);
         void disconnect_write(void* obj);
 
+        // Backs the pages covering [begin, end] directly with memory so that
+        // accesses skip the handlers entirely. Only suitable for memory whose
+        // accesses have no side effects. begin and end must be page aligned.
+        void map_memory(uint16_t begin, uint16_t end, uint8_t* data, bool writable);
+        void unmap_memory(uint16_t begin, uint16_t end);
+        void serialize(state_t& state);
+
         uint8_t read(uint16_t addr, bool allow_side_effects = true);
         void write(uint16_t addr, uint8_t value);
 
+        // For caching decoded code. The generation changes whenever a page
+        // is mapped or unmapped, and only read-only mapped pages are
+        // returned since their contents can't change under the cache.
+        uint32_t get_map_generation() const
+        {
+            return map_generation;
+        }
+
+        const uint8_t* get_rom_page(uint16_t addr) const
+        {
+            size_t page = (addr & mask) / PAGE_SIZE;
+            return write_pages[page].memory ? nullptr : read_pages[page].memory;
+        }
+
+        // Memory backing the page containing addr, or null if accesses to
+        // the page go through handlers
+        uint8_t* get_read_memory(uint16_t addr) const
+        {
+            return read_pages[(addr & mask) / PAGE_SIZE].memory;
+        }
+
+        uint8_t* get_write_memory(uint16_t addr) const
+        {
+            return write_pages[(addr & mask) / PAGE_SIZE].memory;
+        }
+
+        uint8_t get_open_bus_value() const
+        {
+            return last_read;
+        }
+
+        // Sets the open bus value as if value had just been read
+        void set_open_bus(uint8_t value)
+        {
+            last_read = value;
+        }
+
+        // Accesses counted since the last reset_counters(). Reads without
+        // side effects are not counted. Always empty unless COUNTERS_ENABLED
+        struct counters_t
+        {
+            struct handler_t
+            {
+                uint16_t begin;
+                uint16_t end;
+                uint64_t count;
+            };
+
+            std::vector<uint64_t> page_reads;
+            std::vector<uint64_t> page_writes;
+            std::vector<handler_t> read_handlers;
+            std::vector<handler_t> write_handlers;
+            uint64_t open_bus_reads;
+            uint64_t unhandled_writes;
+        };
+
+        const counters_t& get_counters() const;
+        void reset_counters();
+
+        // Accesses that no handler or mapping served, per address. Only the
+        // first MAX_OPEN_BUS_ADDRS addresses seen get an entry.
+        struct open_bus_t
+        {
+            uint16_t addr;
+            uint64_t reads;
+            uint64_t writes;
+        };
+
+        static constexpr size_t MAX_OPEN_BUS_ADDRS = 64;
+        static constexpr auto OPEN_BUS_REPORT_INTERVAL = std::chrono::seconds(5);
+        static constexpr uint64_t OPEN_BUS_CLOCK_CHECK = 1024;
+
+        const std::vector<open_bus_t>& get_open_bus() const;
+
     private:
         using bus_read_t = bool (*)(
             uint16_t addr,
@@ -59,11 +156,45 @@ namespace nes
         {
             Callback callback;
             void* ctx;
+            uint16_t begin;
+            uint16_t end;
+            uint16_t index; // Position in readers or writers
         };
+
+        // Range of entries in the dispatch list that overlap a page, or the
+        // memory backing the page if it has been mapped directly
+        struct page_t
+        {
+            uint8_t* memory;
+            uint16_t first;
+            uint16_t last;
+        };
+
+        template <typename Callback>
+        void rebuild_pages(
+            const std::vector<connection_t<Callback>>& connections,
+            std::vector<connection_t<Callback>>& dispatch,
+            std::vector<page_t>& pages,
+            std::vector<counters_t::handler_t>& handler_counters);
+        void rebuild_read_pages();
+        void rebuild_write_pages();
+        void report_open_bus(uint16_t addr, bool write, uint8_t value);
+
         std::vector<connection_t<bus_read_t>> readers;
         std::vector<connection_t<bus_write_t>> writers;
+        std::vector<connection_t<bus_read_t>> read_dispatch;
+        std::vector<connection_t<bus_write_t>> write_dispatch;
+        std::vector<page_t> read_pages;
+        std::vector<page_t> write_pages;
+        counters_t counters;
+        std::vector<open_bus_t> open_bus;
+        // One past each address's index in open_bus, or 0 if it has none
+        std::vector<uint8_t> open_bus_slots;
+        uint64_t open_bus_unreported;
+        std::chrono::steady_clock::time_point next_open_bus_report;
+        uint32_t map_generation;
         uint8_t last_read;
         uint16_t mask;
         std::string name;
     };
-}
\ No newline at end of file
+}
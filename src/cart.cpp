@@ -28,6 +28,12 @@ namespace nes
 
     std::unique_ptr<cart_t> cart_t::load(std::vector<uint8_t> rom)
     {
+        return load(std::make_shared<const std::vector<uint8_t>>(std::move(rom)));
+    }
+
+    std::unique_ptr<cart_t> cart_t::load(std::shared_ptr<const std::vector<uint8_t>> image)
+    {
+        const std::vector<uint8_t>& rom = *image;
         size_t i = 0;
         auto cart = std::make_unique<cart_t>();
 
@@ -68,7 +74,7 @@ namespace nes
             SPDLOG_ERROR("Invalid ROM: PRG ROM too short");
             return nullptr;
         }
-        cart->prg_rom = std::span<uint8_t>(rom.data() + i, prg_size);
+        cart->prg_rom = std::span<const uint8_t>(rom.data() + i, prg_size);
 
         // Load CHR ROM
         i += prg_size;
@@ -81,18 +87,17 @@ namespace nes
         if (cart->header.chr_chunks == 0)
         {
             cart->chr_ram.resize(0x2000);
-            cart->chr = std::span<uint8_t>(cart->chr_ram);
         }
         else
         {
-            cart->chr = std::span<uint8_t>(rom.data() + i, chr_size);
+            cart->chr_ram.assign(rom.begin() + i, rom.begin() + i + chr_size);
         }
+        cart->chr = std::span<uint8_t>(cart->chr_ram);
         i += chr_size;
 
-        cart->rom = std::move(rom);
+        cart->rom = std::move(image);
 
-        uint8_t mapper_number = (cart->header.mapper_number_upper << 4)
-                               | cart->header.mapper_number_lower;
+        uint8_t mapper_number = cart->header.mapper_number();
         if (!load_mapper(mapper_number, *cart))
         {
             SPDLOG_ERROR("Unsupported mapper: {}", mapper_number);
@@ -104,6 +109,17 @@ namespace nes
     void cart_t::reset()
     {
         mapper->reset();
+        mapper->update_memory_map();
+    }
+
+    // CHR ROM is not saved, since it can't be written. See ppu_write().
+    void cart_t::serialize(state_t& state)
+    {
+        mapper->serialize(state);
+        if (header.chr_chunks == 0)
+        {
+            state.bytes(chr_ram.data(), chr_ram.size());
+        }
     }
 
     bool cart_t::cpu_read(uint16_t addr, uint8_t& value, bool allow_side_effects)
@@ -121,8 +137,13 @@ namespace nes
         return mapper->ppu_read(addr, value, allow_side_effects);
     }
 
+    // Writes to CHR ROM are ignored, as on hardware, for every mapper
     bool cart_t::ppu_write(uint16_t addr, uint8_t value)
     {
+        if (addr < 0x2000 && header.chr_chunks != 0)
+        {
+            return true;
+        }
         return mapper->ppu_write(addr, value);
     }
 }
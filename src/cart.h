@@ -42,6 +42,11 @@ namespace nes
         uint8_t _reserved3 : 2;
 
         uint8_t _unused[5];
+
+        uint8_t mapper_number() const
+        {
+            return (mapper_number_upper << 4) | mapper_number_lower;
+        }
     };
 
     static_assert(sizeof(ines_header_t) == 16, "INES header size mismatch");
@@ -53,7 +58,9 @@ namespace nes
         cart_t& operator=(cart_t&&) = delete;
 
         static std::unique_ptr<cart_t> load(std::vector<uint8_t> rom);
+        static std::unique_ptr<cart_t> load(std::shared_ptr<const std::vector<uint8_t>> rom);
         void reset();
+        void serialize(state_t& state);
 
         bool cpu_read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         bool cpu_write(uint16_t addr, uint8_t value);
@@ -61,10 +68,14 @@ namespace nes
         bool ppu_write(uint16_t addr, uint8_t value);
 
         ines_header_t header;
-        std::vector<uint8_t> rom;
-        std::span<uint8_t> prg_rom;
+        // The ROM image is never written, so carts loaded from the same
+        // image share it. CHR is always copied since writes reach it.
+        std::shared_ptr<const std::vector<uint8_t>> rom;
+        std::span<const uint8_t> prg_rom;
         std::span<uint8_t> chr;
         std::vector<uint8_t> chr_ram;
         std::unique_ptr<mapper_t> mapper;
+        bus_t* cpu_bus = nullptr;
+        bus_t* ppu_bus = nullptr;
     };
 }
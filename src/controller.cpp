@@ -14,6 +14,13 @@ namespace nes
         *this = controller_t();
     }
 
+    void controller_t::serialize(state_t& state)
+    {
+        state.value(status_shift_reg);
+        state.value(status);
+        state.value(latch);
+    }
+
     bool controller_t::read(uint16_t addr, uint8_t& value, bool allow_side_effects)
     {
         if (addr == 0x4016)
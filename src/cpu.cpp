@@ -1,5 +1,8 @@
 #include "pch.h"
 #include "cpu.h"
+#include "cpu_trace.h"
+
+#include <algorithm>
 
 static uint8_t page_differs(uint16_t addr1, uint16_t addr2)
 {
@@ -8,70 +11,120 @@ static uint8_t page_differs(uint16_t addr1, uint16_t addr2)
 
 namespace nes
 {
-#define X(_opcode, _addr_mode, _cycles)                                          \
+    // Bytes an instruction takes, including the opcode
+    static constexpr int byte_count(cpu_t::addr_mode_fn cpu_t::*addr_mode)
+    {
+        if (addr_mode == &cpu_t::IMP || addr_mode == &cpu_t::ACC)
+        {
+            return 1;
+        }
+        else if (addr_mode == &cpu_t::ABS
+              || addr_mode == &cpu_t::ABX
+              || addr_mode == &cpu_t::ABY
+              || addr_mode == &cpu_t::IND)
+        {
+            return 3;
+        }
+        else
+        {
+            return 2;
+        }
+    }
+
+    // X(opcode, operation, addressing mode, cycles)
+#define CPU_INSTRUCTIONS(X)                                                                                                                                                                                                                                                                                                                                                                                                 \
+    /* YX*/ /* 0 */                  /* 1 */                  /* 2 */                  /* 3 */                  /* 4 */                  /* 5 */                  /* 6 */                  /* 7 */                  /* 8 */                  /* 9 */                  /* A */                  /* B */                  /* C */                  /* D */                  /* E */                  /* F */                  \
+    /* 0 */ X(0x00, BRK,     IMM, 7) X(0x01, ORA,     IDX, 6) X(0x02, KIL,     IMP, 2) X(0x03, SLO,     IDX, 8) X(0x04, DOP,     ZRP, 3) X(0x05, ORA,     ZRP, 3) X(0x06, ASL,     ZRP, 5) X(0x07, SLO,     ZRP, 5) X(0x08, PHP,     IMP, 3) X(0x09, ORA,     IMM, 2) X(0x0A, ASL_ACC, ACC, 2) X(0x0B, AAC,     IMM, 2) X(0x0C, TOP,     ABS, 4) X(0x0D, ORA,     ABS, 4) X(0x0E, ASL,     ABS, 6) X(0x0F, SLO,     ABS, 6) \
+    /* 1 */ X(0x10, BPL,     REL, 2) X(0x11, ORA,     IDY, 5) X(0x12, KIL,     IMP, 2) X(0x13, SLO,     IDY, 8) X(0x14, DOP,     ZPX, 4) X(0x15, ORA,     ZPX, 4) X(0x16, ASL,     ZPX, 6) X(0x17, SLO,     ZPX, 6) X(0x18, CLC,     IMP, 2) X(0x19, ORA,     ABY, 4) X(0x1A, NOP,     IMP, 2) X(0x1B, SLO,     ABY, 7) X(0x1C, TOP,     ABX, 4) X(0x1D, ORA,     ABX, 4) X(0x1E, ASL,     ABX, 7) X(0x1F, SLO,     ABX, 7) \
+    /* 2 */ X(0x20, JSR,     ABS, 6) X(0x21, AND,     IDX, 6) X(0x22, KIL,     IMP, 2) X(0x23, RLA,     IDX, 8) X(0x24, BIT,     ZRP, 3) X(0x25, AND,     ZRP, 3) X(0x26, ROL,     ZRP, 5) X(0x27, RLA,     ZRP, 5) X(0x28, PLP,     IMP, 4) X(0x29, AND,     IMM, 2) X(0x2A, ROL_ACC, ACC, 2) X(0x2B, AAC,     IMM, 2) X(0x2C, BIT,     ABS, 4) X(0x2D, AND,     ABS, 4) X(0x2E, ROL,     ABS, 6) X(0x2F, RLA,     ABS, 6) \
+    /* 3 */ X(0x30, BMI,     REL, 2) X(0x31, AND,     IDY, 5) X(0x32, KIL,     IMP, 2) X(0x33, RLA,     IDY, 8) X(0x34, DOP,     ZPX, 4) X(0x35, AND,     ZPX, 4) X(0x36, ROL,     ZPX, 6) X(0x37, RLA,     ZPX, 6) X(0x38, SEC,     IMP, 2) X(0x39, AND,     ABY, 4) X(0x3A, NOP,     IMP, 2) X(0x3B, RLA,     ABY, 7) X(0x3C, TOP,     ABX, 4) X(0x3D, AND,     ABX, 4) X(0x3E, ROL,     ABX, 7) X(0x3F, RLA,     ABX, 7) \
+                                                                                                                                                                                                                                                                                                                                                                                                                            \
+    /* 4 */ X(0x40, RTI,     IMP, 6) X(0x41, EOR,     IDX, 6) X(0x42, KIL,     IMP, 2) X(0x43, SRE,     IDX, 8) X(0x44, DOP,     ZRP, 3) X(0x45, EOR,     ZRP, 3) X(0x46, LSR,     ZRP, 5) X(0x47, SRE,     ZRP, 5) X(0x48, PHA,     IMP, 3) X(0x49, EOR,     IMM, 2) X(0x4A, LSR_ACC, ACC, 2) X(0x4B, ASR,     IMM, 2) X(0x4C, JMP,     ABS, 3) X(0x4D, EOR,     ABS, 4) X(0x4E, LSR,     ABS, 6) X(0x4F, SRE,     ABS, 6) \
+    /* 5 */ X(0x50, BVC,     REL, 2) X(0x51, EOR,     IDY, 5) X(0x52, KIL,     IMP, 2) X(0x53, SRE,     IDY, 8) X(0x54, DOP,     ZPX, 4) X(0x55, EOR,     ZPX, 4) X(0x56, LSR,     ZPX, 6) X(0x57, SRE,     ZPX, 6) X(0x58, CLI,     IMP, 2) X(0x59, EOR,     ABY, 4) X(0x5A, NOP,     IMP, 2) X(0x5B, SRE,     ABY, 7) X(0x5C, TOP,     ABX, 4) X(0x5D, EOR,     ABX, 4) X(0x5E, LSR,     ABX, 7) X(0x5F, SRE,     ABX, 7) \
+    /* 6 */ X(0x60, RTS,     IMP, 6) X(0x61, ADC,     IDX, 6) X(0x62, KIL,     IMP, 2) X(0x63, RRA,     IDX, 8) X(0x64, DOP,     ZRP, 3) X(0x65, ADC,     ZRP, 3) X(0x66, ROR,     ZRP, 5) X(0x67, RRA,     ZRP, 5) X(0x68, PLA,     IMP, 4) X(0x69, ADC,     IMM, 2) X(0x6A, ROR_ACC, ACC, 2) X(0x6B, ARR,     IMM, 2) X(0x6C, JMP,     IND, 5) X(0x6D, ADC,     ABS, 4) X(0x6E, ROR,     ABS, 6) X(0x6F, RRA,     ABS, 6) \
+    /* 7 */ X(0x70, BVS,     REL, 2) X(0x71, ADC,     IDY, 5) X(0x72, KIL,     IMP, 2) X(0x73, RRA,     IDY, 8) X(0x74, DOP,     ZPX, 4) X(0x75, ADC,     ZPX, 4) X(0x76, ROR,     ZPX, 6) X(0x77, RRA,     ZPX, 6) X(0x78, SEI,     IMP, 2) X(0x79, ADC,     ABY, 4) X(0x7A, NOP,     IMP, 2) X(0x7B, RRA,     ABY, 7) X(0x7C, TOP,     ABX, 4) X(0x7D, ADC,     ABX, 4) X(0x7E, ROR,     ABX, 7) X(0x7F, RRA,     ABX, 7) \
+                                                                                                                                                                                                                                                                                                                                                                                                                            \
+    /* 8 */ X(0x80, DOP,     IMM, 2) X(0x81, STA,     IDX, 6) X(0x82, DOP,     IMM, 2) X(0x83, SAX,     IDX, 6) X(0x84, STY,     ZRP, 3) X(0x85, STA,     ZRP, 3) X(0x86, STX,     ZRP, 3) X(0x87, SAX,     ZRP, 3) X(0x88, DEY,     IMP, 2) X(0x89, DOP,     IMM, 2) X(0x8A, TXA,     IMP, 2) X(0x8B, XAA,     IMM, 2) X(0x8C, STY,     ABS, 4) X(0x8D, STA,     ABS, 4) X(0x8E, STX,     ABS, 4) X(0x8F, SAX,     ABS, 4) \
+    /* 9 */ X(0x90, BCC,     REL, 2) X(0x91, STA,     IDY, 6) X(0x92, KIL,     IMP, 2) X(0x93, AXA,     IDY, 6) X(0x94, STY,     ZPX, 4) X(0x95, STA,     ZPX, 4) X(0x96, STX,     ZPY, 4) X(0x97, SAX,     ZPY, 4) X(0x98, TYA,     IMP, 2) X(0x99, STA,     ABY, 5) X(0x9A, TXS,     IMP, 2) X(0x9B, XAS,     ABY, 5) X(0x9C, SYA,     ABX, 5) X(0x9D, STA,     ABX, 5) X(0x9E, SXA,     ABY, 5) X(0x9F, AXA,     ABY, 5) \
+    /* A */ X(0xA0, LDY,     IMM, 2) X(0xA1, LDA,     IDX, 6) X(0xA2, LDX,     IMM, 2) X(0xA3, LAX,     IDX, 6) X(0xA4, LDY,     ZRP, 3) X(0xA5, LDA,     ZRP, 3) X(0xA6, LDX,     ZRP, 3) X(0xA7, LAX,     ZRP, 3) X(0xA8, TAY,     IMP, 2) X(0xA9, LDA,     IMM, 2) X(0xAA, TAX,     IMP, 2) X(0xAB, ATX,     IMM, 2) X(0xAC, LDY,     ABS, 4) X(0xAD, LDA,     ABS, 4) X(0xAE, LDX,     ABS, 4) X(0xAF, LAX,     ABS, 4) \
+    /* B */ X(0xB0, BCS,     REL, 2) X(0xB1, LDA,     IDY, 5) X(0xB2, KIL,     IMP, 2) X(0xB3, LAX,     IDY, 5) X(0xB4, LDY,     ZPX, 4) X(0xB5, LDA,     ZPX, 4) X(0xB6, LDX,     ZPY, 4) X(0xB7, LAX,     ZPY, 4) X(0xB8, CLV,     IMP, 2) X(0xB9, LDA,     ABY, 4) X(0xBA, TSX,     IMP, 2) X(0xBB, LAR,     ABY, 4) X(0xBC, LDY,     ABX, 4) X(0xBD, LDA,     ABX, 4) X(0xBE, LDX,     ABY, 4) X(0xBF, LAX,     ABY, 4) \
+                                                                                                                                                                                                                                                                                                                                                                                                                            \
+    /* C */ X(0xC0, CPY,     IMM, 2) X(0xC1, CMP,     IDX, 6) X(0xC2, DOP,     IMM, 2) X(0xC3, DCP,     IDX, 8) X(0xC4, CPY,     ZRP, 3) X(0xC5, CMP,     ZRP, 3) X(0xC6, DEC,     ZRP, 5) X(0xC7, DCP,     ZRP, 5) X(0xC8, INY,     IMP, 2) X(0xC9, CMP,     IMM, 2) X(0xCA, DEX,     IMP, 2) X(0xCB, AXS,     IMM, 2) X(0xCC, CPY,     ABS, 4) X(0xCD, CMP,     ABS, 4) X(0xCE, DEC,     ABS, 6) X(0xCF, DCP,     ABS, 6) \
+    /* D */ X(0xD0, BNE,     REL, 2) X(0xD1, CMP,     IDY, 5) X(0xD2, KIL,     IMP, 2) X(0xD3, DCP,     IDY, 8) X(0xD4, DOP,     ZPX, 4) X(0xD5, CMP,     ZPX, 4) X(0xD6, DEC,     ZPX, 6) X(0xD7, DCP,     ZPX, 6) X(0xD8, CLD,     IMP, 2) X(0xD9, CMP,     ABY, 4) X(0xDA, NOP,     IMP, 2) X(0xDB, DCP,     ABY, 7) X(0xDC, TOP,     ABX, 4) X(0xDD, CMP,     ABX, 4) X(0xDE, DEC,     ABX, 7) X(0xDF, DCP,     ABX, 7) \
+    /* E */ X(0xE0, CPX,     IMM, 2) X(0xE1, SBC,     IDX, 6) X(0xE2, DOP,     IMM, 2) X(0xE3, ISB,     IDX, 8) X(0xE4, CPX,     ZRP, 3) X(0xE5, SBC,     ZRP, 3) X(0xE6, INC,     ZRP, 5) X(0xE7, ISB,     ZRP, 5) X(0xE8, INX,     IMP, 2) X(0xE9, SBC,     IMM, 2) X(0xEA, NOP,     IMP, 2) X(0xEB, SBC,     IMM, 2) X(0xEC, CPX,     ABS, 4) X(0xED, SBC,     ABS, 4) X(0xEE, INC,     ABS, 6) X(0xEF, ISB,     ABS, 6) \
+    /* F */ X(0xF0, BEQ,     REL, 2) X(0xF1, SBC,     IDY, 5) X(0xF2, KIL,     IMP, 2) X(0xF3, ISB,     IDY, 8) X(0xF4, DOP,     ZPX, 4) X(0xF5, SBC,     ZPX, 4) X(0xF6, INC,     ZPX, 6) X(0xF7, ISB,     ZPX, 6) X(0xF8, SED,     IMP, 2) X(0xF9, SBC,     ABY, 4) X(0xFA, NOP,     IMP, 2) X(0xFB, ISB,     ABY, 7) X(0xFC, TOP,     ABX, 4) X(0xFD, SBC,     ABX, 4) X(0xFE, INC,     ABX, 7) X(0xFF, ISB,     ABX, 7)
+
+#define X(_op, _opcode, _addr_mode, _cycles)                                     \
     instruction_t{                                                               \
         .opcode = &cpu_t::_opcode,                                               \
         .addr_mode = &cpu_t::_addr_mode,                                         \
         .cycles = _cycles,                                                       \
+        .byte_count = byte_count(&cpu_t::_addr_mode),                            \
         .opcode_name = { #_opcode[0], #_opcode[1], #_opcode[2], 0 },             \
         .addr_mode_name = { #_addr_mode[0], #_addr_mode[1], #_addr_mode[2], 0 }, \
-    }
+    },
 
     const instruction_t cpu_t::instructions[256]
     {
-    /* YX*/ /* 0 */         /* 1 */         /* 2 */         /* 3 */         /* 4 */         /* 5 */         /* 6 */         /* 7 */         /* 8 */         /* 9 */         /* A */             /* B */         /* C */         /* D */         /* E */         /* F */
-    /* 0 */ X(BRK, IMM, 7), X(ORA, IDX, 6), X(KIL, IMP, 2), X(SLO, IDX, 8), X(DOP, ZRP, 3), X(ORA, ZRP, 3), X(ASL, ZRP, 5), X(SLO, ZRP, 5), X(PHP, IMP, 3), X(ORA, IMM, 2), X(ASL_ACC, ACC, 2), X(AAC, IMM, 2), X(TOP, ABS, 4), X(ORA, ABS, 4), X(ASL, ABS, 6), X(SLO, ABS, 6),
-    /* 1 */ X(BPL, REL, 2), X(ORA, IDY, 5), X(KIL, IMP, 2), X(SLO, IDY, 8), X(DOP, ZPX, 4), X(ORA, ZPX, 4), X(ASL, ZPX, 6), X(SLO, ZPX, 6), X(CLC, IMP, 2), X(ORA, ABY, 4), X(NOP,     IMP, 2), X(SLO, ABY, 7), X(TOP, ABX, 4), X(ORA, ABX, 4), X(ASL, ABX, 7), X(SLO, ABX, 7),
-    /* 2 */ X(JSR, ABS, 6), X(AND, IDX, 6), X(KIL, IMP, 2), X(RLA, IDX, 8), X(BIT, ZRP, 3), X(AND, ZRP, 3), X(ROL, ZRP, 5), X(RLA, ZRP, 5), X(PLP, IMP, 4), X(AND, IMM, 2), X(ROL_ACC, ACC, 2), X(AAC, IMM, 2), X(BIT, ABS, 4), X(AND, ABS, 4), X(ROL, ABS, 6), X(RLA, ABS, 6),
-    /* 3 */ X(BMI, REL, 2), X(AND, IDY, 5), X(KIL, IMP, 2), X(RLA, IDY, 8), X(DOP, ZPX, 4), X(AND, ZPX, 4), X(ROL, ZPX, 6), X(RLA, ZPX, 6), X(SEC, IMP, 2), X(AND, ABY, 4), X(NOP,     IMP, 2), X(RLA, ABY, 7), X(TOP, ABX, 4), X(AND, ABX, 4), X(ROL, ABX, 7), X(RLA, ABX, 7),
-
-    /* 4 */ X(RTI, IMP, 6), X(EOR, IDX, 6), X(KIL, IMP, 2), X(SRE, IDX, 8), X(DOP, ZRP, 3), X(EOR, ZRP, 3), X(LSR, ZRP, 5), X(SRE, ZRP, 5), X(PHA, IMP, 3), X(EOR, IMM, 2), X(LSR_ACC, ACC, 2), X(ASR, IMM, 2), X(JMP, ABS, 3), X(EOR, ABS, 4), X(LSR, ABS, 6), X(SRE, ABS, 6),
-    /* 5 */ X(BVC, REL, 2), X(EOR, IDY, 5), X(KIL, IMP, 2), X(SRE, IDY, 8), X(DOP, ZPX, 4), X(EOR, ZPX, 4), X(LSR, ZPX, 6), X(SRE, ZPX, 6), X(CLI, IMP, 2), X(EOR, ABY, 4), X(NOP,     IMP, 2), X(SRE, ABY, 7), X(TOP, ABX, 4), X(EOR, ABX, 4), X(LSR, ABX, 7), X(SRE, ABX, 7),
-    /* 6 */ X(RTS, IMP, 6), X(ADC, IDX, 6), X(KIL, IMP, 2), X(RRA, IDX, 8), X(DOP, ZRP, 3), X(ADC, ZRP, 3), X(ROR, ZRP, 5), X(RRA, ZRP, 5), X(PLA, IMP, 4), X(ADC, IMM, 2), X(ROR_ACC, ACC, 2), X(ARR, IMM, 2), X(JMP, IND, 5), X(ADC, ABS, 4), X(ROR, ABS, 6), X(RRA, ABS, 6),
-    /* 7 */ X(BVS, REL, 2), X(ADC, IDY, 5), X(KIL, IMP, 2), X(RRA, IDY, 8), X(DOP, ZPX, 4), X(ADC, ZPX, 4), X(ROR, ZPX, 6), X(RRA, ZPX, 6), X(SEI, IMP, 2), X(ADC, ABY, 4), X(NOP,     IMP, 2), X(RRA, ABY, 7), X(TOP, ABX, 4), X(ADC, ABX, 4), X(ROR, ABX, 7), X(RRA, ABX, 7),
-
-    /* 8 */ X(DOP, IMM, 2), X(STA, IDX, 6), X(DOP, IMM, 2), X(SAX, IDX, 6), X(STY, ZRP, 3), X(STA, ZRP, 3), X(STX, ZRP, 3), X(SAX, ZRP, 3), X(DEY, IMP, 2), X(DOP, IMM, 2), X(TXA,     IMP, 2), X(XAA, IMM, 2), X(STY, ABS, 4), X(STA, ABS, 4), X(STX, ABS, 4), X(SAX, ABS, 4),
-    /* 9 */ X(BCC, REL, 2), X(STA, IDY, 6), X(KIL, IMP, 2), X(AXA, IDY, 6), X(STY, ZPX, 4), X(STA, ZPX, 4), X(STX, ZPY, 4), X(SAX, ZPY, 4), X(TYA, IMP, 2), X(STA, ABY, 5), X(TXS,     IMP, 2), X(XAS, ABY, 5), X(SYA, ABX, 5), X(STA, ABX, 5), X(SXA, ABY, 5), X(AXA, ABY, 5),
-    /* A */ X(LDY, IMM, 2), X(LDA, IDX, 6), X(LDX, IMM, 2), X(LAX, IDX, 6), X(LDY, ZRP, 3), X(LDA, ZRP, 3), X(LDX, ZRP, 3), X(LAX, ZRP, 3), X(TAY, IMP, 2), X(LDA, IMM, 2), X(TAX,     IMP, 2), X(ATX, IMM, 2), X(LDY, ABS, 4), X(LDA, ABS, 4), X(LDX, ABS, 4), X(LAX, ABS, 4),
-    /* B */ X(BCS, REL, 2), X(LDA, IDY, 5), X(KIL, IMP, 2), X(LAX, IDY, 5), X(LDY, ZPX, 4), X(LDA, ZPX, 4), X(LDX, ZPY, 4), X(LAX, ZPY, 4), X(CLV, IMP, 2), X(LDA, ABY, 4), X(TSX,     IMP, 2), X(LAR, ABY, 4), X(LDY, ABX, 4), X(LDA, ABX, 4), X(LDX, ABY, 4), X(LAX, ABY, 4),
-
-    /* C */ X(CPY, IMM, 2), X(CMP, IDX, 6), X(DOP, IMM, 2), X(DCP, IDX, 8), X(CPY, ZRP, 3), X(CMP, ZRP, 3), X(DEC, ZRP, 5), X(DCP, ZRP, 5), X(INY, IMP, 2), X(CMP, IMM, 2), X(DEX,     IMP, 2), X(AXS, IMM, 2), X(CPY, ABS, 4), X(CMP, ABS, 4), X(DEC, ABS, 6), X(DCP, ABS, 6),
-    /* D */ X(BNE, REL, 2), X(CMP, IDY, 5), X(KIL, IMP, 2), X(DCP, IDY, 8), X(DOP, ZPX, 4), X(CMP, ZPX, 4), X(DEC, ZPX, 6), X(DCP, ZPX, 6), X(CLD, IMP, 2), X(CMP, ABY, 4), X(NOP,     IMP, 2), X(DCP, ABY, 7), X(TOP, ABX, 4), X(CMP, ABX, 4), X(DEC, ABX, 7), X(DCP, ABX, 7),
-    /* E */ X(CPX, IMM, 2), X(SBC, IDX, 6), X(DOP, IMM, 2), X(ISB, IDX, 8), X(CPX, ZRP, 3), X(SBC, ZRP, 3), X(INC, ZRP, 5), X(ISB, ZRP, 5), X(INX, IMP, 2), X(SBC, IMM, 2), X(NOP,     IMP, 2), X(SBC, IMM, 2), X(CPX, ABS, 4), X(SBC, ABS, 4), X(INC, ABS, 6), X(ISB, ABS, 6),
-    /* F */ X(BEQ, REL, 2), X(SBC, IDY, 5), X(KIL, IMP, 2), X(ISB, IDY, 8), X(DOP, ZPX, 4), X(SBC, ZPX, 4), X(INC, ZPX, 6), X(ISB, ZPX, 6), X(SED, IMP, 2), X(SBC, ABY, 4), X(NOP,     IMP, 2), X(ISB, ABY, 7), X(TOP, ABX, 4), X(SBC, ABX, 4), X(INC, ABX, 7), X(ISB, ABX, 7),
+        CPU_INSTRUCTIONS(X)
     };
 #undef X
 
-    int instruction_t::byte_count() const
+    template <cpu_t::addr_mode_fn cpu_t::*addr_mode, cpu_t::opcode_fn cpu_t::*opcode, int cycles, bool fetch>
+    void cpu_t::run(cpu_t& cpu, uint16_t operand)
     {
-        if (addr_mode == &cpu_t::IMP || addr_mode == &cpu_t::ACC)
+        // Immediate operations read their operand themselves
+        constexpr int operand_bytes = addr_mode == &cpu_t::IMM ? 0 : byte_count(addr_mode) - 1;
+        if constexpr (fetch && operand_bytes > 0)
         {
-            return 1;
+            operand = cpu.cpu_bus->read(cpu.pc);
         }
-        else if (addr_mode == &cpu_t::ABS
-              || addr_mode == &cpu_t::ABX
-              || addr_mode == &cpu_t::ABY
-              || addr_mode == &cpu_t::IND)
+        if constexpr (fetch && operand_bytes > 1)
         {
-            return 3;
+            operand |= cpu.cpu_bus->read(cpu.pc + 1) << 8;
         }
-        else
+        cpu.cycles_until_next_instruction = cycles;
+        bool crossed_page = false;
+        uint16_t addr = (cpu.*addr_mode)(operand, crossed_page);
+        (cpu.*opcode)(addr, crossed_page);
+        if constexpr (COUNTERS_ENABLED)
         {
-            return 2;
+            // A taken branch adds a cycle without crossing a page, so only
+            // count the extra cycles when a page was crossed
+            if (crossed_page && cpu.cycles_until_next_instruction > cycles)
+            {
+                cpu.counters.page_cross_penalties++;
+            }
         }
     }
 
+#define X(_op, _opcode, _addr_mode, _cycles) &cpu_t::run<&cpu_t::_addr_mode, &cpu_t::_opcode, _cycles, true>,
+
+    void (*const cpu_t::handlers[256])(cpu_t& cpu, uint16_t operand)
+    {
+        CPU_INSTRUCTIONS(X)
+    };
+#undef X
+
+#define X(_op, _opcode, _addr_mode, _cycles) &cpu_t::run<&cpu_t::_addr_mode, &cpu_t::_opcode, _cycles, false>,
+
+    void (*const cpu_t::decoded_handlers[256])(cpu_t& cpu, uint16_t operand)
+    {
+        CPU_INSTRUCTIONS(X)
+    };
+#undef X
+
     cpu_t::cpu_t(bus_t &cpu_bus)
-        : cpu_bus(&cpu_bus),
-          status{},
+        : status{},
           ra(0),
           rx(0),
           ry(0),
           sp(0xFD),
           pc(0),
-          addr(0),
-          crossed_page(false),
-          cycles_until_next_instruction(0)
+          cycles_until_next_instruction(0),
+          trace(nullptr),
+          cpu_bus(&cpu_bus),
+          counters{}
     {
         status.i = true;
         status.u = true;
@@ -79,10 +132,27 @@ namespace nes
 
     void cpu_t::reset()
     {
+        counters_t counters = this->counters;
+        auto decode_cache = std::move(this->decode_cache);
+        cpu_trace_t* trace = this->trace;
         *this = cpu_t(*cpu_bus);
+        this->counters = counters;
+        this->decode_cache = std::move(decode_cache);
+        this->trace = trace;
         pc = cpu_bus->read(0xFFFC) | (cpu_bus->read(0xFFFD) << 8);
     }
 
+    void cpu_t::serialize(state_t& state)
+    {
+        state.value(status);
+        state.value(ra);
+        state.value(rx);
+        state.value(ry);
+        state.value(sp);
+        state.value(pc);
+        state.value(cycles_until_next_instruction);
+    }
+
     void cpu_t::irq()
     {
         if (!status.i)
@@ -94,6 +164,10 @@ namespace nes
             status.i = true;
             pc = cpu_bus->read(0xFFFE) | (cpu_bus->read(0xFFFF) << 8);
             cycles_until_next_instruction = 7;
+            if constexpr (COUNTERS_ENABLED)
+            {
+                counters.irqs++;
+            }
         }
     }
 
@@ -106,22 +180,156 @@ namespace nes
         status.i = true;
         pc = cpu_bus->read(0xFFFA) | (cpu_bus->read(0xFFFB) << 8);
         cycles_until_next_instruction = 8;
+        if constexpr (COUNTERS_ENABLED)
+        {
+            counters.nmis++;
+        }
     }
 
     void cpu_t::clock()
     {
         if (cycles_until_next_instruction == 0)
         {
-            uint8_t op = cpu_bus->read(pc);
-            pc++;
-            const instruction_t &instruction = instructions[op];
-            cycles_until_next_instruction = instruction.cycles;
-            crossed_page = (this->*instruction.addr_mode)();
-            (this->*instruction.opcode)();
+            if (trace)
+            {
+                trace->record(*this);
+            }
+            const decoded_instruction_t* decoded = decode_cache ? find_decoded() : nullptr;
+            uint8_t op;
+            if (decoded)
+            {
+                op = decoded->op;
+                cpu_bus->set_open_bus(decoded->last_byte);
+                pc++;
+                decoded->execute(*this, decoded->operand);
+            }
+            else
+            {
+                op = cpu_bus->read(pc);
+                pc++;
+#ifdef NES_CPU_SWITCH_DISPATCH
+                execute(op);
+#else
+                handlers[op](*this, 0);
+#endif
+            }
+            if constexpr (COUNTERS_ENABLED)
+            {
+                counters.opcodes[op]++;
+            }
         }
         cycles_until_next_instruction--;
     }
 
+    const cpu_t::counters_t& cpu_t::get_counters() const
+    {
+        return counters;
+    }
+
+    void cpu_t::reset_counters()
+    {
+        counters = {};
+    }
+
+    void cpu_t::set_decode_cache(bool enabled)
+    {
+        if (enabled && !decode_cache)
+        {
+            decode_cache = std::make_unique<decode_cache_t>();
+        }
+        else if (!enabled)
+        {
+            decode_cache.reset();
+        }
+    }
+
+    bool cpu_t::is_decode_cache_enabled() const
+    {
+        return decode_cache != nullptr;
+    }
+
+    void cpu_t::clear_decode_cache()
+    {
+        if (decode_cache)
+        {
+            decode_cache = std::make_unique<decode_cache_t>();
+        }
+    }
+
+    // Returns null if the instruction at pc has to be fetched through the bus
+    const decoded_instruction_t* cpu_t::find_decoded()
+    {
+        decode_cache_t& cache = *decode_cache;
+        if (cache.map_generation != cpu_bus->get_map_generation())
+        {
+            std::ranges::fill(cache.cpu_pages, nullptr);
+            cache.map_generation = cpu_bus->get_map_generation();
+        }
+        decode_cache_t::page_t*& page = cache.cpu_pages[pc / bus_t::PAGE_SIZE];
+        if (!page)
+        {
+            const uint8_t* memory = cpu_bus->get_rom_page(pc);
+            page = memory ? &cache.rom_pages[memory] : &cache.uncached;
+        }
+        if (page == &cache.uncached)
+        {
+            return nullptr;
+        }
+        decoded_instruction_t& decoded = (*page)[pc % bus_t::PAGE_SIZE];
+        if (!decoded.execute)
+        {
+            decode(decoded);
+        }
+        return decoded.execute ? &decoded : nullptr;
+    }
+
+    // Reads without side effects, so the open bus value is left for the
+    // instruction to set
+    void cpu_t::decode(decoded_instruction_t& decoded)
+    {
+        uint8_t op = cpu_bus->read(pc, false);
+        const instruction_t& instruction = instructions[op];
+        int byte_count = instruction.byte_count;
+        // Operands in the next page may come from a different bank
+        if (pc % bus_t::PAGE_SIZE + byte_count > bus_t::PAGE_SIZE)
+        {
+            return;
+        }
+        uint16_t operand = 0;
+        for (int i = 1; i < byte_count; i++)
+        {
+            operand |= cpu_bus->read(pc + i, false) << ((i - 1) * 8);
+        }
+        // The operation reads an immediate operand itself
+        bool fetches_operand = instruction.addr_mode != &cpu_t::IMM;
+        decoded = decoded_instruction_t{
+            .execute = decoded_handlers[op],
+            .operand = operand,
+            .op = op,
+            .last_byte = fetches_operand && byte_count > 1
+                ? (uint8_t)(operand >> ((byte_count - 2) * 8))
+                : op,
+        };
+    }
+
+#ifdef NES_CPU_SWITCH_DISPATCH
+    // Same as dispatching through the handlers table, but each opcode gets
+    // its own case so the handlers are inlined into one function
+    void cpu_t::execute(uint8_t op)
+    {
+        switch (op)
+        {
+#define X(_op, _opcode, _addr_mode, _cycles)                                    \
+        case _op:                                                              \
+            run<&cpu_t::_addr_mode, &cpu_t::_opcode, _cycles, true>(*this, 0); \
+            break;
+
+            CPU_INSTRUCTIONS(X)
+#undef X
+        }
+    }
+#endif
+
     void cpu_t::push_stack(uint8_t value)
     {
         cpu_bus->write(0x0100 + sp, value);
@@ -134,131 +342,127 @@ namespace nes
         return cpu_bus->read(0x0100 + sp);
     }
 
-    // Addressing modes
+    // Addressing modes. operand holds the bytes after the opcode, which have
+    // already been read, so only the pc is advanced past them here.
 
     // Implicit
-    bool cpu_t::IMP()
+    uint16_t cpu_t::IMP(uint16_t operand, bool& crossed_page)
     {
-        return false;
+        return 0;
     }
 
     // Immediate
     // addr = pc
-    bool cpu_t::IMM()
+    uint16_t cpu_t::IMM(uint16_t operand, bool& crossed_page)
     {
-        addr = pc;
+        uint16_t addr = pc;
         pc++;
-        return false;
+        return addr;
     }
 
     // Absolute
     // addr = [pc]
-    bool cpu_t::ABS()
+    uint16_t cpu_t::ABS(uint16_t operand, bool& crossed_page)
     {
-        addr = cpu_bus->read(pc) | (cpu_bus->read(pc + 1) << 8);
         pc += 2;
-        return false;
+        return operand;
     }
 
     // X-indexed absolute
     // addr = [pc] + rx
-    bool cpu_t::ABX()
+    uint16_t cpu_t::ABX(uint16_t operand, bool& crossed_page)
     {
-        uint16_t tmp_addr = cpu_bus->read(pc) | (cpu_bus->read(pc + 1) << 8);
-        addr = tmp_addr + rx;
+        uint16_t addr = operand + rx;
         pc += 2;
-        return page_differs(tmp_addr, addr);
+        crossed_page = page_differs(operand, addr);
+        return addr;
     }
 
     // Y-indexed absolute
     // addr = [pc] + ry
-    bool cpu_t::ABY()
+    uint16_t cpu_t::ABY(uint16_t operand, bool& crossed_page)
     {
-        uint16_t tmp_addr = cpu_bus->read(pc) | (cpu_bus->read(pc + 1) << 8);
-        addr = tmp_addr + ry;
+        uint16_t addr = operand + ry;
         pc += 2;
-        return page_differs(tmp_addr, addr);
+        crossed_page = page_differs(operand, addr);
+        return addr;
     }
 
     // Zero page
     // addr = [pc] & 0xFF
-    bool cpu_t::ZRP()
+    uint16_t cpu_t::ZRP(uint16_t operand, bool& crossed_page)
     {
-        addr = cpu_bus->read(pc);
         pc++;
-        return false;
+        return operand;
     }
 
     // X-indexed zero page
     // addr = ([pc] + rx) & 0xFF
-    bool cpu_t::ZPX()
+    uint16_t cpu_t::ZPX(uint16_t operand, bool& crossed_page)
     {
-        addr = (cpu_bus->read(pc) + rx) & 0xFF;
         pc++;
-        return false;
+        return (operand + rx) & 0xFF;
     }
 
     // Y-indexed zero page
     // addr = ([pc] + ry) & 0xFF
-    bool cpu_t::ZPY()
+    uint16_t cpu_t::ZPY(uint16_t operand, bool& crossed_page)
     {
-        addr = (cpu_bus->read(pc) + ry) & 0xFF;
         pc++;
-        return false;
+        return (operand + ry) & 0xFF;
     }
 
     // Accumulator
-    bool cpu_t::ACC()
+    uint16_t cpu_t::ACC(uint16_t operand, bool& crossed_page)
     {
-        return false;
+        return 0;
     }
 
     // Relative (for branches)
     // addr = (signed [pc] & 0xFF) + pc + 1
-    bool cpu_t::REL()
+    uint16_t cpu_t::REL(uint16_t operand, bool& crossed_page)
     {
-        addr = (int8_t)cpu_bus->read(pc) + pc + 1;
+        uint16_t addr = (int8_t)operand + pc + 1;
         pc++;
-        return page_differs(pc + 1, addr);
+        crossed_page = page_differs(pc + 1, addr);
+        return addr;
     }
 
     // Indexed indirect
     // data = [([pc] + rx) & 0xFF]
-    bool cpu_t::IDX()
+    uint16_t cpu_t::IDX(uint16_t operand, bool& crossed_page)
     {
-        uint8_t zrp_addr = cpu_bus->read(pc) + rx;
+        uint8_t zrp_addr = (uint8_t)operand + rx;
         pc++;
-        addr = cpu_bus->read(zrp_addr) |
+        return cpu_bus->read(zrp_addr) |
                (cpu_bus->read((zrp_addr + 1) & 0xFF) << 8);
-        return false;
     }
 
     // Indirect indexed
     // data = [[pc] & 0xFF] + ry
-    bool cpu_t::IDY()
+    uint16_t cpu_t::IDY(uint16_t operand, bool& crossed_page)
     {
-        uint8_t zrp_addr = cpu_bus->read(pc);
+        uint8_t zrp_addr = (uint8_t)operand;
         pc++;
         uint16_t tmp_addr = cpu_bus->read(zrp_addr) |
                       (cpu_bus->read((zrp_addr + 1) & 0xFF) << 8);
-        addr = tmp_addr + ry;
-        return page_differs(tmp_addr, addr);
+        uint16_t addr = tmp_addr + ry;
+        crossed_page = page_differs(tmp_addr, addr);
+        return addr;
     }
 
     // Indirect (for JMP)
     // addr = [[pc]]
-    bool cpu_t::IND()
+    uint16_t cpu_t::IND(uint16_t operand, bool& crossed_page)
     {
-        addr = cpu_bus->read(pc) | (cpu_bus->read(pc + 1) << 8);
-        addr = cpu_bus->read(addr) |
-               (cpu_bus->read(((addr + 1) & 0xFF) | (addr & 0xFF00)) << 8);
-        return false;
+        return cpu_bus->read(operand) |
+               (cpu_bus->read(((operand + 1) & 0xFF) | (operand & 0xFF00)) << 8);
     }
 
     // Opcodes
 
     // Add with carry
-    void cpu_t::ADC()
+    void cpu_t::ADC(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint16_t res16 = ra + data + status.c;
@@ -272,7 +476,7 @@ namespace nes
     }
 
     // Bitwise AND
-    void cpu_t::AND()
+    void cpu_t::AND(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra &= data;
@@ -282,7 +486,7 @@ namespace nes
     }
 
     // Arithmetic shift left (memory)
-    void cpu_t::ASL()
+    void cpu_t::ASL(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = data << 1;
@@ -293,7 +497,7 @@ namespace nes
     }
 
     // Arithmetic shift left (accumulator)
-    void cpu_t::ASL_ACC()
+    void cpu_t::ASL_ACC(uint16_t addr, bool crossed_page)
     {
         bool carry = ra & 0x80;
         ra <<= 1;
@@ -303,7 +507,7 @@ namespace nes
     }
 
     // Branch if carry clear
-    void cpu_t::BCC()
+    void cpu_t::BCC(uint16_t addr, bool crossed_page)
     {
         if (!status.c)
         {
@@ -313,7 +517,7 @@ namespace nes
     }
 
     // Branch if carry set
-    void cpu_t::BCS()
+    void cpu_t::BCS(uint16_t addr, bool crossed_page)
     {
         if (status.c)
         {
@@ -323,7 +527,7 @@ namespace nes
     }
 
     // Branch if equal
-    void cpu_t::BEQ()
+    void cpu_t::BEQ(uint16_t addr, bool crossed_page)
     {
         if (status.z)
         {
@@ -333,7 +537,7 @@ namespace nes
     }
 
     // Bit test
-    void cpu_t::BIT()
+    void cpu_t::BIT(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         status.z = (data & ra) == 0;
@@ -342,7 +546,7 @@ namespace nes
     }
 
     // Branch if minus
-    void cpu_t::BMI()
+    void cpu_t::BMI(uint16_t addr, bool crossed_page)
     {
         if (status.n)
         {
@@ -352,7 +556,7 @@ namespace nes
     }
 
     // Branch if not equal
-    void cpu_t::BNE()
+    void cpu_t::BNE(uint16_t addr, bool crossed_page)
     {
         if (!status.z)
         {
@@ -362,7 +566,7 @@ namespace nes
     }
 
     // Branch if plus
-    void cpu_t::BPL()
+    void cpu_t::BPL(uint16_t addr, bool crossed_page)
     {
         if (!status.n)
         {
@@ -372,7 +576,7 @@ namespace nes
     }
 
     // Break (software IRQ)
-    void cpu_t::BRK()
+    void cpu_t::BRK(uint16_t addr, bool crossed_page)
     {
         push_stack((uint8_t)(pc >> 8));
         push_stack((uint8_t)pc);
@@ -383,7 +587,7 @@ namespace nes
     }
 
     // Branch if overflow clear
-    void cpu_t::BVC()
+    void cpu_t::BVC(uint16_t addr, bool crossed_page)
     {
         if (!status.v)
         {
@@ -393,7 +597,7 @@ namespace nes
     }
 
     // Branch if overflow set
-    void cpu_t::BVS()
+    void cpu_t::BVS(uint16_t addr, bool crossed_page)
     {
         if (status.v)
         {
@@ -403,31 +607,31 @@ namespace nes
     }
 
     // Clear carry
-    void cpu_t::CLC()
+    void cpu_t::CLC(uint16_t addr, bool crossed_page)
     {
         status.c = false;
     }
 
     // Clear decimal
-    void cpu_t::CLD()
+    void cpu_t::CLD(uint16_t addr, bool crossed_page)
     {
         status.d = false;
     }
 
     // Clear interrupt disable
-    void cpu_t::CLI()
+    void cpu_t::CLI(uint16_t addr, bool crossed_page)
     {
         status.i = false;
     }
 
     // Clear overflow
-    void cpu_t::CLV()
+    void cpu_t::CLV(uint16_t addr, bool crossed_page)
     {
         status.v = false;
     }
 
     // Compare A
-    void cpu_t::CMP()
+    void cpu_t::CMP(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = ra - data;
@@ -438,7 +642,7 @@ namespace nes
     }
 
     // Compare X
-    void cpu_t::CPX()
+    void cpu_t::CPX(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = rx - data;
@@ -448,7 +652,7 @@ namespace nes
     }
 
     // Compare Y
-    void cpu_t::CPY()
+    void cpu_t::CPY(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = ry - data;
@@ -458,7 +662,7 @@ namespace nes
     }
 
     // Decrement memory
-    void cpu_t::DEC()
+    void cpu_t::DEC(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = data - 1;
@@ -468,7 +672,7 @@ namespace nes
     }
 
     // Decrement X
-    void cpu_t::DEX()
+    void cpu_t::DEX(uint16_t addr, bool crossed_page)
     {
         rx--;
         status.n = rx & 0x80;
@@ -476,7 +680,7 @@ namespace nes
     }
 
     // Decrement Y
-    void cpu_t::DEY()
+    void cpu_t::DEY(uint16_t addr, bool crossed_page)
     {
         ry--;
         status.n = ry & 0x80;
@@ -484,7 +688,7 @@ namespace nes
     }
 
     // Bitwise exclusive OR
-    void cpu_t::EOR()
+    void cpu_t::EOR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra ^= data;
@@ -494,7 +698,7 @@ namespace nes
     }
 
     // Increment memory
-    void cpu_t::INC()
+    void cpu_t::INC(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = data + 1;
@@ -504,7 +708,7 @@ namespace nes
     }
 
     // Increment X
-    void cpu_t::INX()
+    void cpu_t::INX(uint16_t addr, bool crossed_page)
     {
         rx++;
         status.n = rx & 0x80;
@@ -512,7 +716,7 @@ namespace nes
     }
 
     // Increment Y
-    void cpu_t::INY()
+    void cpu_t::INY(uint16_t addr, bool crossed_page)
     {
         ry++;
         status.n = ry & 0x80;
@@ -520,13 +724,13 @@ namespace nes
     }
 
     // Jump
-    void cpu_t::JMP()
+    void cpu_t::JMP(uint16_t addr, bool crossed_page)
     {
         pc = addr;
     }
 
     // Jump to subroutine
-    void cpu_t::JSR()
+    void cpu_t::JSR(uint16_t addr, bool crossed_page)
     {
         uint16_t prev_addr = pc - 1;
         push_stack((uint8_t)(prev_addr >> 8));
@@ -535,7 +739,7 @@ namespace nes
     }
 
     // Load A
-    void cpu_t::LDA()
+    void cpu_t::LDA(uint16_t addr, bool crossed_page)
     {
         ra = cpu_bus->read(addr);
         status.z = ra == 0;
@@ -544,7 +748,7 @@ namespace nes
     }
 
     // Load X
-    void cpu_t::LDX()
+    void cpu_t::LDX(uint16_t addr, bool crossed_page)
     {
         rx = cpu_bus->read(addr);
         status.z = rx == 0;
@@ -553,7 +757,7 @@ namespace nes
     }
 
     // Load Y
-    void cpu_t::LDY()
+    void cpu_t::LDY(uint16_t addr, bool crossed_page)
     {
         ry = cpu_bus->read(addr);
         status.z = ry == 0;
@@ -562,7 +766,7 @@ namespace nes
     }
 
     // Logical shift left (memory)
-    void cpu_t::LSR()
+    void cpu_t::LSR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = data >> 1;
@@ -573,7 +777,7 @@ namespace nes
     }
 
     // Logical shift right (accumulator)
-    void cpu_t::LSR_ACC()
+    void cpu_t::LSR_ACC(uint16_t addr, bool crossed_page)
     {
         bool carry = ra & 0x01;
         ra >>= 1;
@@ -583,12 +787,12 @@ namespace nes
     }
 
     // No operation
-    void cpu_t::NOP()
+    void cpu_t::NOP(uint16_t addr, bool crossed_page)
     {
     }
 
     // Bitwise OR
-    void cpu_t::ORA()
+    void cpu_t::ORA(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra |= data;
@@ -598,20 +802,20 @@ namespace nes
     }
 
     // Push A
-    void cpu_t::PHA()
+    void cpu_t::PHA(uint16_t addr, bool crossed_page)
     {
         push_stack(ra);
     }
 
     // Push processor status
-    void cpu_t::PHP()
+    void cpu_t::PHP(uint16_t addr, bool crossed_page)
     {
         status.b = true;
         push_stack(status.reg);
     }
 
     // Pull A
-    void cpu_t::PLA()
+    void cpu_t::PLA(uint16_t addr, bool crossed_page)
     {
         ra = pop_stack();
         status.z = ra == 0;
@@ -619,14 +823,14 @@ namespace nes
     }
 
     // Pull processor status
-    void cpu_t::PLP()
+    void cpu_t::PLP(uint16_t addr, bool crossed_page)
     {
         status.reg = pop_stack();
         status.u = true;
     }
 
     // Rotate left (memory)
-    void cpu_t::ROL()
+    void cpu_t::ROL(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = (data << 1) | (uint8_t)status.c;
@@ -637,7 +841,7 @@ namespace nes
     }
 
     // Rotate left (accumulator)
-    void cpu_t::ROL_ACC()
+    void cpu_t::ROL_ACC(uint16_t addr, bool crossed_page)
     {
         bool carry = ra & 0x80;
         ra = (ra << 1) | (uint8_t)status.c;
@@ -647,7 +851,7 @@ namespace nes
     }
 
     // Rotate right (memory)
-    void cpu_t::ROR()
+    void cpu_t::ROR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         uint8_t res = (data >> 1) | (status.c << 7);
@@ -658,7 +862,7 @@ namespace nes
     }
 
     // Rotate right (accumulator)
-    void cpu_t::ROR_ACC()
+    void cpu_t::ROR_ACC(uint16_t addr, bool crossed_page)
     {
         bool carry = ra & 0x01;
         ra = (ra >> 1) | (status.c << 7);
@@ -668,7 +872,7 @@ namespace nes
     }
 
     // Return from interrupt
-    void cpu_t::RTI()
+    void cpu_t::RTI(uint16_t addr, bool crossed_page)
     {
         status.reg = pop_stack();
         status.u = true;
@@ -677,7 +881,7 @@ namespace nes
     }
 
     // Return from subroutine
-    void cpu_t::RTS()
+    void cpu_t::RTS(uint16_t addr, bool crossed_page)
     {
         pc = pop_stack();
         pc |= pop_stack() << 8;
@@ -685,7 +889,7 @@ namespace nes
     }
 
     // Subtract with carry
-    void cpu_t::SBC()
+    void cpu_t::SBC(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         data = ~data;
@@ -700,43 +904,43 @@ namespace nes
     }
 
     // Set carry
-    void cpu_t::SEC()
+    void cpu_t::SEC(uint16_t addr, bool crossed_page)
     {
         status.c = true;
     }
 
     // Set decimal
-    void cpu_t::SED()
+    void cpu_t::SED(uint16_t addr, bool crossed_page)
     {
         status.d = true;
     }
 
     // Set interrupt disable
-    void cpu_t::SEI()
+    void cpu_t::SEI(uint16_t addr, bool crossed_page)
     {
         status.i = true;
     }
 
     // Store A
-    void cpu_t::STA()
+    void cpu_t::STA(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, ra);
     }
 
     // Store X
-    void cpu_t::STX()
+    void cpu_t::STX(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, rx);
     }
 
     // Store Y
-    void cpu_t::STY()
+    void cpu_t::STY(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, ry);
     }
 
     // Transfer A to X
-    void cpu_t::TAX()
+    void cpu_t::TAX(uint16_t addr, bool crossed_page)
     {
         rx = ra;
         status.n = rx & 0x80;
@@ -744,7 +948,7 @@ namespace nes
     }
 
     // Transfer A to Y
-    void cpu_t::TAY()
+    void cpu_t::TAY(uint16_t addr, bool crossed_page)
     {
         ry = ra;
         status.n = ry & 0x80;
@@ -752,7 +956,7 @@ namespace nes
     }
 
     // Transfer stack pointer to X
-    void cpu_t::TSX()
+    void cpu_t::TSX(uint16_t addr, bool crossed_page)
     {
         rx = sp;
         status.n = rx & 0x80;
@@ -760,7 +964,7 @@ namespace nes
     }
 
     // Transfer X to A
-    void cpu_t::TXA()
+    void cpu_t::TXA(uint16_t addr, bool crossed_page)
     {
         ra = rx;
         status.n = ra & 0x80;
@@ -768,13 +972,13 @@ namespace nes
     }
 
     // Transfer X to stack pointer
-    void cpu_t::TXS()
+    void cpu_t::TXS(uint16_t addr, bool crossed_page)
     {
         sp = rx;
     }
 
     // Transfer Y to A
-    void cpu_t::TYA()
+    void cpu_t::TYA(uint16_t addr, bool crossed_page)
     {
         ra = ry;
         status.n = ra & 0x80;
@@ -783,18 +987,18 @@ namespace nes
 
     // Illegal opcodes
 
-    void cpu_t::AAC()
+    void cpu_t::AAC(uint16_t addr, bool crossed_page)
     {
-        AND();
+        AND(addr, crossed_page);
         status.c = status.z;
     }
 
-    void cpu_t::SAX()
+    void cpu_t::SAX(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, rx & ra);
     }
 
-    void cpu_t::ARR()
+    void cpu_t::ARR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra &= data;
@@ -807,7 +1011,7 @@ namespace nes
         status.v = b5 ^ b6;
     }
 
-    void cpu_t::ASR()
+    void cpu_t::ASR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra &= data;
@@ -817,7 +1021,7 @@ namespace nes
         status.z = ra == 0;
     }
 
-    void cpu_t::ATX()
+    void cpu_t::ATX(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra &= data;
@@ -826,12 +1030,12 @@ namespace nes
         status.z = rx == 0;
     }
 
-    void cpu_t::AXA()
+    void cpu_t::AXA(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, ra & rx & 7);
     }
 
-    void cpu_t::AXS()
+    void cpu_t::AXS(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         rx &= ra;
@@ -841,29 +1045,29 @@ namespace nes
         status.z = rx == 0;
     }
 
-    void cpu_t::DCP()
+    void cpu_t::DCP(uint16_t addr, bool crossed_page)
     {
-        DEC();
-        CMP();
+        DEC(addr, crossed_page);
+        CMP(addr, crossed_page);
     }
 
-    void cpu_t::DOP()
+    void cpu_t::DOP(uint16_t addr, bool crossed_page)
     {
     }
 
-    void cpu_t::ISB()
+    void cpu_t::ISB(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr) + 1;
         cpu_bus->write(addr, data);
-        SBC();
+        SBC(addr, crossed_page);
     }
 
-    void cpu_t::KIL()
+    void cpu_t::KIL(uint16_t addr, bool crossed_page)
     {
         pc--;
     }
 
-    void cpu_t::LAR()
+    void cpu_t::LAR(uint16_t addr, bool crossed_page)
     {
         uint8_t data = cpu_bus->read(addr);
         ra = rx = sp &= data;
@@ -871,59 +1075,59 @@ namespace nes
         status.z = ra == 0;
     }
 
-    void cpu_t::LAX()
+    void cpu_t::LAX(uint16_t addr, bool crossed_page)
     {
         ra = rx = cpu_bus->read(addr);
         status.n = ra & 0x80;
         status.z = ra == 0;
     }
 
-    void cpu_t::RLA()
+    void cpu_t::RLA(uint16_t addr, bool crossed_page)
     {
-        ROL();
-        AND();
+        ROL(addr, crossed_page);
+        AND(addr, crossed_page);
     }
 
-    void cpu_t::RRA()
+    void cpu_t::RRA(uint16_t addr, bool crossed_page)
     {
-        ROR();
-        ADC();
+        ROR(addr, crossed_page);
+        ADC(addr, crossed_page);
     }
 
-    void cpu_t::SLO()
+    void cpu_t::SLO(uint16_t addr, bool crossed_page)
     {
-        ASL();
-        ORA();
+        ASL(addr, crossed_page);
+        ORA(addr, crossed_page);
     }
 
-    void cpu_t::SRE()
+    void cpu_t::SRE(uint16_t addr, bool crossed_page)
     {
-        LSR();
-        EOR();
+        LSR(addr, crossed_page);
+        EOR(addr, crossed_page);
     }
 
-    void cpu_t::SXA()
+    void cpu_t::SXA(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, ((addr >> 8) & rx) + 1);
     }
 
-    void cpu_t::SYA()
+    void cpu_t::SYA(uint16_t addr, bool crossed_page)
     {
         cpu_bus->write(addr, ((addr >> 8) & ry) + 1);
     }
 
-    void cpu_t::TOP()
+    void cpu_t::TOP(uint16_t addr, bool crossed_page)
     {
     }
 
-    void cpu_t::XAA()
+    void cpu_t::XAA(uint16_t addr, bool crossed_page)
     {
         // Unpredictable
         uint8_t data = cpu_bus->read(addr);
         ra &= rx & data;
     }
 
-    void cpu_t::XAS()
+    void cpu_t::XAS(uint16_t addr, bool crossed_page)
     {
         sp = rx & ra;
         cpu_bus->write(addr, ((addr >> 8) & rx) + 1);
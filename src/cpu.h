@@ -2,24 +2,59 @@
 #include "pch.h"
 #include "bus.h"
 
+#include <array>
+#include <memory>
+#include <unordered_map>
+
 namespace nes
 {
     struct cpu_t;
+    struct cpu_trace_t;
 
+    // What the instruction table says about an opcode. The interpreter runs
+    // handlers generated from the same table, so the operation and
+    // addressing mode here identify the instruction rather than run it.
     struct instruction_t
     {
-        void (cpu_t::*opcode)(void);
-        bool (cpu_t::*addr_mode)(void);
+        void (cpu_t::*opcode)(uint16_t addr, bool crossed_page);
+        uint16_t (cpu_t::*addr_mode)(uint16_t operand, bool& crossed_page);
         int cycles;
+        int byte_count;
         char opcode_name[4];
         char addr_mode_name[4];
-        int byte_count() const;
+    };
+
+    // An instruction with its operand bytes already fetched, ready to run
+    // without going through the bus or the opcode dispatch
+    struct decoded_instruction_t
+    {
+        void (*execute)(cpu_t& cpu, uint16_t operand);
+        uint16_t operand;
+        uint8_t op;
+        uint8_t last_byte; // Last byte the bus would have fetched
+    };
+
+    // Decoded instructions for each page of PRG ROM seen so far, keyed by
+    // the ROM itself so that bank switching never makes an entry stale.
+    // Code in RAM is not cached, so writes never need to invalidate it.
+    struct decode_cache_t
+    {
+        using page_t = std::array<decoded_instruction_t, bus_t::PAGE_SIZE>;
+
+        std::unordered_map<const uint8_t*, page_t> rom_pages;
+        // Decoded pages by CPU page for the current memory map, or null if
+        // not looked up since the map last changed
+        page_t* cpu_pages[0x10000 / bus_t::PAGE_SIZE];
+        // Stands in for pages that aren't ROM
+        page_t uncached;
+        uint32_t map_generation;
     };
 
     struct cpu_t
     {
         cpu_t(bus_t& cpu_bus);
         void reset();
+        void serialize(state_t& state);
         void irq();
         void nmi();
         void clock();
@@ -51,8 +86,11 @@ namespace nes
         void push_stack(uint8_t value);
         uint8_t pop_stack();
 
-        using addr_mode_fn = bool(void);
-        using opcode_fn = void(void);
+        // Addressing modes work out the effective address from the bytes
+        // after the opcode, and operations run on it. The page crossing the
+        // mode reports is the operation's to turn into extra cycles.
+        using addr_mode_fn = uint16_t(uint16_t operand, bool& crossed_page);
+        using opcode_fn = void(uint16_t addr, bool crossed_page);
 
         addr_mode_fn IMP, IMM, ACC;
         addr_mode_fn ABS, ABX, ABY;
@@ -71,9 +109,49 @@ namespace nes
         opcode_fn LAR, LAX, RLA, RRA, SLO, SRE, SXA, SYA, TOP, XAA, XAS;
 
         int cycles_until_next_instruction;
+
+        // Set by nes_t::set_cpu_trace(), null when not tracing. Kept across
+        // reset().
+        cpu_trace_t* trace;
+
+        // Counted since the last reset_counters() and kept across reset().
+        // Always zero unless COUNTERS_ENABLED
+        struct counters_t
+        {
+            uint64_t opcodes[256];
+            uint64_t page_cross_penalties;
+            uint64_t nmis;
+            uint64_t irqs;
+        };
+
+        const counters_t& get_counters() const;
+        void reset_counters();
+
+        // Runs instructions in ROM from a cache of decoded instructions
+        // instead of fetching and decoding them each time. Kept across
+        // reset(), but must be cleared when the ROM changes.
+        void set_decode_cache(bool enabled);
+        bool is_decode_cache_enabled() const;
+        void clear_decode_cache();
     private:
+        friend struct jit_t;
+
+#ifdef NES_CPU_SWITCH_DISPATCH
+        void execute(uint8_t op);
+#endif
+        const decoded_instruction_t* find_decoded();
+        void decode(decoded_instruction_t& decoded);
+
+        // One opcode with its addressing mode and operation inlined. Fetches
+        // the operand through the bus, or takes it from a decoded instruction
+        template <addr_mode_fn cpu_t::*addr_mode, opcode_fn cpu_t::*opcode, int cycles, bool fetch>
+        static void run(cpu_t& cpu, uint16_t operand);
+
+        static void (*const handlers[256])(cpu_t& cpu, uint16_t operand);
+        static void (*const decoded_handlers[256])(cpu_t& cpu, uint16_t operand);
+
         bus_t* cpu_bus;
-        uint16_t addr;
-        bool crossed_page;
+        counters_t counters;
+        std::unique_ptr<decode_cache_t> decode_cache;
     };
 }
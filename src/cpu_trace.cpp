@@ -0,0 +1,370 @@
+#include "pch.h"
+#include "cpu_trace.h"
+#include "nes.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace nes
+{
+    // The file grows by at least this much at a time
+    static constexpr size_t FILE_GROWTH = 64 * 1024 * 1024;
+
+    std::string format_nestest(const cpu_trace_record_t& record)
+    {
+        const instruction_t& instruction = cpu_t::instructions[record.bytes[0]];
+        std::string name = instruction.opcode_name;
+        // nestest marks unofficial opcodes, including the extra NOPs and SBC
+        static constexpr std::string_view OFFICIAL[] = {
+            "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE", "BPL", "BRK", "BVC", "BVS", "CLC",
+            "CLD", "CLI", "CLV", "CMP", "CPX", "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP",
+            "JSR", "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PHP", "PLA", "PLP", "ROL", "ROR", "RTI",
+            "RTS", "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY", "TAX", "TAY", "TSX", "TXA", "TXS", "TYA",
+        };
+        bool official = std::ranges::find(OFFICIAL, name) != std::end(OFFICIAL)
+            && (record.bytes[0] == 0xEA || name != "NOP")
+            && record.bytes[0] != 0xEB;
+        if (name == "DOP" || name == "TOP")
+        {
+            name = "NOP";
+        }
+
+        uint8_t lo = record.bytes[1];
+        uint16_t word = record.bytes[1] | (record.bytes[2] << 8);
+        std::string operand;
+        auto mode = instruction.addr_mode;
+        if (mode == &cpu_t::ACC)
+        {
+            operand = "A";
+        }
+        else if (mode == &cpu_t::IMM)
+        {
+            operand = fmt::format("#${:02X}", lo);
+        }
+        else if (mode == &cpu_t::ZRP)
+        {
+            operand = fmt::format("${:02X}", lo);
+        }
+        else if (mode == &cpu_t::ZPX)
+        {
+            operand = fmt::format("${:02X},X", lo);
+        }
+        else if (mode == &cpu_t::ZPY)
+        {
+            operand = fmt::format("${:02X},Y", lo);
+        }
+        else if (mode == &cpu_t::ABS)
+        {
+            operand = fmt::format("${:04X}", word);
+        }
+        else if (mode == &cpu_t::ABX)
+        {
+            operand = fmt::format("${:04X},X", word);
+        }
+        else if (mode == &cpu_t::ABY)
+        {
+            operand = fmt::format("${:04X},Y", word);
+        }
+        else if (mode == &cpu_t::IND)
+        {
+            operand = fmt::format("(${:04X})", word);
+        }
+        else if (mode == &cpu_t::IDX)
+        {
+            operand = fmt::format("(${:02X},X)", lo);
+        }
+        else if (mode == &cpu_t::IDY)
+        {
+            operand = fmt::format("(${:02X}),Y", lo);
+        }
+        else if (mode == &cpu_t::REL)
+        {
+            operand = fmt::format("${:04X}", (uint16_t)(record.pc + 2 + (int8_t)lo));
+        }
+
+        std::string bytes;
+        for (int i = 0; i < instruction.byte_count; i++)
+        {
+            bytes += fmt::format("{:02X} ", record.bytes[i]);
+        }
+        std::string disassembly = operand.empty() ? name : name + " " + operand;
+        return fmt::format("{:04X}  {:<9}{}{:<32}A:{:02X} X:{:02X} Y:{:02X} P:{:02X} SP:{:02X} PPU:{:3},{:3} CYC:{}",
+            record.pc, bytes, official ? ' ' : '*', disassembly,
+            record.a, record.x, record.y, record.p, record.sp,
+            record.scanline, record.dot, record.cycle / 3);
+    }
+
+    cpu_trace_t::cpu_trace_t(size_t capacity)
+        : dropped(0),
+          records(std::bit_ceil(std::max<size_t>(capacity, 1))),
+          mask(records.size() - 1),
+          head(0),
+          tail(0),
+          nes(nullptr)
+    {
+    }
+
+    void cpu_trace_t::record(const cpu_t& cpu)
+    {
+        if (nes->ppu_catch_up)
+        {
+            nes->sync_ppu();
+        }
+        uint64_t index = head.load(std::memory_order_relaxed);
+        // Keeps the writes below from becoming visible before the store of
+        // head that published the previous record. Pairs with the acquire
+        // fence in drain(), so a drain that copied any part of this record
+        // also sees head at index and discards it.
+        std::atomic_thread_fence(std::memory_order_release);
+        cpu_trace_record_t& record = records[index & mask];
+        record.cycle = nes->scheduler.time;
+        record.pc = cpu.pc;
+        record.scanline = (uint16_t)nes->ppu.scanline;
+        record.dot = (uint16_t)nes->ppu.dot;
+        record.bytes[0] = nes->cpu_bus.read(cpu.pc, false);
+        int byte_count = cpu_t::instructions[record.bytes[0]].byte_count;
+        for (int i = 1; i < 3; i++)
+        {
+            record.bytes[i] = i < byte_count ? nes->cpu_bus.read(cpu.pc + i, false) : 0;
+        }
+        record.a = cpu.ra;
+        record.x = cpu.rx;
+        record.y = cpu.ry;
+        record.p = cpu.status.reg;
+        record.sp = cpu.sp;
+        record.unused[0] = 0;
+        record.unused[1] = 0;
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    uint64_t cpu_trace_t::recorded() const
+    {
+        return head.load(std::memory_order_relaxed);
+    }
+
+    void cpu_trace_t::recent(size_t count, std::vector<cpu_trace_record_t>& out) const
+    {
+        uint64_t end = head.load(std::memory_order_relaxed);
+        count = (size_t)std::min<uint64_t>({ count, end, records.size() });
+        out.clear();
+        for (uint64_t i = end - count; i < end; i++)
+        {
+            out.push_back(records[i & mask]);
+        }
+    }
+
+    size_t cpu_trace_t::drain(cpu_trace_file_t& file)
+    {
+        uint64_t end = head.load(std::memory_order_acquire);
+        if (end - tail > records.size())
+        {
+            dropped.fetch_add(end - records.size() - tail, std::memory_order_relaxed);
+            tail = end - records.size();
+        }
+        size_t count = (size_t)(end - tail);
+        cpu_trace_record_t* out = file.reserve(count);
+        if (count == 0 || !out)
+        {
+            return 0;
+        }
+        // At most two spans, split where the ring wraps
+        size_t first = std::min(count, (size_t)(records.size() - (tail & mask)));
+        memcpy(out, &records[tail & mask], first * sizeof(cpu_trace_record_t));
+        memcpy(out + first, records.data(), (count - first) * sizeof(cpu_trace_record_t));
+
+        // The oldest records may have been overwritten while they were
+        // copied, including the one being written now
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = head.load(std::memory_order_relaxed);
+        if (now + 1 > tail + records.size())
+        {
+            size_t lost = (size_t)std::min<uint64_t>(now + 1 - records.size() - tail, count);
+            memmove(out, out + lost, (count - lost) * sizeof(cpu_trace_record_t));
+            dropped.fetch_add(lost, std::memory_order_relaxed);
+            count -= lost;
+        }
+        file.commit(count);
+        tail = end;
+        return count;
+    }
+
+#ifdef _WIN32
+    cpu_trace_file_t::cpu_trace_file_t()
+        : file(INVALID_HANDLE_VALUE),
+          mapping(nullptr),
+          memory(nullptr),
+          mapped_size(0)
+    {
+    }
+#else
+    cpu_trace_file_t::cpu_trace_file_t()
+        : file(-1),
+          memory(nullptr),
+          mapped_size(0)
+    {
+    }
+#endif
+
+    cpu_trace_file_t::~cpu_trace_file_t()
+    {
+        close();
+    }
+
+    bool cpu_trace_file_t::open(const char* path)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+#else
+        file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+        {
+            return false;
+        }
+#endif
+        if (!map(FILE_GROWTH))
+        {
+            close();
+            return false;
+        }
+        header_t& header = *(header_t*)memory;
+        header = header_t{
+            .magic = MAGIC,
+            .version = VERSION,
+            .record_size = sizeof(cpu_trace_record_t),
+            .unused = 0,
+            .count = 0,
+        };
+        return true;
+    }
+
+    void cpu_trace_file_t::close()
+    {
+        size_t size = sizeof(header_t) + count() * sizeof(cpu_trace_record_t);
+        unmap();
+#ifdef _WIN32
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            LARGE_INTEGER end;
+            end.QuadPart = (LONGLONG)size;
+            SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+            SetEndOfFile(file);
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (file >= 0)
+        {
+            if (ftruncate(file, (off_t)size) != 0)
+            {
+                SPDLOG_ERROR("Failed to trim CPU trace file");
+            }
+            ::close(file);
+            file = -1;
+        }
+#endif
+    }
+
+    bool cpu_trace_file_t::is_open() const
+    {
+        return memory != nullptr;
+    }
+
+    uint64_t cpu_trace_file_t::count() const
+    {
+        return memory ? ((const header_t*)memory)->count : 0;
+    }
+
+    cpu_trace_record_t* cpu_trace_file_t::reserve(size_t count)
+    {
+        if (!memory)
+        {
+            return nullptr;
+        }
+        size_t used = sizeof(header_t) + this->count() * sizeof(cpu_trace_record_t);
+        size_t needed = used + count * sizeof(cpu_trace_record_t);
+        if (needed > mapped_size && !map(std::max(needed, mapped_size + FILE_GROWTH)))
+        {
+            return nullptr;
+        }
+        return (cpu_trace_record_t*)(memory + used);
+    }
+
+    void cpu_trace_file_t::commit(size_t count)
+    {
+        ((header_t*)memory)->count += count;
+    }
+
+    // Maps the first size bytes of the file, growing it to that size. On
+    // success the old mapping is dropped, so pointers into it are no longer
+    // valid. On failure it is kept.
+    bool cpu_trace_file_t::map(size_t size)
+    {
+        uint8_t* new_memory = nullptr;
+#ifdef _WIN32
+        HANDLE new_mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+        if (new_mapping)
+        {
+            new_memory = (uint8_t*)MapViewOfFile(new_mapping, FILE_MAP_WRITE, 0, 0, size);
+            if (!new_memory)
+            {
+                CloseHandle(new_mapping);
+            }
+        }
+#else
+        if (ftruncate(file, (off_t)size) == 0)
+        {
+            void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            new_memory = address == MAP_FAILED ? nullptr : (uint8_t*)address;
+        }
+#endif
+        if (!new_memory)
+        {
+            SPDLOG_ERROR("Failed to map {} bytes of CPU trace file", size);
+            return false;
+        }
+        unmap();
+#ifdef _WIN32
+        mapping = new_mapping;
+#endif
+        memory = new_memory;
+        mapped_size = size;
+        return true;
+    }
+
+    void cpu_trace_file_t::unmap()
+    {
+#ifdef _WIN32
+        if (memory)
+        {
+            UnmapViewOfFile(memory);
+        }
+        if (mapping)
+        {
+            CloseHandle(mapping);
+            mapping = nullptr;
+        }
+#else
+        if (memory)
+        {
+            munmap(memory, mapped_size);
+        }
+#endif
+        memory = nullptr;
+        mapped_size = 0;
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "pch.h"
+#include "state.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace nes
+{
+    struct nes_t;
+    struct cpu_t;
+    struct cpu_trace_file_t;
+
+    // The machine as the CPU starts an instruction, before it runs
+    struct cpu_trace_record_t
+    {
+        uint64_t cycle; // Master clock, in PPU dots
+        uint16_t pc;
+        uint16_t scanline;
+        uint16_t dot;
+        // Opcode and operand, zero past the end of the instruction
+        uint8_t bytes[3];
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t p;
+        uint8_t sp;
+        uint8_t unused[2];
+    };
+
+    static_assert(sizeof(cpu_trace_record_t) == 24);
+
+    // Formats a record as a line of nestest.log, without the memory values
+    // that log shows after operands, which a record doesn't hold
+    std::string format_nestest(const cpu_trace_record_t& record);
+
+    // Records every instruction the CPU starts in a ring that keeps the most
+    // recent ones. Adding a record takes no lock, and one other thread may
+    // drain() the ring while the emulation runs.
+    //
+    // Attach with nes_t::set_cpu_trace(). While attached, the JIT and idle
+    // loop skipping are bypassed so that no instruction goes unrecorded, and
+    // in catch-up mode the PPU is synced before each record.
+    struct cpu_trace_t
+    {
+        // capacity is rounded up to a power of two
+        cpu_trace_t(size_t capacity = 1024 * 1024);
+        cpu_trace_t(const cpu_trace_t&) = delete;
+        cpu_trace_t& operator=(const cpu_trace_t&) = delete;
+
+        // Called by the CPU before it runs an instruction
+        void record(const cpu_t& cpu);
+        // Records added since the trace was created
+        uint64_t recorded() const;
+        // Copies up to count of the most recent records, oldest first. Only
+        // call from the thread that runs the emulation.
+        void recent(size_t count, std::vector<cpu_trace_record_t>& out) const;
+        // Moves the records added since the last drain into file and
+        // returns how many were moved. Records overwritten before they were
+        // drained are counted in dropped instead.
+        size_t drain(cpu_trace_file_t& file);
+
+        // Written by drain(), so may be read from any thread
+        std::atomic<uint64_t> dropped;
+
+    private:
+        friend struct nes_t;
+
+        std::vector<cpu_trace_record_t> records;
+        uint64_t mask;
+        std::atomic<uint64_t> head;
+        uint64_t tail;
+        nes_t* nes;
+    };
+
+    // Trace records written through a memory mapping of a file, which grows
+    // as records are added. The header's count is updated on every commit,
+    // so the file holds everything up to the last drain even if it is never
+    // closed.
+    struct cpu_trace_file_t
+    {
+        static constexpr uint32_t MAGIC = make_state_tag("NEST");
+        static constexpr uint32_t VERSION = 1;
+
+        struct header_t
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t record_size;
+            uint32_t unused;
+            uint64_t count;
+        };
+
+        cpu_trace_file_t();
+        ~cpu_trace_file_t();
+        cpu_trace_file_t(const cpu_trace_file_t&) = delete;
+        cpu_trace_file_t& operator=(const cpu_trace_file_t&) = delete;
+
+        bool open(const char* path);
+        // Trims the file to the records committed
+        void close();
+        bool is_open() const;
+        uint64_t count() const;
+        // Space for count more records, or null if the file can't grow
+        cpu_trace_record_t* reserve(size_t count);
+        void commit(size_t count);
+
+    private:
+        bool map(size_t size);
+        void unmap();
+
+#ifdef _WIN32
+        void* file;
+        void* mapping;
+#else
+        int file;
+#endif
+        uint8_t* memory;
+        size_t mapped_size;
+    };
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "pch.h"
+
+namespace nes
+{
+    // Bookkeeping that only the debugger reads, such as the PPU pixel trace
+    // and the APU channel mutes, is compiled out when NES_NO_DEBUG is defined
+#ifdef NES_NO_DEBUG
+    constexpr bool DEBUG_ENABLED = false;
+#else
+    constexpr bool DEBUG_ENABLED = true;
+#endif
+
+    // Bus and CPU access counters for profiling. Off unless NES_COUNTERS is
+    // defined since they sit on the hottest paths in the emulator
+#ifdef NES_COUNTERS
+    constexpr bool COUNTERS_ENABLED = true;
+#else
+    constexpr bool COUNTERS_ENABLED = false;
+#endif
+}
@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "hash.h"
+
+#include <bit>
+
+namespace nes
+{
+    static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87;
+    static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4F;
+    static constexpr uint64_t PRIME3 = 0x165667B19E3779F9;
+    static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63;
+    static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5;
+
+    // Compiles to a plain load on little-endian machines
+    template <typename T>
+    static T read_le(const uint8_t* data)
+    {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+        {
+            value |= (T)data[i] << (i * 8);
+        }
+        return value;
+    }
+
+    static uint64_t round(uint64_t lane, uint64_t input)
+    {
+        lane += input * PRIME2;
+        lane = std::rotl(lane, 31);
+        return lane * PRIME1;
+    }
+
+    static uint64_t merge_round(uint64_t hash, uint64_t lane)
+    {
+        hash ^= round(0, lane);
+        return hash * PRIME1 + PRIME4;
+    }
+
+    hasher_t::hasher_t(uint64_t seed)
+        : seed(seed),
+          lanes{ seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 },
+          total_size(0),
+          buffer{},
+          buffered(0)
+    {
+    }
+
+    void hasher_t::update(const void* data, size_t size)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        total_size += size;
+
+        if (buffered + size < sizeof(buffer))
+        {
+            memcpy(buffer + buffered, bytes, size);
+            buffered += size;
+            return;
+        }
+
+        if (buffered > 0)
+        {
+            size_t fill = sizeof(buffer) - buffered;
+            memcpy(buffer + buffered, bytes, fill);
+            for (int i = 0; i < 4; i++)
+            {
+                lanes[i] = round(lanes[i], read_le<uint64_t>(buffer + i * 8));
+            }
+            bytes += fill;
+            size -= fill;
+            buffered = 0;
+        }
+
+        while (size >= sizeof(buffer))
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                lanes[i] = round(lanes[i], read_le<uint64_t>(bytes + i * 8));
+            }
+            bytes += sizeof(buffer);
+            size -= sizeof(buffer);
+        }
+
+        memcpy(buffer, bytes, size);
+        buffered = size;
+    }
+
+    uint64_t hasher_t::digest() const
+    {
+        uint64_t hash;
+        if (total_size >= sizeof(buffer))
+        {
+            hash = std::rotl(lanes[0], 1)
+                + std::rotl(lanes[1], 7)
+                + std::rotl(lanes[2], 12)
+                + std::rotl(lanes[3], 18);
+            for (uint64_t lane : lanes)
+            {
+                hash = merge_round(hash, lane);
+            }
+        }
+        else
+        {
+            hash = seed + PRIME5;
+        }
+        hash += total_size;
+
+        const uint8_t* bytes = buffer;
+        size_t size = buffered;
+        for (; size >= 8; bytes += 8, size -= 8)
+        {
+            hash ^= round(0, read_le<uint64_t>(bytes));
+            hash = std::rotl(hash, 27) * PRIME1 + PRIME4;
+        }
+        if (size >= 4)
+        {
+            hash ^= read_le<uint32_t>(bytes) * PRIME1;
+            hash = std::rotl(hash, 23) * PRIME2 + PRIME3;
+            bytes += 4;
+            size -= 4;
+        }
+        for (; size > 0; bytes++, size--)
+        {
+            hash ^= *bytes * PRIME5;
+            hash = std::rotl(hash, 11) * PRIME1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "pch.h"
+
+namespace nes
+{
+    // 64-bit FNV-1a. Not cryptographic; used to compare emulator output
+    // between runs.
+    static constexpr uint64_t HASH_SEED = 0xCBF29CE484222325;
+
+    inline uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = HASH_SEED)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3;
+        }
+        return hash;
+    }
+
+    // Incremental 64-bit xxHash (XXH64). Much faster than hash_bytes on
+    // large inputs as it consumes 32 bytes at a time in four independent
+    // lanes, and gives the same result on every platform regardless of how
+    // the input is split between update() calls.
+    struct hasher_t
+    {
+        hasher_t(uint64_t seed = 0);
+        void update(const void* data, size_t size);
+        uint64_t digest() const;
+
+    private:
+        uint64_t seed;
+        uint64_t lanes[4];
+        uint64_t total_size;
+        uint8_t buffer[32];
+        size_t buffered;
+    };
+}
@@ -0,0 +1,211 @@
+#include "pch.h"
+#include "idle_loop.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace nes
+{
+    // Operations whose only effect is on registers and flags
+    static constexpr cpu_t::opcode_fn cpu_t::*REGISTER_OPCODES[] = {
+        &cpu_t::ADC, &cpu_t::AND, &cpu_t::BIT, &cpu_t::CLC, &cpu_t::CLD, &cpu_t::CLV,
+        &cpu_t::CMP, &cpu_t::CPX, &cpu_t::CPY, &cpu_t::DEX, &cpu_t::DEY, &cpu_t::EOR,
+        &cpu_t::INX, &cpu_t::INY, &cpu_t::LDA, &cpu_t::LDX, &cpu_t::LDY, &cpu_t::NOP,
+        &cpu_t::ORA, &cpu_t::SBC, &cpu_t::SEC, &cpu_t::SED, &cpu_t::TAX, &cpu_t::TAY,
+        &cpu_t::TSX, &cpu_t::TXA, &cpu_t::TXS, &cpu_t::TYA,
+        &cpu_t::ASL_ACC, &cpu_t::ROL_ACC, &cpu_t::LSR_ACC, &cpu_t::ROR_ACC,
+    };
+
+    static bool is_ppu_status(uint16_t addr)
+    {
+        return addr >= 0x2000 && addr <= 0x3FFF && (addr & 0x7) == 0x2;
+    }
+
+    idle_loop_t::idle_loop_t(cpu_t& cpu, bus_t& bus)
+        : cpu(cpu),
+          bus(bus)
+    {
+        reset();
+    }
+
+    void idle_loop_t::reset()
+    {
+        head = 0;
+        cycles = 0;
+        reads_ppu_status = false;
+        repeated = false;
+        round_start = 0;
+        valid = false;
+        last_pc = 0;
+        rejected_head = 0;
+        rejected_tail = 0;
+        map_generation = 0;
+        code_size = 0;
+        a = x = y = sp = p = 0;
+    }
+
+    bool idle_loop_t::update(uint64_t time)
+    {
+        uint16_t pc = cpu.pc;
+        uint16_t last_pc = this->last_pc;
+        this->last_pc = pc;
+        if (valid && pc == head)
+        {
+            // Nothing but the loop fits in exactly one time round: anything
+            // else would have to leave through the jump back without taking
+            // it, or be an interrupt, and both take longer
+            repeated = time - round_start == (uint64_t)cycles * 3
+                && cpu.ra == a
+                && cpu.rx == x
+                && cpu.ry == y
+                && cpu.sp == sp
+                && cpu.status.reg == p;
+            if (repeated && (map_generation != bus.get_map_generation() || code_changed()))
+            {
+                valid = false;
+                return false;
+            }
+        }
+        else if (pc < last_pc && last_pc - pc <= MAX_LOOP_BYTES)
+        {
+            // Jumped back a short way, so last_pc may be the end of a loop
+            if (pc == rejected_head
+                && last_pc == rejected_tail
+                && map_generation == bus.get_map_generation())
+            {
+                return false;
+            }
+            valid = analyze(pc, last_pc);
+            if (!valid)
+            {
+                rejected_head = pc;
+                rejected_tail = last_pc;
+                return false;
+            }
+            repeated = false;
+        }
+        else
+        {
+            return false;
+        }
+
+        round_start = time;
+        a = cpu.ra;
+        x = cpu.rx;
+        y = cpu.ry;
+        sp = cpu.sp;
+        p = cpu.status.reg;
+        return true;
+    }
+
+    bool idle_loop_t::analyze(uint16_t head, uint16_t tail)
+    {
+        map_generation = bus.get_map_generation();
+        this->head = head;
+        reads_ppu_status = false;
+        cycles = 0;
+
+        uint8_t op = 0;
+        uint8_t lo = 0;
+        uint8_t hi = 0;
+        uint16_t pc = head;
+        while (pc < tail)
+        {
+            if (!peek(pc, op))
+            {
+                return false;
+            }
+            const instruction_t& instruction = cpu_t::instructions[op];
+            if (std::ranges::find(REGISTER_OPCODES, instruction.opcode) == std::end(REGISTER_OPCODES))
+            {
+                return false;
+            }
+            if (instruction.addr_mode == &cpu_t::ZRP || instruction.addr_mode == &cpu_t::ABS)
+            {
+                hi = 0;
+                if (!peek(pc + 1, lo)
+                    || (instruction.addr_mode == &cpu_t::ABS && !peek(pc + 2, hi)))
+                {
+                    return false;
+                }
+                uint16_t addr = lo | (hi << 8);
+                if (is_ppu_status(addr))
+                {
+                    reads_ppu_status = true;
+                }
+                else if (!bus.get_read_memory(addr))
+                {
+                    return false;
+                }
+            }
+            else if (instruction.addr_mode != &cpu_t::IMP
+                && instruction.addr_mode != &cpu_t::ACC
+                && instruction.addr_mode != &cpu_t::IMM)
+            {
+                return false;
+            }
+            cycles += instruction.cycles;
+            pc += instruction.byte_count;
+        }
+        if (pc != tail || !peek(tail, op) || !peek(tail + 1, lo))
+        {
+            return false;
+        }
+
+        const instruction_t& instruction = cpu_t::instructions[op];
+        if (instruction.addr_mode == &cpu_t::REL)
+        {
+            // A taken branch, which crosses a page by the same rule as REL
+            uint16_t next = tail + 2;
+            if ((uint16_t)(next + (int8_t)lo) != head)
+            {
+                return false;
+            }
+            cycles += instruction.cycles + 1 + (((next + 1) & 0xFF00) != (head & 0xFF00));
+        }
+        else if (instruction.opcode == &cpu_t::JMP && instruction.addr_mode == &cpu_t::ABS)
+        {
+            if (!peek(tail + 2, hi) || (lo | (hi << 8)) != head)
+            {
+                return false;
+            }
+            cycles += instruction.cycles;
+        }
+        else
+        {
+            return false;
+        }
+
+        code_size = tail + instruction.byte_count - head;
+        for (int i = 0; i < code_size; i++)
+        {
+            peek(head + i, code[i]);
+        }
+        return true;
+    }
+
+    bool idle_loop_t::peek(uint16_t addr, uint8_t& value) const
+    {
+        const uint8_t* memory = bus.get_read_memory(addr);
+        if (!memory)
+        {
+            return false;
+        }
+        value = memory[addr % bus_t::PAGE_SIZE];
+        return true;
+    }
+
+    // Code in RAM can be rewritten without the map changing
+    bool idle_loop_t::code_changed() const
+    {
+        for (int i = 0; i < code_size; i++)
+        {
+            uint8_t value;
+            if (!peek(head + i, value) || value != code[i])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "pch.h"
+#include "cpu.h"
+#include "bus.h"
+
+namespace nes
+{
+    // Spots loops that wait for something outside the CPU, like
+    //   wait: LDA $2002      or      wait: LDA frame_done
+    //         BPL wait                     BEQ wait
+    // An idle loop is straight-line code ending in a jump back to its start,
+    // that only reads memory or PPUSTATUS, never writes, and comes back
+    // round to the registers it started with. Running it again changes
+    // nothing until memory, PPUSTATUS or an interrupt does.
+    struct idle_loop_t
+    {
+        static constexpr int MAX_LOOP_BYTES = 16;
+
+        idle_loop_t(cpu_t& cpu, bus_t& bus);
+        // Must be called when the CPU takes an interrupt or its state is
+        // replaced
+        void reset();
+        // Call between instructions with the master clock. Returns true if
+        // the CPU is at the start of an idle loop. The loop has then
+        // repeated if the last time round ran nothing else and ended with
+        // the registers it started with.
+        bool update(uint64_t time);
+
+        uint16_t head;
+        // CPU cycles one time round the loop takes
+        int cycles;
+        bool reads_ppu_status;
+        bool repeated;
+        // Master clock when the CPU was last at head
+        uint64_t round_start;
+
+    private:
+        bool analyze(uint16_t head, uint16_t tail);
+        bool peek(uint16_t addr, uint8_t& value) const;
+        bool code_changed() const;
+
+        cpu_t& cpu;
+        bus_t& bus;
+        bool valid;
+        uint16_t last_pc;
+        uint16_t rejected_head;
+        uint16_t rejected_tail;
+        uint32_t map_generation;
+        uint8_t code[MAX_LOOP_BYTES + 3];
+        int code_size;
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t sp;
+        uint8_t p;
+    };
+}
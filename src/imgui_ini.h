@@ -88,6 +88,12 @@ Size=434,511
 Collapsed=0
 DockId=0x00000006,2
 
+[Window][COUNTERS]
+Pos=1486,516
+Size=434,511
+Collapsed=0
+DockId=0x00000006,3
+
 [Window][Control]
 Pos=0,553
 Size=410,474
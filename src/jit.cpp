@@ -0,0 +1,1386 @@
+#include "pch.h"
+#include "jit.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NES_JIT_X64
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace nes
+{
+#ifdef NES_JIT_X64
+    // Code is protected a page at a time
+    static constexpr uintptr_t CODE_PAGE_SIZE = 4096;
+
+    enum x64_reg_t : int
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    // Condition codes for jcc and setcc
+    enum x64_cc_t : uint8_t
+    {
+        CC_B = 0x2,
+        CC_E = 0x4,
+        CC_NE = 0x5,
+    };
+
+    // The /digit of the group 1 instructions. The register to register form
+    // of each is opcode op * 8 + 1.
+    enum x64_alu_t : uint8_t
+    {
+        ALU_ADD = 0,
+        ALU_OR = 1,
+        ALU_SBB = 3,
+        ALU_AND = 4,
+        ALU_SUB = 5,
+        ALU_XOR = 6,
+        ALU_CMP = 7,
+    };
+
+    // [base + index * scale + disp], always encoded with a 32 bit disp
+    struct x64_mem_t
+    {
+        int base;
+        int index;
+        int scale;
+        int32_t disp;
+    };
+
+    static x64_mem_t mem(int base, int32_t disp)
+    {
+        return { base, -1, 1, disp };
+    }
+
+    static x64_mem_t mem(int base, int index, int scale, int32_t disp)
+    {
+        return { base, index, scale, disp };
+    }
+
+    static x64_mem_t ctx_mem(size_t offset)
+    {
+        return mem(R11, (int32_t)offset);
+    }
+
+#define CTX(field) ctx_mem(offsetof(jit_context_t, field))
+
+    // Just enough of an x86-64 assembler for the translated instructions.
+    // Byte registers are limited to al, cl, dl, bl and r8b-r15b.
+    struct x64_emitter_t
+    {
+        std::vector<uint8_t> buf;
+
+        void u8(uint8_t value)
+        {
+            buf.push_back(value);
+        }
+
+        void u16(uint16_t value)
+        {
+            u8((uint8_t)value);
+            u8((uint8_t)(value >> 8));
+        }
+
+        void u32(uint32_t value)
+        {
+            u16((uint16_t)value);
+            u16((uint16_t)(value >> 16));
+        }
+
+        void u64(uint64_t value)
+        {
+            u32((uint32_t)value);
+            u32((uint32_t)(value >> 32));
+        }
+
+        void rex(bool w, int reg, int index, int base)
+        {
+            uint8_t prefix = 0x40
+                | (w ? 0x08 : 0)
+                | ((reg & 8) ? 0x04 : 0)
+                | (index >= 0 && (index & 8) ? 0x02 : 0)
+                | ((base & 8) ? 0x01 : 0);
+            if (prefix != 0x40)
+            {
+                u8(prefix);
+            }
+        }
+
+        void modrm(int reg, x64_mem_t m)
+        {
+            if (m.index < 0 && (m.base & 7) != RSP)
+            {
+                u8(0x80 | (reg & 7) << 3 | (m.base & 7));
+            }
+            else
+            {
+                int ss = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0;
+                u8(0x80 | (reg & 7) << 3 | 4);
+                u8(ss << 6 | ((m.index < 0 ? RSP : m.index) & 7) << 3 | (m.base & 7));
+            }
+            u32((uint32_t)m.disp);
+        }
+
+        void op_mem(std::initializer_list<uint8_t> opcode, int reg, x64_mem_t m, bool w = false, bool op16 = false)
+        {
+            if (op16)
+            {
+                u8(0x66);
+            }
+            rex(w, reg, m.index, m.base);
+            for (uint8_t b : opcode)
+            {
+                u8(b);
+            }
+            modrm(reg, m);
+        }
+
+        void op_reg(std::initializer_list<uint8_t> opcode, int reg, int rm, bool w = false)
+        {
+            rex(w, reg, -1, rm);
+            for (uint8_t b : opcode)
+            {
+                u8(b);
+            }
+            u8(0xC0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        void movzx8(int dst, x64_mem_t src) { op_mem({ 0x0F, 0xB6 }, dst, src); }
+        void store8(x64_mem_t dst, int src) { op_mem({ 0x88 }, src, dst); }
+        void store16(x64_mem_t dst, int src) { op_mem({ 0x89 }, src, dst, false, true); }
+        void store8_imm(x64_mem_t dst, uint8_t value) { op_mem({ 0xC6 }, 0, dst); u8(value); }
+        void store16_imm(x64_mem_t dst, uint16_t value) { op_mem({ 0xC7 }, 0, dst, false, true); u16(value); }
+        void load64(int dst, x64_mem_t src) { op_mem({ 0x8B }, dst, src, true); }
+        void mov(int dst, int src) { op_reg({ 0x89 }, src, dst); }
+        void mov64(int dst, int src) { op_reg({ 0x89 }, src, dst, true); }
+        void mov_imm(int dst, uint32_t value) { rex(false, 0, -1, dst); u8(0xB8 + (dst & 7)); u32(value); }
+        void alu(x64_alu_t op, int dst, int src) { op_reg({ (uint8_t)(op * 8 + 1) }, src, dst); }
+        void alu64(x64_alu_t op, int dst, int src) { op_reg({ (uint8_t)(op * 8 + 1) }, src, dst, true); }
+        void alu_imm(x64_alu_t op, int dst, uint32_t value) { op_reg({ 0x81 }, op, dst); u32(value); }
+        void alu32_mem(x64_alu_t op, x64_mem_t dst, int src) { op_mem({ (uint8_t)(op * 8 + 1) }, src, dst); }
+        void alu32_mem_imm(x64_alu_t op, x64_mem_t dst, uint32_t value) { op_mem({ 0x81 }, op, dst); u32(value); }
+        void shl(int dst, uint8_t count) { op_reg({ 0xC1 }, 4, dst); u8(count); }
+        void shr(int dst, uint8_t count) { op_reg({ 0xC1 }, 5, dst); u8(count); }
+        void not_(int dst) { op_reg({ 0xF7 }, 2, dst); }
+        void test64(int a, int b) { op_reg({ 0x85 }, b, a, true); }
+        void setcc(x64_cc_t cc, int dst) { op_reg({ 0x0F, (uint8_t)(0x90 + cc) }, 0, dst); }
+        void movzx8(int dst, int src) { op_reg({ 0x0F, 0xB6 }, dst, src); }
+        void test_imm(int reg, uint32_t value) { op_reg({ 0xF7 }, 0, reg); u32(value); }
+        void push(int reg) { rex(false, 0, -1, reg); u8(0x50 + (reg & 7)); }
+        void pop(int reg) { rex(false, 0, -1, reg); u8(0x58 + (reg & 7)); }
+        void ret() { u8(0xC3); }
+
+        // Returns the position to pass to patch() once the target is known
+        size_t jmp()
+        {
+            u8(0xE9);
+            u32(0);
+            return buf.size();
+        }
+
+        // Returns the position to pass to patch() once the target is known
+        size_t jcc(x64_cc_t cc)
+        {
+            u8(0x0F);
+            u8(0x80 + cc);
+            u32(0);
+            return buf.size();
+        }
+
+        void patch(size_t jump, size_t target)
+        {
+            uint32_t rel = (uint32_t)(target - jump);
+            memcpy(&buf[jump - 4], &rel, 4);
+        }
+    };
+
+    enum class jit_op_t : uint8_t
+    {
+        none,
+        lda, ldx, ldy, sta, stx, sty,
+        adc, sbc, and_, ora, eor, cmp, cpx, cpy, bit,
+        inc, dec, asl, lsr, rol, ror,
+        asl_acc, lsr_acc, rol_acc, ror_acc,
+        inx, iny, dex, dey,
+        tax, tay, txa, tya, tsx, txs,
+        clc, sec, clv, cld, sed, nop,
+        pha, php, pla,
+        bpl, bmi, bvc, bvs, bcc, bcs, bne, beq,
+        jmp, jsr, rts,
+    };
+
+    // Instructions that change the interrupt flag or run interrupt code are
+    // left to the interpreter, as are the unofficial ones other than NOP and
+    // the duplicate SBC
+    static jit_op_t get_jit_op(uint8_t op)
+    {
+        static const std::pair<cpu_t::opcode_fn cpu_t::*, jit_op_t> OPS[] = {
+            { &cpu_t::LDA, jit_op_t::lda }, { &cpu_t::LDX, jit_op_t::ldx }, { &cpu_t::LDY, jit_op_t::ldy },
+            { &cpu_t::STA, jit_op_t::sta }, { &cpu_t::STX, jit_op_t::stx }, { &cpu_t::STY, jit_op_t::sty },
+            { &cpu_t::ADC, jit_op_t::adc }, { &cpu_t::SBC, jit_op_t::sbc }, { &cpu_t::AND, jit_op_t::and_ },
+            { &cpu_t::ORA, jit_op_t::ora }, { &cpu_t::EOR, jit_op_t::eor }, { &cpu_t::CMP, jit_op_t::cmp },
+            { &cpu_t::CPX, jit_op_t::cpx }, { &cpu_t::CPY, jit_op_t::cpy }, { &cpu_t::BIT, jit_op_t::bit },
+            { &cpu_t::INC, jit_op_t::inc }, { &cpu_t::DEC, jit_op_t::dec }, { &cpu_t::ASL, jit_op_t::asl },
+            { &cpu_t::LSR, jit_op_t::lsr }, { &cpu_t::ROL, jit_op_t::rol }, { &cpu_t::ROR, jit_op_t::ror },
+            { &cpu_t::ASL_ACC, jit_op_t::asl_acc }, { &cpu_t::LSR_ACC, jit_op_t::lsr_acc },
+            { &cpu_t::ROL_ACC, jit_op_t::rol_acc }, { &cpu_t::ROR_ACC, jit_op_t::ror_acc },
+            { &cpu_t::INX, jit_op_t::inx }, { &cpu_t::INY, jit_op_t::iny },
+            { &cpu_t::DEX, jit_op_t::dex }, { &cpu_t::DEY, jit_op_t::dey },
+            { &cpu_t::TAX, jit_op_t::tax }, { &cpu_t::TAY, jit_op_t::tay }, { &cpu_t::TXA, jit_op_t::txa },
+            { &cpu_t::TYA, jit_op_t::tya }, { &cpu_t::TSX, jit_op_t::tsx }, { &cpu_t::TXS, jit_op_t::txs },
+            { &cpu_t::CLC, jit_op_t::clc }, { &cpu_t::SEC, jit_op_t::sec }, { &cpu_t::CLV, jit_op_t::clv },
+            { &cpu_t::CLD, jit_op_t::cld }, { &cpu_t::SED, jit_op_t::sed }, { &cpu_t::NOP, jit_op_t::nop },
+            { &cpu_t::PHA, jit_op_t::pha }, { &cpu_t::PHP, jit_op_t::php }, { &cpu_t::PLA, jit_op_t::pla },
+            { &cpu_t::BPL, jit_op_t::bpl }, { &cpu_t::BMI, jit_op_t::bmi }, { &cpu_t::BVC, jit_op_t::bvc },
+            { &cpu_t::BVS, jit_op_t::bvs }, { &cpu_t::BCC, jit_op_t::bcc }, { &cpu_t::BCS, jit_op_t::bcs },
+            { &cpu_t::BNE, jit_op_t::bne }, { &cpu_t::BEQ, jit_op_t::beq },
+            { &cpu_t::JMP, jit_op_t::jmp }, { &cpu_t::JSR, jit_op_t::jsr }, { &cpu_t::RTS, jit_op_t::rts },
+        };
+        for (const auto& [opcode, jit_op] : OPS)
+        {
+            if (cpu_t::instructions[op].opcode == opcode)
+            {
+                return jit_op;
+            }
+        }
+        return jit_op_t::none;
+    }
+
+    enum class jit_access_t
+    {
+        none,
+        read,
+        write,
+        modify,
+    };
+
+    static jit_access_t get_access(jit_op_t op)
+    {
+        switch (op)
+        {
+        case jit_op_t::lda: case jit_op_t::ldx: case jit_op_t::ldy:
+        case jit_op_t::adc: case jit_op_t::sbc: case jit_op_t::and_:
+        case jit_op_t::ora: case jit_op_t::eor: case jit_op_t::cmp:
+        case jit_op_t::cpx: case jit_op_t::cpy: case jit_op_t::bit:
+            return jit_access_t::read;
+        case jit_op_t::sta: case jit_op_t::stx: case jit_op_t::sty:
+            return jit_access_t::write;
+        case jit_op_t::inc: case jit_op_t::dec: case jit_op_t::asl:
+        case jit_op_t::lsr: case jit_op_t::rol: case jit_op_t::ror:
+            return jit_access_t::modify;
+        default:
+            return jit_access_t::none;
+        }
+    }
+
+    // Instructions that take a cycle longer when indexing crosses a page
+    static bool has_page_penalty(jit_op_t op)
+    {
+        switch (op)
+        {
+        case jit_op_t::lda: case jit_op_t::ldx: case jit_op_t::ldy:
+        case jit_op_t::adc: case jit_op_t::sbc: case jit_op_t::and_:
+        case jit_op_t::ora: case jit_op_t::eor: case jit_op_t::cmp:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool is_branch(jit_op_t op)
+    {
+        return op >= jit_op_t::bpl && op <= jit_op_t::beq;
+    }
+
+    static bool ends_block(jit_op_t op)
+    {
+        return is_branch(op) || op == jit_op_t::jmp || op == jit_op_t::jsr || op == jit_op_t::rts;
+    }
+
+    static bool reads_nz(jit_op_t op)
+    {
+        switch (op)
+        {
+        case jit_op_t::bpl: case jit_op_t::bmi: case jit_op_t::bne: case jit_op_t::beq:
+        case jit_op_t::php:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool writes_nz(jit_op_t op)
+    {
+        switch (op)
+        {
+        case jit_op_t::sta: case jit_op_t::stx: case jit_op_t::sty:
+        case jit_op_t::txs: case jit_op_t::clc: case jit_op_t::sec:
+        case jit_op_t::clv: case jit_op_t::cld: case jit_op_t::sed:
+        case jit_op_t::nop: case jit_op_t::pha: case jit_op_t::php:
+            return false;
+        default:
+            return !ends_block(op);
+        }
+    }
+
+    // Whether the instruction looks up a page table, and so may return to
+    // the interpreter before it runs
+    static bool may_side_exit(const instruction_t& instruction, jit_op_t op, uint16_t operand)
+    {
+        auto mode = instruction.addr_mode;
+        if (op == jit_op_t::jmp)
+        {
+            return mode == &cpu_t::IND && operand >= 0x2000;
+        }
+        if (get_access(op) == jit_access_t::none || mode == &cpu_t::IMM
+            || mode == &cpu_t::ZPX || mode == &cpu_t::ZPY)
+        {
+            return false;
+        }
+        return !((mode == &cpu_t::ZRP || mode == &cpu_t::ABS) && operand < 0x2000);
+    }
+
+    // Register allocation: the 6502 registers live in ebx (A), r12d (X),
+    // r13d (Y), r14d (SP) and r15d (P) for the whole block, always zero
+    // extended. These are callee saved, so the block saves them on entry.
+    // r11 holds the context and r10 the 2KB of RAM. eax, ecx, edx, r8 and r9
+    // are scratch.
+    static constexpr int REG_A = RBX;
+    static constexpr int REG_X = R12;
+    static constexpr int REG_Y = R13;
+    static constexpr int REG_SP = R14;
+    static constexpr int REG_P = R15;
+    static constexpr int SAVED_REGS[] = { REG_A, REG_X, REG_Y, REG_SP, REG_P };
+
+    struct block_compiler_t
+    {
+        x64_emitter_t a;
+        // Jumps to the epilogue, with the instruction count in eax
+        std::vector<size_t> exits;
+        // Side exits as (jump, instruction to resume the interpreter at)
+        std::vector<std::pair<size_t, uint32_t>> side_exits;
+        // Whether anything reads the N and Z the current instruction sets
+        // before another instruction sets them again
+        bool nz_live = true;
+
+        void prologue()
+        {
+            for (int reg : SAVED_REGS)
+            {
+                a.push(reg);
+            }
+#ifdef _WIN32
+            a.mov64(R11, RCX);
+#else
+            a.mov64(R11, RDI);
+#endif
+            a.load64(R10, CTX(ram));
+            a.movzx8(REG_A, CTX(a));
+            a.movzx8(REG_X, CTX(x));
+            a.movzx8(REG_Y, CTX(y));
+            a.movzx8(REG_SP, CTX(sp));
+            a.movzx8(REG_P, CTX(p));
+        }
+
+        // Side exits return the number of instructions before them, and
+        // every exit goes through one epilogue
+        void epilogue()
+        {
+            std::ranges::sort(side_exits, {}, &std::pair<size_t, uint32_t>::second);
+            size_t stub = 0;
+            for (size_t i = 0; i < side_exits.size(); i++)
+            {
+                if (i == 0 || side_exits[i].second != side_exits[i - 1].second)
+                {
+                    stub = a.buf.size();
+                    exit(side_exits[i].second);
+                }
+                a.patch(side_exits[i].first, stub);
+            }
+            for (size_t jump : exits)
+            {
+                a.patch(jump, a.buf.size());
+            }
+            a.store8(CTX(a), REG_A);
+            a.store8(CTX(x), REG_X);
+            a.store8(CTX(y), REG_Y);
+            a.store8(CTX(sp), REG_SP);
+            a.store8(CTX(p), REG_P);
+            for (int i = (int)std::size(SAVED_REGS) - 1; i >= 0; i--)
+            {
+                a.pop(SAVED_REGS[i]);
+            }
+            a.ret();
+        }
+
+        void exit(uint32_t count)
+        {
+            a.mov_imm(RAX, count);
+            exits.push_back(a.jmp());
+        }
+
+        void side_exit_if_null(int reg, uint32_t index)
+        {
+            a.test64(reg, reg);
+            side_exits.push_back({ a.jcc(CC_E), index });
+        }
+
+        // Sets N and Z from value into P, which must have them clear. Uses
+        // r9.
+        void or_nz(int value)
+        {
+            if (!nz_live)
+            {
+                return;
+            }
+            a.mov(R9, value);
+            a.alu_imm(ALU_AND, R9, 0x80);
+            a.alu(ALU_OR, REG_P, R9);
+            a.alu_imm(ALU_CMP, value, 1);
+            a.alu(ALU_SBB, R9, R9);
+            a.alu_imm(ALU_AND, R9, 0x02);
+            a.alu(ALU_OR, REG_P, R9);
+        }
+
+        void set_nz(int value)
+        {
+            if (!nz_live)
+            {
+                return;
+            }
+            a.alu_imm(ALU_AND, REG_P, 0x7D);
+            or_nz(value);
+        }
+
+        void push(int value)
+        {
+            a.store8(mem(R10, REG_SP, 1, 0x100), value);
+            a.alu_imm(ALU_SUB, REG_SP, 1);
+            a.alu_imm(ALU_AND, REG_SP, 0xFF);
+        }
+
+        void pull(int dst)
+        {
+            a.alu_imm(ALU_ADD, REG_SP, 1);
+            a.alu_imm(ALU_AND, REG_SP, 0xFF);
+            a.movzx8(dst, mem(R10, REG_SP, 1, 0x100));
+        }
+
+        // Ends the block with pc set and count instructions run
+        void finish(uint16_t pc, uint32_t count)
+        {
+            a.store16_imm(CTX(pc), pc);
+            exit(count);
+        }
+
+        void finish_dynamic(int pc, uint32_t count)
+        {
+            a.store16(CTX(pc), pc);
+            exit(count);
+        }
+
+        // Adds instruction index of the block
+        void instruction(uint32_t index, uint16_t pc, uint8_t op, jit_op_t jit_op, uint16_t operand);
+        void operate(jit_op_t op, x64_mem_t target);
+        void adc();
+        void compare(int reg);
+    };
+
+    void block_compiler_t::instruction(uint32_t index, uint16_t pc, uint8_t op, jit_op_t jit_op, uint16_t operand)
+    {
+        const instruction_t& instruction = cpu_t::instructions[op];
+        auto mode = instruction.addr_mode;
+        int byte_count = instruction.byte_count;
+        uint16_t next_pc = pc + byte_count;
+        uint8_t last_fetch = byte_count == 1 ? op : byte_count == 2 ? (uint8_t)operand : (uint8_t)(operand >> 8);
+
+        // Anything that can side exit comes first, so that an exit leaves
+        // the registers as the previous instruction left them
+        if (is_branch(jit_op))
+        {
+            uint16_t target = next_pc + (int8_t)operand;
+            uint8_t crossed = ((next_pc + 1) & 0xFF00) != (target & 0xFF00);
+            static constexpr std::pair<uint8_t, bool> CONDITIONS[] = {
+                { 0x80, false }, { 0x80, true }, // BPL, BMI
+                { 0x40, false }, { 0x40, true }, // BVC, BVS
+                { 0x01, false }, { 0x01, true }, // BCC, BCS
+                { 0x02, false }, { 0x02, true }, // BNE, BEQ
+            };
+            auto [flag, taken_if_set] = CONDITIONS[(int)jit_op - (int)jit_op_t::bpl];
+            a.store8_imm(CTX(last_read), last_fetch);
+            a.test_imm(REG_P, flag);
+            size_t taken = a.jcc(taken_if_set ? CC_NE : CC_E);
+            finish(next_pc, index + 1);
+            a.patch(taken, a.buf.size());
+            a.alu32_mem_imm(ALU_ADD, CTX(extra_cycles), 1 + crossed);
+            finish(target, index + 1);
+            return;
+        }
+
+        switch (jit_op)
+        {
+        case jit_op_t::jmp:
+            if (mode == &cpu_t::IND)
+            {
+                uint16_t hi_addr = (operand & 0xFF00) | ((operand + 1) & 0xFF);
+                x64_mem_t lo_mem, hi_mem;
+                if (operand < 0x2000)
+                {
+                    lo_mem = mem(R10, operand & 0x7FF);
+                    hi_mem = mem(R10, hi_addr & 0x7FF);
+                }
+                else
+                {
+                    a.load64(R8, ctx_mem(offsetof(jit_context_t, read_pages) + operand / bus_t::PAGE_SIZE * sizeof(uint8_t*)));
+                    side_exit_if_null(R8, index);
+                    lo_mem = mem(R8, operand & 0xFF);
+                    hi_mem = mem(R8, hi_addr & 0xFF);
+                }
+                a.movzx8(RAX, lo_mem);
+                a.movzx8(RDX, hi_mem);
+                a.store8(CTX(last_read), RDX);
+                a.shl(RDX, 8);
+                a.alu(ALU_OR, RAX, RDX);
+                finish_dynamic(RAX, index + 1);
+            }
+            else
+            {
+                a.store8_imm(CTX(last_read), last_fetch);
+                finish(operand, index + 1);
+            }
+            return;
+        case jit_op_t::jsr:
+        {
+            uint16_t return_addr = pc + 2;
+            a.store8_imm(CTX(last_read), last_fetch);
+            a.mov_imm(RAX, return_addr >> 8);
+            push(RAX);
+            a.mov_imm(RAX, return_addr & 0xFF);
+            push(RAX);
+            finish(operand, index + 1);
+            return;
+        }
+        case jit_op_t::rts:
+            pull(RAX);
+            pull(RDX);
+            a.store8(CTX(last_read), RDX);
+            a.shl(RDX, 8);
+            a.alu(ALU_OR, RAX, RDX);
+            a.alu_imm(ALU_ADD, RAX, 1);
+            finish_dynamic(RAX, index + 1);
+            return;
+        default:
+            break;
+        }
+
+        jit_access_t access = get_access(jit_op);
+        if (access == jit_access_t::none || mode == &cpu_t::IMM)
+        {
+            a.store8_imm(CTX(last_read), last_fetch);
+            if (mode == &cpu_t::IMM)
+            {
+                a.mov_imm(RAX, (uint8_t)operand);
+            }
+            operate(jit_op, x64_mem_t{});
+            return;
+        }
+
+        // Work out where the operand lives: a static address in RAM, a static
+        // page, or an address in ecx looked up at run time
+        size_t page_table = access == jit_access_t::read
+            ? offsetof(jit_context_t, read_pages)
+            : offsetof(jit_context_t, write_pages);
+        x64_mem_t target;
+        bool dynamic_crossed = false;
+        bool pointer = false;
+        if (mode == &cpu_t::ZRP || mode == &cpu_t::ABS)
+        {
+            if (operand < 0x2000)
+            {
+                target = mem(R10, operand & 0x7FF);
+            }
+            else
+            {
+                a.load64(R8, ctx_mem(page_table + operand / bus_t::PAGE_SIZE * sizeof(uint8_t*)));
+                side_exit_if_null(R8, index);
+                target = mem(R8, operand & 0xFF);
+            }
+        }
+        else if (mode == &cpu_t::ZPX || mode == &cpu_t::ZPY)
+        {
+            a.mov(RCX, mode == &cpu_t::ZPX ? REG_X : REG_Y);
+            a.alu_imm(ALU_ADD, RCX, operand);
+            a.alu_imm(ALU_AND, RCX, 0xFF);
+            target = mem(R10, RCX, 1, 0);
+        }
+        else
+        {
+            // Base address into eax, then the effective address into ecx
+            if (mode == &cpu_t::ABX || mode == &cpu_t::ABY)
+            {
+                a.mov_imm(RAX, operand);
+            }
+            else
+            {
+                // The pointer is always in zero page
+                pointer = true;
+                if (mode == &cpu_t::IDX)
+                {
+                    a.mov(RCX, REG_X);
+                    a.alu_imm(ALU_ADD, RCX, operand);
+                    a.alu_imm(ALU_AND, RCX, 0xFF);
+                    a.movzx8(RAX, mem(R10, RCX, 1, 0));
+                    a.alu_imm(ALU_ADD, RCX, 1);
+                    a.alu_imm(ALU_AND, RCX, 0xFF);
+                    a.movzx8(RDX, mem(R10, RCX, 1, 0));
+                }
+                else
+                {
+                    a.movzx8(RAX, mem(R10, operand & 0xFF));
+                    a.movzx8(RDX, mem(R10, (operand + 1) & 0xFF));
+                }
+                a.shl(RDX, 8);
+                a.alu(ALU_OR, RAX, RDX);
+            }
+            a.mov(RCX, RAX);
+            if (mode != &cpu_t::IDX)
+            {
+                dynamic_crossed = true;
+                a.alu(ALU_ADD, RCX, mode == &cpu_t::ABX ? REG_X : REG_Y);
+                a.alu_imm(ALU_AND, RCX, 0xFFFF);
+                a.mov(R9, RCX);
+                a.alu(ALU_XOR, R9, RAX);
+                a.alu_imm(ALU_AND, R9, 0xFF00);
+                a.setcc(CC_NE, R9);
+                a.movzx8(R9, R9);
+            }
+            a.mov(RDX, RCX);
+            a.shr(RDX, 8);
+            a.load64(R8, mem(R11, RDX, 8, (int32_t)page_table));
+            side_exit_if_null(R8, index);
+            a.movzx8(RDX, RCX);
+            a.alu64(ALU_ADD, R8, RDX);
+            target = mem(R8, 0);
+        }
+
+        if (pointer)
+        {
+            a.shr(RAX, 8);
+            a.store8(CTX(last_read), RAX);
+        }
+        else
+        {
+            a.store8_imm(CTX(last_read), last_fetch);
+        }
+        if (dynamic_crossed && has_page_penalty(jit_op))
+        {
+            a.alu32_mem(ALU_ADD, CTX(extra_cycles), R9);
+        }
+        if (access != jit_access_t::write)
+        {
+            a.movzx8(RAX, target);
+            a.store8(CTX(last_read), RAX);
+        }
+        operate(jit_op, target);
+    }
+
+    // Runs the operation on the data in eax. target is where a store or
+    // read-modify-write goes.
+    void block_compiler_t::operate(jit_op_t op, x64_mem_t target)
+    {
+        auto shift = [&](jit_op_t op)
+        {
+            switch (op)
+            {
+            case jit_op_t::asl:
+                a.shl(RAX, 1);
+                a.mov(R9, RAX);
+                a.shr(R9, 8);
+                a.alu_imm(ALU_AND, RAX, 0xFF);
+                break;
+            case jit_op_t::lsr:
+                a.mov(R9, RAX);
+                a.alu_imm(ALU_AND, R9, 0x01);
+                a.shr(RAX, 1);
+                break;
+            case jit_op_t::rol:
+                a.mov(R9, REG_P);
+                a.alu_imm(ALU_AND, R9, 0x01);
+                a.shl(RAX, 1);
+                a.alu(ALU_OR, RAX, R9);
+                a.mov(R9, RAX);
+                a.shr(R9, 8);
+                a.alu_imm(ALU_AND, RAX, 0xFF);
+                break;
+            default: // ror
+                a.mov(R9, REG_P);
+                a.alu_imm(ALU_AND, R9, 0x01);
+                a.shl(R9, 8);
+                a.alu(ALU_OR, RAX, R9);
+                a.mov(R9, RAX);
+                a.alu_imm(ALU_AND, R9, 0x01);
+                a.shr(RAX, 1);
+                break;
+            }
+            a.alu_imm(ALU_AND, REG_P, 0x7C);
+            a.alu(ALU_OR, REG_P, R9);
+            or_nz(RAX);
+        };
+        auto step = [&](int reg, x64_alu_t alu_op)
+        {
+            a.alu_imm(alu_op, reg, 1);
+            a.alu_imm(ALU_AND, reg, 0xFF);
+            set_nz(reg);
+        };
+        auto transfer = [&](int from, int to, bool flags)
+        {
+            a.mov(to, from);
+            if (flags)
+            {
+                set_nz(to);
+            }
+        };
+        auto logic = [&](x64_alu_t alu_op)
+        {
+            a.alu(alu_op, REG_A, RAX);
+            set_nz(REG_A);
+        };
+
+        switch (op)
+        {
+        case jit_op_t::lda: a.mov(REG_A, RAX); set_nz(RAX); break;
+        case jit_op_t::ldx: a.mov(REG_X, RAX); set_nz(RAX); break;
+        case jit_op_t::ldy: a.mov(REG_Y, RAX); set_nz(RAX); break;
+        case jit_op_t::sta: a.store8(target, REG_A); break;
+        case jit_op_t::stx: a.store8(target, REG_X); break;
+        case jit_op_t::sty: a.store8(target, REG_Y); break;
+        case jit_op_t::sbc: a.alu_imm(ALU_XOR, RAX, 0xFF); adc(); break;
+        case jit_op_t::adc: adc(); break;
+        case jit_op_t::and_: logic(ALU_AND); break;
+        case jit_op_t::ora: logic(ALU_OR); break;
+        case jit_op_t::eor: logic(ALU_XOR); break;
+        case jit_op_t::cmp: compare(REG_A); break;
+        case jit_op_t::cpx: compare(REG_X); break;
+        case jit_op_t::cpy: compare(REG_Y); break;
+        case jit_op_t::bit:
+            a.alu_imm(ALU_AND, REG_P, 0x3D);
+            a.mov(R9, RAX);
+            a.alu_imm(ALU_AND, R9, 0xC0);
+            a.alu(ALU_OR, REG_P, R9);
+            a.mov(RCX, REG_A);
+            a.alu(ALU_AND, RCX, RAX);
+            a.alu_imm(ALU_CMP, RCX, 1);
+            a.alu(ALU_SBB, R9, R9);
+            a.alu_imm(ALU_AND, R9, 0x02);
+            a.alu(ALU_OR, REG_P, R9);
+            break;
+        case jit_op_t::inc:
+        case jit_op_t::dec:
+            a.alu_imm(op == jit_op_t::inc ? ALU_ADD : ALU_SUB, RAX, 1);
+            a.alu_imm(ALU_AND, RAX, 0xFF);
+            a.store8(target, RAX);
+            set_nz(RAX);
+            break;
+        case jit_op_t::asl:
+        case jit_op_t::lsr:
+        case jit_op_t::rol:
+        case jit_op_t::ror:
+            shift(op);
+            a.store8(target, RAX);
+            break;
+        case jit_op_t::asl_acc:
+        case jit_op_t::lsr_acc:
+        case jit_op_t::rol_acc:
+        case jit_op_t::ror_acc:
+            a.mov(RAX, REG_A);
+            shift((jit_op_t)((int)op - (int)jit_op_t::asl_acc + (int)jit_op_t::asl));
+            a.mov(REG_A, RAX);
+            break;
+        case jit_op_t::inx: step(REG_X, ALU_ADD); break;
+        case jit_op_t::iny: step(REG_Y, ALU_ADD); break;
+        case jit_op_t::dex: step(REG_X, ALU_SUB); break;
+        case jit_op_t::dey: step(REG_Y, ALU_SUB); break;
+        case jit_op_t::tax: transfer(REG_A, REG_X, true); break;
+        case jit_op_t::tay: transfer(REG_A, REG_Y, true); break;
+        case jit_op_t::txa: transfer(REG_X, REG_A, true); break;
+        case jit_op_t::tya: transfer(REG_Y, REG_A, true); break;
+        case jit_op_t::tsx: transfer(REG_SP, REG_X, true); break;
+        case jit_op_t::txs: transfer(REG_X, REG_SP, false); break;
+        case jit_op_t::clc: a.alu_imm(ALU_AND, REG_P, (uint8_t)~0x01); break;
+        case jit_op_t::sec: a.alu_imm(ALU_OR, REG_P, 0x01); break;
+        case jit_op_t::clv: a.alu_imm(ALU_AND, REG_P, (uint8_t)~0x40); break;
+        case jit_op_t::cld: a.alu_imm(ALU_AND, REG_P, (uint8_t)~0x08); break;
+        case jit_op_t::sed: a.alu_imm(ALU_OR, REG_P, 0x08); break;
+        case jit_op_t::php:
+            a.alu_imm(ALU_OR, REG_P, 0x10);
+            push(REG_P);
+            break;
+        case jit_op_t::pha:
+            push(REG_A);
+            break;
+        case jit_op_t::pla:
+            pull(REG_A);
+            a.store8(CTX(last_read), REG_A);
+            set_nz(REG_A);
+            break;
+        default: // nop
+            break;
+        }
+    }
+
+    // A + eax + C into A, with the same flags as cpu_t::ADC
+    void block_compiler_t::adc()
+    {
+        a.mov(R8, REG_P);
+        a.alu_imm(ALU_AND, R8, 0x01);
+        a.alu(ALU_ADD, R8, REG_A);
+        a.alu(ALU_ADD, R8, RAX);
+        // V = ~(A ^ data) & (A ^ result) & 0x80
+        a.mov(R9, REG_A);
+        a.alu(ALU_XOR, R9, RAX);
+        a.not_(R9);
+        a.mov(RCX, REG_A);
+        a.alu(ALU_XOR, RCX, R8);
+        a.alu(ALU_AND, R9, RCX);
+        a.alu_imm(ALU_AND, R9, 0x80);
+        a.shr(R9, 1);
+        a.alu_imm(ALU_AND, REG_P, 0x3C);
+        a.alu(ALU_OR, REG_P, R9);
+        a.mov(R9, R8);
+        a.shr(R9, 8);
+        a.alu(ALU_OR, REG_P, R9);
+        a.mov(REG_A, R8);
+        a.alu_imm(ALU_AND, REG_A, 0xFF);
+        or_nz(REG_A);
+    }
+
+    void block_compiler_t::compare(int reg)
+    {
+        a.mov(RCX, reg);
+        a.alu_imm(ALU_AND, REG_P, 0x7C);
+        // C = reg >= data
+        a.alu(ALU_CMP, RCX, RAX);
+        a.alu(ALU_SBB, R9, R9);
+        a.alu_imm(ALU_ADD, R9, 1);
+        a.alu(ALU_OR, REG_P, R9);
+        a.alu(ALU_SUB, RCX, RAX);
+        a.alu_imm(ALU_AND, RCX, 0xFF);
+        or_nz(RCX);
+    }
+#endif
+
+    jit_t::jit_t(cpu_t& cpu, bus_t& bus, jit_mode_t mode)
+        : mode(mode),
+          blocks_compiled(0),
+          blocks_run(0),
+          mismatches(0),
+          cpu(cpu),
+          bus(bus),
+          ctx{},
+          cpu_pages{},
+          uncached{},
+          map_generation(0),
+          pages_generation(UINT32_MAX),
+          ram_mapped(false),
+          next_block(nullptr),
+          next_pc(0),
+          skip_begin(0),
+          skip_end(0),
+          skip_generation(0),
+          code(nullptr),
+          code_used(0)
+    {
+        for (block_t& block : uncached)
+        {
+            block.state = block_state_t::failed;
+        }
+#ifdef NES_JIT_X64
+#ifdef _WIN32
+        code = (uint8_t*)VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+        void* memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        code = memory == MAP_FAILED ? nullptr : (uint8_t*)memory;
+#endif
+        if (!code)
+        {
+            SPDLOG_ERROR("Failed to allocate memory for JIT code");
+        }
+#endif
+    }
+
+    jit_t::~jit_t()
+    {
+        release_code();
+    }
+
+    bool jit_t::is_supported()
+    {
+#ifdef NES_JIT_X64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void jit_t::clear()
+    {
+        rom_pages.clear();
+        std::ranges::fill(cpu_pages, nullptr);
+        next_block = nullptr;
+        skip_end = skip_begin;
+        code_used = 0;
+    }
+
+    // Switches the pages holding [start, start + size) between read/write
+    // and read/execute
+    bool jit_t::protect_code(uint8_t* start, size_t size, bool writable)
+    {
+#ifdef NES_JIT_X64
+        uintptr_t first = (uintptr_t)start & ~(CODE_PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)start + size + CODE_PAGE_SIZE - 1) & ~(CODE_PAGE_SIZE - 1);
+#ifdef _WIN32
+        DWORD old_protect;
+        bool changed = VirtualProtect((void*)first, end - first,
+            writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old_protect) != 0;
+        if (changed && !writable)
+        {
+            FlushInstructionCache(GetCurrentProcess(), start, size);
+        }
+#else
+        bool changed = mprotect((void*)first, end - first,
+            writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+        if (!changed)
+        {
+            SPDLOG_ERROR("Failed to make JIT code {}", writable ? "writable" : "executable");
+        }
+        return changed;
+#else
+        return false;
+#endif
+    }
+
+    // Frees the code buffer, which stops any more blocks from compiling or
+    // running
+    void jit_t::release_code()
+    {
+#ifdef NES_JIT_X64
+        if (code)
+        {
+#ifdef _WIN32
+            VirtualFree(code, 0, MEM_RELEASE);
+#else
+            munmap(code, CODE_SIZE);
+#endif
+        }
+#endif
+        code = nullptr;
+        clear();
+    }
+
+    // Compiled code indexes the page tables directly, and assumes the 2KB
+    // of RAM is mirrored through the first 8KB as the NES maps it
+    void jit_t::update_pages()
+    {
+        if (pages_generation == map_generation)
+        {
+            return;
+        }
+        pages_generation = map_generation;
+        writable_pages.clear();
+        for (size_t page = 0; page < std::size(ctx.read_pages); page++)
+        {
+            uint16_t addr = (uint16_t)(page * bus_t::PAGE_SIZE);
+            ctx.read_pages[page] = bus.get_read_memory(addr);
+            ctx.write_pages[page] = bus.get_write_memory(addr);
+            if (ctx.write_pages[page]
+                && std::ranges::find(writable_pages, ctx.write_pages[page]) == writable_pages.end())
+            {
+                writable_pages.push_back(ctx.write_pages[page]);
+            }
+        }
+        ctx.ram = ctx.read_pages[0];
+        ram_mapped = ctx.ram != nullptr;
+        for (size_t page = 0; page < 0x2000 / bus_t::PAGE_SIZE; page++)
+        {
+            uint8_t* mirror = ctx.ram + page % 8 * bus_t::PAGE_SIZE;
+            if (ctx.read_pages[page] != mirror || ctx.write_pages[page] != mirror)
+            {
+                ram_mapped = false;
+            }
+        }
+    }
+
+    jit_t::block_t* jit_t::find_block(uint16_t pc)
+    {
+        // Some mappers switch banks constantly, so the page tables are only
+        // rebuilt when a block is about to use them
+        if (map_generation != bus.get_map_generation())
+        {
+            map_generation = bus.get_map_generation();
+            std::ranges::fill(cpu_pages, nullptr);
+        }
+        page_t* page = cpu_pages[pc / bus_t::PAGE_SIZE];
+        if (!page)
+        {
+            page = find_page(pc);
+        }
+        return &(*page)[pc % bus_t::PAGE_SIZE];
+    }
+
+    // Kept out of find_block(), which runs before every interpreted
+    // instruction
+    jit_t::page_t* jit_t::find_page(uint16_t pc)
+    {
+        const uint8_t* memory = bus.get_rom_page(pc);
+        page_t* page = memory
+            ? &rom_pages[{ memory, (uint8_t)(pc / bus_t::PAGE_SIZE) }]
+            : &uncached;
+        cpu_pages[pc / bus_t::PAGE_SIZE] = page;
+        return page;
+    }
+
+    // Looks up the block at pc and returns it if it's compiled. Most calls
+    // find a block that has failed to compile, so everything else is left
+    // to count_entry().
+    jit_t::block_t* jit_t::hot_block(uint16_t pc)
+    {
+        block_t* block = find_block(pc);
+        if (block->state == block_state_t::cold)
+        {
+            block = count_entry(block, pc);
+        }
+        return block && block->state == block_state_t::compiled ? block : nullptr;
+    }
+
+    // Counts an entry to a cold block, compiling it once hot. Returns the
+    // block, or null if compiling it dropped all blocks.
+    jit_t::block_t* jit_t::count_entry(block_t* block, uint16_t pc)
+    {
+        if (++block->count < HOT_THRESHOLD)
+        {
+            return block;
+        }
+        if (code_used + MAX_BLOCK_CODE > CODE_SIZE)
+        {
+            // Start over rather than track which blocks are still hot
+            clear();
+            return nullptr;
+        }
+        update_pages();
+        if (!ram_mapped)
+        {
+            return block;
+        }
+        bool compiled = compile(*block, pc, bus.get_rom_page(pc));
+        if (!code)
+        {
+            return nullptr;
+        }
+        block->state = compiled ? block_state_t::compiled : block_state_t::failed;
+        return block;
+    }
+
+    int jit_t::next_block_cycles()
+    {
+        uint16_t pc = cpu.pc;
+        if (pc - skip_begin < skip_end - skip_begin && skip_generation == bus.get_map_generation())
+        {
+            return 0;
+        }
+        if (!code)
+        {
+            return 0;
+        }
+        next_pc = pc;
+        next_block = hot_block(next_pc);
+        if (!next_block)
+        {
+            skip_failed(find_block(next_pc), next_pc);
+            return 0;
+        }
+        return next_block->max_cycles;
+    }
+
+    // Skips lookups over a page that isn't ROM, or over a block too short
+    // to compile, since blocks starting at its later instructions are
+    // shorter still
+    void jit_t::skip_failed(block_t* block, uint16_t pc)
+    {
+        if (cpu_pages[pc / bus_t::PAGE_SIZE] == &uncached)
+        {
+            skip_begin = pc & ~(bus_t::PAGE_SIZE - 1);
+            skip_end = skip_begin + bus_t::PAGE_SIZE;
+        }
+        else if (block->state == block_state_t::failed && block->pcs.size() < MIN_BLOCK_INSTRUCTIONS)
+        {
+            skip_begin = pc;
+            skip_end = std::max<uint32_t>(block->end, pc + 1);
+        }
+        else
+        {
+            return;
+        }
+        skip_generation = map_generation;
+    }
+
+    bool jit_t::run(uint64_t max_cycles)
+    {
+        block_t* block = next_block;
+        next_block = nullptr;
+        if (!block || next_pc != cpu.pc)
+        {
+            return false;
+        }
+        update_pages();
+        if (!ram_mapped)
+        {
+            return false;
+        }
+
+        ctx.a = cpu.ra;
+        ctx.x = cpu.rx;
+        ctx.y = cpu.ry;
+        ctx.sp = cpu.sp;
+        ctx.p = cpu.status.reg;
+        ctx.last_read = bus.get_open_bus_value();
+        ctx.extra_cycles = 0;
+        if (mode == jit_mode_t::differential)
+        {
+            return run_differential(*block);
+        }
+
+        // Blocks that follow each other run back to back, with the
+        // registers staying in the context, for as long as the next one is
+        // sure to end in time. Nothing but a block can change the memory
+        // map or the interrupt flag in between.
+        uint64_t cycles = 0;
+        uint16_t pc = cpu.pc;
+        while (block && cycles + block->max_cycles <= max_cycles)
+        {
+            uint32_t count = block->code(&ctx);
+            if (count == 0)
+            {
+                break;
+            }
+            uint32_t end = (uint32_t)block->pcs.size() - 1;
+            pc = count == end ? ctx.pc : block->pcs[count];
+            cycles += block->cycles[count] + ctx.extra_cycles;
+            ctx.extra_cycles = 0;
+            blocks_run++;
+            // A side exit leaves the next instruction to the interpreter
+            block = count == end ? hot_block(pc) : nullptr;
+        }
+        if (cycles == 0)
+        {
+            return false;
+        }
+        cpu.ra = ctx.a;
+        cpu.rx = ctx.x;
+        cpu.ry = ctx.y;
+        cpu.sp = ctx.sp;
+        cpu.status.reg = ctx.p;
+        cpu.pc = pc;
+        bus.set_open_bus(ctx.last_read);
+        // As if the blocks were one instruction that cpu_t::clock() just ran
+        cpu.cycles_until_next_instruction = (int)cycles - 1;
+        return true;
+    }
+
+    // Runs the block, then rewinds and runs the interpreter over the same
+    // instructions, which gives the result that is kept
+    bool jit_t::run_differential(block_t& block)
+    {
+        std::vector<uint8_t> before;
+        for (uint8_t* page : writable_pages)
+        {
+            before.insert(before.end(), page, page + bus_t::PAGE_SIZE);
+        }
+
+        uint32_t count = block.code(&ctx);
+        if (count == 0)
+        {
+            return false;
+        }
+        jit_context_t result = ctx;
+        std::vector<uint8_t> after;
+        for (size_t i = 0; i < writable_pages.size(); i++)
+        {
+            uint8_t* page = writable_pages[i];
+            after.insert(after.end(), page, page + bus_t::PAGE_SIZE);
+            memcpy(page, &before[i * bus_t::PAGE_SIZE], bus_t::PAGE_SIZE);
+        }
+
+        uint16_t start = cpu.pc;
+        int cycles = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            cpu.cycles_until_next_instruction = 0;
+            cpu.clock();
+            cycles += cpu.cycles_until_next_instruction + 1;
+        }
+        uint16_t pc = count == block.pcs.size() - 1 ? result.pc : block.pcs[count];
+
+        bool memory_matches = true;
+        for (size_t i = 0; i < writable_pages.size(); i++)
+        {
+            if (memcmp(writable_pages[i], &after[i * bus_t::PAGE_SIZE], bus_t::PAGE_SIZE) != 0)
+            {
+                memory_matches = false;
+            }
+        }
+        if (cpu.ra != result.a
+            || cpu.rx != result.x
+            || cpu.ry != result.y
+            || cpu.sp != result.sp
+            || cpu.status.reg != result.p
+            || cpu.pc != pc
+            || bus.get_open_bus_value() != result.last_read
+            || cycles != block.cycles[count] + (int)result.extra_cycles
+            || !memory_matches)
+        {
+            SPDLOG_ERROR("JIT block at {:04X} differs from the interpreter after {} instructions: "
+                "A:{:02X}/{:02X} X:{:02X}/{:02X} Y:{:02X}/{:02X} P:{:02X}/{:02X} SP:{:02X}/{:02X} "
+                "PC:{:04X}/{:04X} cycles:{}/{}{}",
+                start, count,
+                result.a, cpu.ra, result.x, cpu.rx, result.y, cpu.ry, result.p, cpu.status.reg,
+                result.sp, cpu.sp, pc, cpu.pc,
+                block.cycles[count] + result.extra_cycles, cycles,
+                memory_matches ? "" : ", memory differs");
+            mismatches++;
+            block.state = block_state_t::failed;
+        }
+        cpu.cycles_until_next_instruction = cycles - 1;
+        blocks_run++;
+        return true;
+    }
+
+    bool jit_t::compile(block_t& block, uint16_t pc, const uint8_t* page)
+    {
+#ifdef NES_JIT_X64
+        struct decoded_t
+        {
+            uint8_t op;
+            jit_op_t jit_op;
+            uint16_t operand;
+        };
+        std::vector<decoded_t> decoded;
+        block.pcs.clear();
+        block.cycles.clear();
+        int cycles = 0;
+        int max_cycles = 0;
+        uint16_t start_page = pc / bus_t::PAGE_SIZE;
+        while (block.pcs.size() < MAX_BLOCK_INSTRUCTIONS && pc / bus_t::PAGE_SIZE == start_page)
+        {
+            uint8_t op = page[pc % bus_t::PAGE_SIZE];
+            const instruction_t& instruction = cpu_t::instructions[op];
+            int byte_count = instruction.byte_count;
+            jit_op_t jit_op = get_jit_op(op);
+            // Operands in the next page may come from a different bank
+            if (jit_op == jit_op_t::none || pc % bus_t::PAGE_SIZE + byte_count > bus_t::PAGE_SIZE)
+            {
+                break;
+            }
+            uint16_t operand = 0;
+            for (int i = byte_count - 1; i > 0; i--)
+            {
+                operand = operand << 8 | page[(pc + i) % bus_t::PAGE_SIZE];
+            }
+            decoded.push_back({ op, jit_op, operand });
+            block.pcs.push_back(pc);
+            block.cycles.push_back((uint16_t)cycles);
+            cycles += instruction.cycles;
+            max_cycles += instruction.cycles;
+            if (is_branch(jit_op))
+            {
+                max_cycles += 2;
+            }
+            else if (has_page_penalty(jit_op))
+            {
+                max_cycles += 1;
+            }
+            pc += byte_count;
+            if (ends_block(jit_op))
+            {
+                break;
+            }
+        }
+        block.end = pc;
+        // Shorter blocks cost more to enter than they save
+        uint32_t count = (uint32_t)block.pcs.size();
+        if (count < MIN_BLOCK_INSTRUCTIONS)
+        {
+            return false;
+        }
+        block.pcs.push_back(pc);
+        block.cycles.push_back((uint16_t)cycles);
+        block.max_cycles = (uint16_t)max_cycles;
+
+        // N and Z are only worked out where something can see them: a
+        // branch or PHP, or the interpreter after any exit
+        std::vector<bool> nz_live(count);
+        bool live = true;
+        for (uint32_t i = count; i-- > 0;)
+        {
+            nz_live[i] = live;
+            const decoded_t& d = decoded[i];
+            if (writes_nz(d.jit_op))
+            {
+                live = false;
+            }
+            if (reads_nz(d.jit_op) || may_side_exit(cpu_t::instructions[d.op], d.jit_op, d.operand))
+            {
+                live = true;
+            }
+        }
+
+        block_compiler_t compiler;
+        compiler.prologue();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            compiler.nz_live = nz_live[i];
+            compiler.instruction(i, block.pcs[i], decoded[i].op, decoded[i].jit_op, decoded[i].operand);
+        }
+        if (!ends_block(decoded.back().jit_op))
+        {
+            compiler.finish(pc, count);
+        }
+        compiler.epilogue();
+
+        const std::vector<uint8_t>& buf = compiler.a.buf;
+        if (buf.size() > MAX_BLOCK_CODE)
+        {
+            return false;
+        }
+        // The buffer is only ever writable or executable, never both
+        uint8_t* start = code + code_used;
+        if (!protect_code(start, buf.size(), true))
+        {
+            return false;
+        }
+        memcpy(start, buf.data(), buf.size());
+        if (!protect_code(start, buf.size(), false))
+        {
+            // Blocks compiled earlier may share the page, so none can run
+            release_code();
+            return false;
+        }
+        block.code = (block_fn)start;
+        code_used += (buf.size() + 15) & ~(size_t)15;
+        blocks_compiled++;
+        return true;
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include "pch.h"
+#include "cpu.h"
+#include "bus.h"
+
+#include <array>
+#include <map>
+#include <vector>
+
+namespace nes
+{
+    enum class jit_mode_t
+    {
+        off,
+        // Runs compiled blocks in place of the interpreter
+        on,
+        // Runs each compiled block, then runs the interpreter over the same
+        // instructions from the same state and keeps the interpreter's
+        // result. Any difference is logged and the block is dropped.
+        differential,
+    };
+
+    // The machine state compiled code works on. Pages are the bus's memory
+    // mappings, or null where the bus goes through handlers.
+    struct jit_context_t
+    {
+        uint8_t* read_pages[0x10000 / bus_t::PAGE_SIZE];
+        uint8_t* write_pages[0x10000 / bus_t::PAGE_SIZE];
+        uint8_t* ram;
+        uint32_t extra_cycles;
+        uint16_t pc;
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t sp;
+        uint8_t p;
+        uint8_t last_read;
+    };
+
+    // Translates hot basic blocks in PRG ROM into x86-64 code. Blocks run
+    // as one long instruction, so the caller must only run them when nothing
+    // the CPU could observe (an interrupt, DMA or PPU access) can happen
+    // before they end. Blocks only access memory that the bus maps directly
+    // and return to the interpreter before any access that would go through
+    // a handler. The code buffer is never writable and executable at once.
+    // On other architectures nothing is compiled.
+    struct jit_t
+    {
+        using block_fn = uint32_t (*)(jit_context_t* ctx);
+
+        static constexpr int HOT_THRESHOLD = 32;
+        static constexpr int MIN_BLOCK_INSTRUCTIONS = 4;
+        static constexpr int MAX_BLOCK_INSTRUCTIONS = 64;
+        static constexpr size_t CODE_SIZE = 4 * 1024 * 1024;
+        static constexpr size_t MAX_BLOCK_CODE = 64 * 1024;
+
+        jit_t(cpu_t& cpu, bus_t& bus, jit_mode_t mode);
+        ~jit_t();
+        jit_t(const jit_t&) = delete;
+        jit_t& operator=(const jit_t&) = delete;
+
+        static bool is_supported();
+
+        // Counts an entry to the block at the CPU's pc, compiling it once hot.
+        // Returns the most cycles the block can take, or 0 if there is no
+        // compiled block to run.
+        int next_block_cycles();
+        // Runs the block next_block_cycles() just returned, then each block
+        // that follows while it is sure to end within max_cycles. The CPU
+        // must be between instructions. Returns false, leaving the machine
+        // untouched, if the interpreter should run the next instruction
+        // instead.
+        bool run(uint64_t max_cycles);
+        // Drops all compiled code. Must be called when the ROM changes.
+        void clear();
+
+        jit_mode_t mode;
+        uint64_t blocks_compiled;
+        uint64_t blocks_run;
+        uint64_t mismatches;
+
+    private:
+        enum class block_state_t : uint8_t
+        {
+            cold,
+            compiled,
+            failed,
+        };
+
+        struct block_t
+        {
+            block_fn code;
+            block_state_t state;
+            uint32_t count;
+            uint16_t max_cycles;
+            // The address after the last instruction, also set when the
+            // block is too short to compile
+            uint16_t end;
+            // Address and cycles before each instruction, with one more
+            // entry for the end of the block
+            std::vector<uint16_t> pcs;
+            std::vector<uint16_t> cycles;
+        };
+
+        using page_t = std::array<block_t, bus_t::PAGE_SIZE>;
+
+        block_t* find_block(uint16_t pc);
+        page_t* find_page(uint16_t pc);
+        block_t* hot_block(uint16_t pc);
+        block_t* count_entry(block_t* block, uint16_t pc);
+        void skip_failed(block_t* block, uint16_t pc);
+        bool compile(block_t& block, uint16_t pc, const uint8_t* page);
+        bool protect_code(uint8_t* start, size_t size, bool writable);
+        void release_code();
+        void update_pages();
+        bool run_differential(block_t& block);
+
+        cpu_t& cpu;
+        bus_t& bus;
+        jit_context_t ctx;
+        // The same ROM page mapped at two addresses compiles differently,
+        // so pages are keyed by both
+        std::map<std::pair<const uint8_t*, uint8_t>, page_t> rom_pages;
+        // Pages by CPU page for the current memory map, or null if not
+        // looked up since the map last changed
+        page_t* cpu_pages[0x10000 / bus_t::PAGE_SIZE];
+        // Stands in for pages that aren't ROM
+        page_t uncached;
+        // Distinct writable pages, which differential mode snapshots
+        std::vector<uint8_t*> writable_pages;
+        uint32_t map_generation;
+        uint32_t pages_generation;
+        bool ram_mapped;
+        // What next_block_cycles() found, for run()
+        block_t* next_block;
+        uint16_t next_pc;
+        // Addresses with no block to run until the memory map changes,
+        // which next_block_cycles() doesn't look up
+        uint32_t skip_begin;
+        uint32_t skip_end;
+        uint32_t skip_generation;
+        uint8_t* code;
+        size_t code_used;
+    };
+}
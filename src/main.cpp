@@ -13,6 +13,9 @@
 #include "imgui_impl_sdlrenderer3.h"
 
 #include "nes.h"
+#include "rewind.h"
+#include "movie.h"
+#include "profiler.h"
 
 #include <fstream>
 #include <deque>
@@ -22,11 +25,15 @@
 static constexpr size_t LOG_MAX_LINES = 512;
 static constexpr size_t AUDIO_SAMPLE_RATE = 48000;
 static constexpr size_t AUDIO_MAX_LATENCY_MS = 100;
+static constexpr size_t AUDIO_BUFFER_LENGTH = AUDIO_SAMPLE_RATE / 10;
+static constexpr size_t TURBO_TIME_BUDGET_MS = 12;
 static constexpr size_t APU_HISTORY_LENGTH = AUDIO_SAMPLE_RATE * 2;
 static constexpr float APU_MIN_VIEWPORT = -2.0f;
 static constexpr float APU_MAX_VIEWPORT = 0.0f;
 static constexpr int CPU_DISM_NEARBY = 16;
 
+static_assert(nes::DEBUG_ENABLED, "The debugger windows need the core built without NES_NO_DEBUG");
+
 static constexpr SDL_AudioSpec audio_spec = {
     .format = SDL_AUDIO_F32,
     .channels = 1,
@@ -125,6 +132,13 @@ struct debug_image_t
     uint8_t data[Width * Height] = { 0 };
 };
 
+enum class movie_mode_t
+{
+    none,
+    recording,
+    playing,
+};
+
 enum class memory_edit_type_t
 {
     none,
@@ -146,11 +160,32 @@ static struct
     SDL_Texture* screen_texture = nullptr;
 
     SDL_AudioStream *audio_stream = nullptr;
-    float audio_tick_counter = 0;
+    struct
+    {
+        nes::audio_output_t output;
+        float mixed[AUDIO_BUFFER_LENGTH];
+        uint8_t pulse1[AUDIO_BUFFER_LENGTH];
+        uint8_t pulse2[AUDIO_BUFFER_LENGTH];
+        uint8_t triangle[AUDIO_BUFFER_LENGTH];
+        uint8_t noise[AUDIO_BUFFER_LENGTH];
+        uint8_t dmc[AUDIO_BUFFER_LENGTH];
+    } audio_buffer;
     std::vector<float> new_samples;
     float last_sample = 0.0f;
 
     std::unique_ptr<nes::nes_t> nes;
+    nes::rewind_t rewind;
+    std::vector<uint8_t> run_ahead_state;
+    nes::profiler_t profiler;
+
+    struct
+    {
+        nes::movie_t movie;
+        movie_mode_t mode = movie_mode_t::none;
+        uint64_t frame = 0;
+        uint8_t pending_events = 0;
+        std::optional<uint64_t> desync_frame;
+    } movie;
 
     struct
     {
@@ -160,6 +195,10 @@ static struct
         int show_pixel_trace = 0;
         bool pause = false;
         int emulation_speed = 1;
+        int run_ahead = 0;
+        bool turbo = false;
+        bool enable_rewind = true;
+        bool rewinding = false;
         std::optional<nes::pixel_trace_t> pixel_trace;
         std::string cart_name;
         memory_edit_type_t memory_edit_mode = memory_edit_type_t::none;
@@ -226,6 +265,7 @@ static ImVec2 operator-(const ImVec2& a, const ImVec2& b)
 
 static void audio_callback(void* userdata, SDL_AudioStream* stream, int additional_amount, int total_amount)
 {
+    nes::profile_zone_t zone(ctx.profiler, "audio_callback");
     if (additional_amount == 0)
     {
         return;
@@ -257,16 +297,108 @@ static void clear_apu_history()
     std::fill(ctx.debug_apu.mixer_history.begin(), ctx.debug_apu.mixer_history.end(), 0.0f);
 }
 
+static std::string get_movie_file()
+{
+    return ctx.debug_control.cart_name + ".nesm";
+}
+
+// Resets the machine and records from power on until stopped
+static void start_movie_recording()
+{
+    ctx.movie.movie.start_recording(*ctx.nes);
+    ctx.movie.mode = movie_mode_t::recording;
+    ctx.movie.frame = 0;
+    ctx.movie.pending_events = 0;
+    ctx.rewind.clear();
+    clear_apu_history();
+}
+
+static void start_movie_playback()
+{
+    std::string file = get_movie_file();
+    std::ifstream stream(file, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(stream)), {});
+    if (!stream.is_open() || !ctx.movie.movie.load(data.data(), data.size()))
+    {
+        SPDLOG_ERROR("Failed to load movie: {}", file);
+        return;
+    }
+    if (!ctx.movie.movie.matches(*ctx.nes))
+    {
+        SPDLOG_ERROR("Movie was recorded with a different ROM: {}", file);
+        return;
+    }
+    if (!ctx.movie.movie.seek(*ctx.nes, 0))
+    {
+        SPDLOG_ERROR("Failed to start movie: {}", file);
+        return;
+    }
+    ctx.movie.mode = movie_mode_t::playing;
+    ctx.movie.frame = 0;
+    ctx.movie.desync_frame.reset();
+    ctx.rewind.clear();
+    clear_apu_history();
+}
+
+static void stop_movie()
+{
+    if (ctx.movie.mode == movie_mode_t::recording)
+    {
+        std::string file = get_movie_file();
+        std::vector<uint8_t> data;
+        ctx.movie.movie.save(data);
+        std::ofstream stream(file, std::ios::binary);
+        stream.write((const char*)data.data(), data.size());
+        if (!stream.good())
+        {
+            SPDLOG_ERROR("Failed to save movie: {}", file);
+        }
+        else
+        {
+            SPDLOG_INFO("Saved movie: {}", file);
+        }
+    }
+    ctx.movie.mode = movie_mode_t::none;
+}
+
+static void stop_trace()
+{
+    ctx.profiler.stop();
+    std::string file = "trace.json";
+    std::string json;
+    ctx.profiler.save(json);
+    std::ofstream stream(file, std::ios::binary);
+    stream.write(json.data(), json.size());
+    if (!stream.good())
+    {
+        SPDLOG_ERROR("Failed to save trace: {}", file);
+    }
+    else
+    {
+        SPDLOG_INFO("Saved trace: {}", file);
+    }
+}
+
 static void do_action(action_t action)
 {
     switch (action)
     {
     case action_t::reset:
-        ctx.nes->reset();
+        if (ctx.movie.mode == movie_mode_t::recording)
+        {
+            // Recorded and applied at the start of the next frame
+            ctx.movie.pending_events |= nes::movie_t::EVENT_RESET;
+        }
+        else
+        {
+            ctx.nes->reset();
+        }
         clear_apu_history();
         break;
     case action_t::unload_cart:
+        stop_movie();
         ctx.nes->unload_cart();
+        ctx.rewind.clear();
         ctx.debug_control.cart_name.clear();
         clear_apu_history();
         break;
@@ -311,6 +443,7 @@ static void write_texture(
     const uint8_t* colour_indices,
     std::function<void(uint8_t*, int, int, int)> post_process = nullptr)
 {
+    nes::profile_zone_t zone(ctx.profiler, "write_texture");
     float fwidth;
     float fheight;
     int width;
@@ -414,6 +547,7 @@ static void draw_separator()
 
 static void show_log()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_log");
     if (ImGui::Begin("Log"))
     {
         for (const auto& log : ctx.debug_log.logs)
@@ -434,6 +568,7 @@ static void show_log()
 
 static void show_cpu_dism()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_cpu_dism");
     struct disassembly_t
     {
         uint16_t addr;
@@ -586,7 +721,7 @@ static void show_cpu_dism()
                     .args = std::move(args),
                 });
 
-                i += instruction.byte_count();
+                i += instruction.byte_count;
             }
 
             if (cur_entry != -1)
@@ -714,6 +849,7 @@ static void show_memory(nes::bus_t& bus, size_t end_addr, memory_edit_type_t typ
 
 static void show_ram()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_ram");
     ctx.debug_control.memory_edit_window_active &= ~1;
     if (ImGui::Begin("RAM"))
     {
@@ -728,6 +864,7 @@ static void show_ram()
 
 static void show_cpu_memory_map()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_cpu_memory_map");
     ctx.debug_control.memory_edit_window_active &= ~2;
     if (ImGui::Begin("CPU MAP"))
     {
@@ -742,6 +879,7 @@ static void show_cpu_memory_map()
 
 static void show_ppu_memory_map()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_ppu_memory_map");
     ctx.debug_control.memory_edit_window_active &= ~4;
     if (ImGui::Begin("PPU MAP"))
     {
@@ -754,8 +892,138 @@ static void show_ppu_memory_map()
     ImGui::End();
 }
 
+static void show_bus_counters(const char* label, const nes::bus_t& bus)
+{
+    const auto& counters = bus.get_counters();
+    ImGui::PushID(label);
+    ImGui::Text("Open bus reads:   %llu", (unsigned long long)counters.open_bus_reads);
+    ImGui::Text("Unhandled writes: %llu", (unsigned long long)counters.unhandled_writes);
+
+    ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg;
+    if (ImGui::BeginTable("Handlers", 3, flags))
+    {
+        ImGui::TableSetupColumn("Handler");
+        ImGui::TableSetupColumn("Reads");
+        ImGui::TableSetupColumn("Writes");
+        ImGui::TableHeadersRow();
+        auto show_handlers = [](const auto& handlers, int column)
+        {
+            for (const auto& handler : handlers)
+            {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::Text("%04X-%04X", handler.begin, handler.end);
+                ImGui::TableSetColumnIndex(column);
+                ImGui::Text("%llu", (unsigned long long)handler.count);
+            }
+        };
+        show_handlers(counters.read_handlers, 1);
+        show_handlers(counters.write_handlers, 2);
+        ImGui::EndTable();
+    }
+
+    // Only pages that have been accessed
+    if (ImGui::BeginTable("Pages", 3, flags))
+    {
+        ImGui::TableSetupColumn("Page");
+        ImGui::TableSetupColumn("Reads");
+        ImGui::TableSetupColumn("Writes");
+        ImGui::TableHeadersRow();
+        for (size_t page = 0; page < counters.page_reads.size(); page++)
+        {
+            if (counters.page_reads[page] == 0 && counters.page_writes[page] == 0)
+            {
+                continue;
+            }
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%02zX00", page);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)counters.page_reads[page]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)counters.page_writes[page]);
+        }
+        ImGui::EndTable();
+    }
+    ImGui::PopID();
+}
+
+static void show_counters()
+{
+    nes::profile_zone_t zone(ctx.profiler, "show_counters");
+    if (ImGui::Begin("COUNTERS"))
+    {
+        if (!nes::COUNTERS_ENABLED)
+        {
+            ImGui::TextWrapped("Counters are compiled out. Build with NES_COUNTERS=ON to enable them.");
+            ImGui::End();
+            return;
+        }
+
+        if (ImGui::Button("Reset"))
+        {
+            ctx.nes->cpu.reset_counters();
+            ctx.nes->cpu_bus.reset_counters();
+            ctx.nes->ppu_bus.reset_counters();
+        }
+
+        const auto& counters = ctx.nes->cpu.get_counters();
+        ImGui::Text("NMIs:                 %llu", (unsigned long long)counters.nmis);
+        ImGui::Text("IRQs:                 %llu", (unsigned long long)counters.irqs);
+        ImGui::Text("Page cross penalties: %llu", (unsigned long long)counters.page_cross_penalties);
+
+        if (ImGui::CollapsingHeader("Opcodes", ImGuiTreeNodeFlags_DefaultOpen))
+        {
+            // Most executed first
+            std::vector<uint8_t> ops;
+            for (int op = 0; op < 256; op++)
+            {
+                if (counters.opcodes[op])
+                {
+                    ops.push_back((uint8_t)op);
+                }
+            }
+            std::sort(ops.begin(), ops.end(), [&](uint8_t a, uint8_t b)
+            {
+                return counters.opcodes[a] > counters.opcodes[b];
+            });
+
+            if (ImGui::BeginTable("Opcodes", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+            {
+                ImGui::TableSetupColumn("Op");
+                ImGui::TableSetupColumn("Instruction");
+                ImGui::TableSetupColumn("Count");
+                ImGui::TableHeadersRow();
+                for (uint8_t op : ops)
+                {
+                    const auto& instruction = nes::cpu_t::instructions[op];
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%02X", op);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%s %s", instruction.opcode_name, instruction.addr_mode_name);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%llu", (unsigned long long)counters.opcodes[op]);
+                }
+                ImGui::EndTable();
+            }
+        }
+
+        if (ImGui::CollapsingHeader("CPU bus"))
+        {
+            show_bus_counters("CPU", ctx.nes->cpu_bus);
+        }
+        if (ImGui::CollapsingHeader("PPU bus"))
+        {
+            show_bus_counters("PPU", ctx.nes->ppu_bus);
+        }
+    }
+    ImGui::End();
+}
+
 static void show_palette()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_palette");
     if (ImGui::Begin("PALETTE"))
     {
         for (uint8_t is_fg = 0; is_fg < 2; is_fg++)
@@ -811,6 +1079,7 @@ static void show_palette()
 
 static void show_pattern_table()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_pattern_table");
     if (ImGui::Begin("PATTERN TABLE"))
     {
         constexpr uint8_t colours[4] = { 0x0F, 0x00, 0x10, 0x20 };
@@ -869,6 +1138,7 @@ static void show_pattern_table()
 
 static void show_nametable()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_nametable");
     if (ImGui::Begin("NAMETABLE"))
     {
         size_t i = 0;
@@ -994,6 +1264,7 @@ static void show_nametable()
 
 static void show_sprites()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_sprites");
     if (ImGui::Begin("SPRITES"))
     {
         uint8_t sprite_size = ctx.nes->ppu.ppuctrl.sprite_size == 0 ? 8 : 16;
@@ -1104,6 +1375,7 @@ static void show_sprites()
 
 static void show_control()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_control");
     if (ImGui::Begin("Control"))
     {
         ImGui::Text("FPS: %.1f", ImGui::GetIO().Framerate);
@@ -1193,6 +1465,76 @@ static void show_control()
         draw_separator();
         ImGui::SliderInt("Speed", &ctx.debug_control.emulation_speed, 1, 4, "%dx", ImGuiSliderFlags_NoInput);
         ImGui::Checkbox("Pause", &ctx.debug_control.pause);
+        ImGui::SameLine();
+        ImGui::Checkbox("Turbo", &ctx.debug_control.turbo);
+        ImGui::SameLine();
+        bool decode_cache = ctx.nes->cpu.is_decode_cache_enabled();
+        if (ImGui::Checkbox("Decode cache", &decode_cache))
+        {
+            ctx.nes->cpu.set_decode_cache(decode_cache);
+        }
+        ImGui::SliderInt("Run-ahead", &ctx.debug_control.run_ahead, 0, 4, "%d frames", ImGuiSliderFlags_NoInput);
+        if (ImGui::Checkbox("Rewind", &ctx.debug_control.enable_rewind) && !ctx.debug_control.enable_rewind)
+        {
+            ctx.rewind.clear();
+        }
+        ImGui::Text("History: %.1fs (%.1f MB)",
+            ctx.rewind.frame_count() / 60.0,
+            ctx.rewind.memory_used() / (1024.0 * 1024.0));
+
+        draw_separator();
+        if (ctx.movie.mode != movie_mode_t::none)
+        {
+            if (ImGui::Button("Stop movie"))
+            {
+                stop_movie();
+            }
+        }
+        else if (ctx.nes->cart)
+        {
+            if (ImGui::Button("Record movie"))
+            {
+                start_movie_recording();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Play movie"))
+            {
+                start_movie_playback();
+            }
+        }
+        switch (ctx.movie.mode)
+        {
+        case movie_mode_t::recording:
+            ImGui::Text("Recording frame %llu", (unsigned long long)ctx.movie.frame);
+            break;
+        case movie_mode_t::playing:
+            ImGui::Text("Playing frame %llu/%llu",
+                (unsigned long long)ctx.movie.frame,
+                (unsigned long long)ctx.movie.movie.frame_count());
+            break;
+        default:
+            break;
+        }
+        if (ctx.movie.desync_frame)
+        {
+            ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "Desynced at frame %llu",
+                (unsigned long long)*ctx.movie.desync_frame);
+        }
+
+        draw_separator();
+        if (ctx.profiler.is_recording())
+        {
+            if (ImGui::Button("Stop trace"))
+            {
+                stop_trace();
+            }
+            ImGui::SameLine();
+            ImGui::Text("%zu zones", ctx.profiler.zone_count());
+        }
+        else if (ImGui::Button("Record trace"))
+        {
+            ctx.profiler.start();
+        }
 
         draw_separator();
         ImGui::Checkbox("Fullscreen", &ctx.debug_control.fullscreen);
@@ -1209,6 +1551,7 @@ static void show_control()
 
 static void show_apu()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_apu");
     if (ImGui::Begin("APU"))
     {
         float window_width = ImGui::GetContentRegionAvail().x;
@@ -1302,6 +1645,7 @@ static void show_apu()
 
 static void show_screen()
 {
+    nes::profile_zone_t zone(ctx.profiler, "show_screen");
     ctx.debug_control.pixel_trace = std::nullopt;
     if (ImGui::Begin("DISPLAY"))
     {
@@ -1455,6 +1799,12 @@ static void handle_key_up(const SDL_KeyboardEvent& key)
     case SDLK_RCTRL:
         ctx.debug_control.show_pixel_trace &= ~2;
         break;
+    case SDLK_BACKSPACE:
+        ctx.debug_control.rewinding = false;
+        break;
+    case SDLK_TAB:
+        ctx.debug_control.turbo = false;
+        break;
     }
 }
 
@@ -1644,35 +1994,122 @@ static void handle_key_down(const SDL_KeyboardEvent& key)
     case SDLK_RCTRL:
         ctx.debug_control.show_pixel_trace |= 2;
         break;
+    case SDLK_BACKSPACE:
+        ctx.debug_control.rewinding = true;
+        break;
+    case SDLK_TAB:
+        ctx.debug_control.turbo = true;
+        break;
     }
 }
 
-static void on_clock()
+// Moves the samples produced since the last call into the audio queue and
+// the APU debugger histories
+static void consume_audio()
 {
-    constexpr float TICKS_PER_SAMPLE = (float)nes::ppu_t::DOTS_PER_SCANLINE
-        * (float)nes::ppu_t::SCANLINES
-        * (float)nes::ppu_t::FRAME_RATE
-        / (float)AUDIO_SAMPLE_RATE;
-    ctx.audio_tick_counter++;
-    float ticks_per_sample = TICKS_PER_SAMPLE * ctx.debug_control.emulation_speed;
-    while (ctx.audio_tick_counter >= ticks_per_sample)
-    {
-        float mixed_sample = ctx.nes->apu.get_mixed_sample();
+    nes::profile_zone_t zone(ctx.profiler, "consume_audio");
+    auto& buffer = ctx.audio_buffer;
+    for (size_t i = 0; i < buffer.output.count; i++)
+    {
         ctx.debug_apu.pulse1_history.pop_front();
-        ctx.debug_apu.pulse1_history.push_back(ctx.nes->apu.pulse1.get_sample());
+        ctx.debug_apu.pulse1_history.push_back(buffer.pulse1[i]);
         ctx.debug_apu.pulse2_history.pop_front();
-        ctx.debug_apu.pulse2_history.push_back(ctx.nes->apu.pulse2.get_sample());
+        ctx.debug_apu.pulse2_history.push_back(buffer.pulse2[i]);
         ctx.debug_apu.triangle_history.pop_front();
-        ctx.debug_apu.triangle_history.push_back(ctx.nes->apu.triangle.get_sample());
+        ctx.debug_apu.triangle_history.push_back(buffer.triangle[i]);
         ctx.debug_apu.noise_history.pop_front();
-        ctx.debug_apu.noise_history.push_back(ctx.nes->apu.noise.get_sample());
+        ctx.debug_apu.noise_history.push_back(buffer.noise[i]);
         ctx.debug_apu.dmc_history.pop_front();
-        ctx.debug_apu.dmc_history.push_back(ctx.nes->apu.dmc.get_sample());
+        ctx.debug_apu.dmc_history.push_back(buffer.dmc[i]);
         ctx.debug_apu.mixer_history.pop_front();
-        ctx.debug_apu.mixer_history.push_back(mixed_sample);
-        ctx.new_samples.push_back(mixed_sample * 2.0f - 1.0f);
-        ctx.audio_tick_counter -= ticks_per_sample;
+        ctx.debug_apu.mixer_history.push_back(buffer.mixed[i]);
+        ctx.new_samples.push_back(buffer.mixed[i] * 2.0f - 1.0f);
     }
+    buffer.output.count = 0;
+}
+
+// Runs one frame forwards, or one frame backwards while rewinding. Going
+// backwards restores the state from the start of the previous frame and
+// runs it again so the screen shows that frame.
+static void run_frame()
+{
+    nes::profile_zone_t zone(ctx.profiler, "run_frame");
+    auto& movie = ctx.movie;
+    if (movie.mode == movie_mode_t::recording)
+    {
+        movie.movie.record_frame(*ctx.nes, movie.pending_events);
+        movie.pending_events = 0;
+        movie.frame++;
+        consume_audio();
+        return;
+    }
+    if (movie.mode == movie_mode_t::playing)
+    {
+        if (!movie.movie.play_frame(*ctx.nes, movie.frame) && !movie.desync_frame)
+        {
+            SPDLOG_WARN("Movie desynced at frame {}", movie.frame);
+            movie.desync_frame = movie.frame;
+        }
+        if (++movie.frame >= movie.movie.frame_count())
+        {
+            movie.mode = movie_mode_t::none;
+        }
+        consume_audio();
+        return;
+    }
+
+    if (ctx.debug_control.rewinding && ctx.debug_control.enable_rewind)
+    {
+        if (ctx.rewind.rewind(*ctx.nes))
+        {
+            ctx.nes->clock_frame();
+        }
+        ctx.audio_buffer.output.count = 0;
+        return;
+    }
+
+    if (ctx.debug_control.enable_rewind)
+    {
+        ctx.rewind.push(*ctx.nes);
+    }
+    ctx.nes->clock_frame();
+    consume_audio();
+}
+
+// Shows the frame that the latest input will produce run_ahead frames from
+// now, hiding that many frames of input latency. The real frames are run
+// without video output; the extra frames are run without audio output and
+// then thrown away by returning to the saved state.
+static void run_ahead(double sample_rate)
+{
+    nes::profile_zone_t zone(ctx.profiler, "run_ahead");
+    auto& nes = *ctx.nes;
+    ctx.run_ahead_state.clear();
+    nes.save_state(ctx.run_ahead_state);
+    nes.set_audio_output(nullptr, 0.0);
+    for (int i = 0; i < ctx.debug_control.run_ahead; i++)
+    {
+        nes.set_video_output(i == ctx.debug_control.run_ahead - 1);
+        nes.clock_frame();
+    }
+    nes.load_state(ctx.run_ahead_state.data(), ctx.run_ahead_state.size());
+    nes.set_audio_output(&ctx.audio_buffer.output, sample_rate);
+}
+
+// Runs as many frames as fit in the time budget instead of pacing to 60
+// frames per second. Only the last frame is drawn and audio is muted.
+static void run_turbo()
+{
+    auto& nes = *ctx.nes;
+    uint64_t deadline = SDL_GetTicks() + TURBO_TIME_BUDGET_MS;
+    nes.set_audio_output(nullptr, 0.0);
+    nes.set_video_output(false);
+    do
+    {
+        run_frame();
+    } while (SDL_GetTicks() < deadline);
+    nes.set_video_output(true);
+    run_frame();
 }
 
 static void load_rom(const char* rom_file)
@@ -1694,7 +2131,9 @@ static void load_rom(const char* rom_file)
         SPDLOG_ERROR("Failed to load ROM file: {}", rom_file);
         return;
     }
+    stop_movie();
     ctx.nes->load_cart(std::move(cart));
+    ctx.rewind.clear();
 
     std::filesystem::path path(rom_file);
     ctx.debug_control.cart_name = path.stem().string();
@@ -1740,7 +2179,14 @@ int main(int argc, char* argv[])
 
     // Initialise NES
 
-    ctx.nes = std::make_unique<nes::nes_t>(on_clock);
+    ctx.nes = std::make_unique<nes::nes_t>();
+    ctx.audio_buffer.output.mixed = ctx.audio_buffer.mixed;
+    ctx.audio_buffer.output.pulse1 = ctx.audio_buffer.pulse1;
+    ctx.audio_buffer.output.pulse2 = ctx.audio_buffer.pulse2;
+    ctx.audio_buffer.output.triangle = ctx.audio_buffer.triangle;
+    ctx.audio_buffer.output.noise = ctx.audio_buffer.noise;
+    ctx.audio_buffer.output.dmc = ctx.audio_buffer.dmc;
+    ctx.audio_buffer.output.capacity = AUDIO_BUFFER_LENGTH;
     if (argc >= 2)
     {
         const char* rom_file = argv[1];
@@ -1841,6 +2287,8 @@ int main(int argc, char* argv[])
     uint64_t tick_counter = SDL_GetTicks();
     while (running)
     {
+        nes::profile_zone_t frame_zone(ctx.profiler, "frame");
+
         // Process events
 
         SDL_Event event;
@@ -1876,16 +2324,34 @@ int main(int argc, char* argv[])
         uint64_t frames_expected = current_ticks * 60 / 1000;
         if (!ctx.debug_control.pause && ctx.nes->cart)
         {
-            SDL_LockAudioStream(ctx.audio_stream);
-            for (int i = 0; i < 5 && frames_run < frames_expected; i++)
+            if (ctx.debug_control.turbo && !ctx.debug_control.rewinding)
+            {
+                run_turbo();
+            }
+            else
             {
-                for (int j = 0; j < ctx.debug_control.emulation_speed; j++)
+                SDL_LockAudioStream(ctx.audio_stream);
+                double sample_rate = (double)AUDIO_SAMPLE_RATE / ctx.debug_control.emulation_speed;
+                ctx.nes->set_audio_output(&ctx.audio_buffer.output, sample_rate);
+                bool use_run_ahead = ctx.debug_control.run_ahead > 0 && !ctx.debug_control.rewinding;
+                bool ran = false;
+                ctx.nes->set_video_output(!use_run_ahead);
+                for (int i = 0; i < 5 && frames_run < frames_expected; i++)
+                {
+                    for (int j = 0; j < ctx.debug_control.emulation_speed; j++)
+                    {
+                        run_frame();
+                    }
+                    frames_run++;
+                    ran = true;
+                }
+                ctx.nes->set_video_output(true);
+                if (ran && use_run_ahead)
                 {
-                    ctx.nes->clock_frame();
+                    run_ahead(sample_rate);
                 }
-                frames_run++;
+                SDL_UnlockAudioStream(ctx.audio_stream);
             }
-            SDL_UnlockAudioStream(ctx.audio_stream);
         }
         frames_run = frames_expected;
 
@@ -1904,6 +2370,7 @@ int main(int argc, char* argv[])
         show_ram();
         show_cpu_memory_map();
         show_ppu_memory_map();
+        show_counters();
         show_control();
         show_sprites();
 
@@ -1917,9 +2384,15 @@ int main(int argc, char* argv[])
 
         // End rendering
 
-        ImGui::Render();
-        ImGui_ImplSDLRenderer3_RenderDrawData(ImGui::GetDrawData(), ctx.renderer);
-        SDL_RenderPresent(ctx.renderer);
+        {
+            nes::profile_zone_t zone(ctx.profiler, "ImGui::Render");
+            ImGui::Render();
+            ImGui_ImplSDLRenderer3_RenderDrawData(ImGui::GetDrawData(), ctx.renderer);
+        }
+        {
+            nes::profile_zone_t zone(ctx.profiler, "SDL_RenderPresent");
+            SDL_RenderPresent(ctx.renderer);
+        }
 
         bool is_fullscreen = SDL_GetWindowFlags(ctx.window) & SDL_WINDOW_FULLSCREEN;
         if (is_fullscreen != ctx.debug_control.fullscreen)
@@ -1933,6 +2406,10 @@ int main(int argc, char* argv[])
     }
 
     SPDLOG_INFO("Application exiting");
+    if (ctx.profiler.is_recording())
+    {
+        stop_trace();
+    }
 
     // Close ImGui
 
@@ -2,6 +2,8 @@
 #include "mapper.h"
 #include "cart.h"
 
+#include <algorithm>
+
 namespace nes
 {
     mapper_t::mapper_t(cart_t& cart)
@@ -61,6 +63,78 @@ namespace nes
     {
     }
 
+    // Whether on_scanline() may raise an IRQ
+    bool mapper_t::has_scanline_irq() const
+    {
+        return false;
+    }
+
+    // Mappers with registers override this and serialize the base first.
+    // The memory map is rebuilt by the caller after loading.
+    void mapper_t::serialize(state_t& state)
+    {
+        state.value(mirroring);
+        state.value(irq);
+        // PRG RAM is mapped for every cart, but most have none and never
+        // write to it, so it is only saved once it holds something
+        bool has_prg_ram = !state.is_loading()
+            && std::ranges::any_of(prg_ram, [](uint8_t value) { return value != 0; });
+        state.value(has_prg_ram);
+        if (has_prg_ram)
+        {
+            state.value(prg_ram);
+        }
+        else if (state.is_loading())
+        {
+            memset(prg_ram, 0, sizeof(prg_ram));
+        }
+    }
+
+    size_t mapper_t::map_prg(uint16_t addr)
+    {
+        return addr - 0x8000;
+    }
+
+    size_t mapper_t::map_chr(uint16_t addr)
+    {
+        return addr;
+    }
+
+    // Publishes the current banks to the buses so that reads of PRG RAM,
+    // PRG ROM and CHR bypass the mapper. Must be called whenever a bank
+    // register changes.
+    void mapper_t::update_memory_map()
+    {
+        if (cart->cpu_bus)
+        {
+            cart->cpu_bus->map_memory(0x6000, 0x7FFF, prg_ram, true);
+            for (uint32_t addr = 0x8000; addr < 0x10000; addr += bus_t::PAGE_SIZE)
+            {
+                // Mapped read-only, so the ROM image is never written
+                size_t mapped = map_prg((uint16_t)addr) % cart->prg_rom.size();
+                cart->cpu_bus->map_memory(
+                    (uint16_t)addr,
+                    (uint16_t)(addr + bus_t::PAGE_SIZE - 1),
+                    const_cast<uint8_t*>(&cart->prg_rom[mapped]),
+                    false);
+            }
+        }
+        if (cart->ppu_bus)
+        {
+            // Only CHR RAM is writable. Writes to CHR ROM go to the mapper.
+            bool chr_writable = cart->header.chr_chunks == 0;
+            for (uint32_t addr = 0x0000; addr < 0x2000; addr += bus_t::PAGE_SIZE)
+            {
+                size_t mapped = map_chr((uint16_t)addr) % cart->chr.size();
+                cart->ppu_bus->map_memory(
+                    (uint16_t)addr,
+                    (uint16_t)(addr + bus_t::PAGE_SIZE - 1),
+                    &cart->chr[mapped],
+                    chr_writable);
+            }
+        }
+    }
+
     size_t mapper_t::get_prg_bank_count(uint32_t bank_size) const
     {
         return cart->prg_rom.size() / bank_size;
@@ -1,6 +1,7 @@
 #pragma once
 #include "pch.h"
 #include "mirroring.h"
+#include "state.h"
 
 #define MAPPER_DEFINE_RESET(T) void T::reset() { *this = T(*cart); }
 #define MAPPER_DEFINE_NAME(T, name) const char* T::get_name() const { return name; }
@@ -20,7 +21,12 @@ namespace nes
         virtual bool ppu_read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         virtual bool ppu_write(uint16_t addr, uint8_t value);
         virtual void on_scanline();
+        virtual bool has_scanline_irq() const;
+        virtual void serialize(state_t& state);
+        virtual size_t map_prg(uint16_t addr);
+        virtual size_t map_chr(uint16_t addr);
 
+        void update_memory_map();
         size_t get_prg_bank_count(uint32_t bank_size) const;
         size_t get_chr_bank_count(uint32_t bank_size) const;
 
@@ -18,6 +18,16 @@ namespace nes
     MAPPER_DEFINE_RESET(mapper001_t);
     MAPPER_DEFINE_NAME(mapper001_t, "MMC1");
 
+    void mapper001_t::serialize(state_t& state)
+    {
+        mapper_t::serialize(state);
+        state.value(shift_register);
+        state.value(control);
+        state.value(chr_bank0);
+        state.value(chr_bank1);
+        state.value(prg_bank);
+    }
+
     bool mapper001_t::cpu_read(uint16_t addr, uint8_t& value, bool readonly)
     {
         if (addr >= 0x6000 && addr < 0x8000)
@@ -47,6 +57,7 @@ namespace nes
             {
                 shift_register = 0x10;
                 control.prg_bank_mode = 3;
+                update_memory_map();
             }
             else if ((shift_register & 1) == 0)
             {
@@ -80,6 +91,7 @@ namespace nes
                 {
                     prg_bank = shift_value & 0x0F;
                 }
+                update_memory_map();
             }
             return true;
         }
@@ -9,6 +9,7 @@ namespace nes
         mapper001_t(cart_t& cart);
         void reset() override;
         const char* get_name() const override;
+        void serialize(state_t& state) override;
         bool cpu_read(uint16_t addr, uint8_t& value, bool readonly) override;
         bool cpu_write(uint16_t addr, uint8_t value) override;
         bool ppu_read(uint16_t addr, uint8_t& value, bool readonly) override;
@@ -33,7 +34,7 @@ namespace nes
         uint8_t prg_bank;
 
     private:
-        size_t map_prg(uint16_t addr);
-        size_t map_chr(uint16_t addr);
+        size_t map_prg(uint16_t addr) override;
+        size_t map_chr(uint16_t addr) override;
     };
 }
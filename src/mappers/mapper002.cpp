@@ -13,6 +13,12 @@ namespace nes
     MAPPER_DEFINE_RESET(mapper002_t);
     MAPPER_DEFINE_NAME(mapper002_t, "UxROM");
 
+    void mapper002_t::serialize(state_t& state)
+    {
+        mapper_t::serialize(state);
+        state.value(bank_select);
+    }
+
     bool mapper002_t::cpu_read(uint16_t addr, uint8_t& value, bool readonly)
     {
         if (addr >= 0x6000 && addr < 0x8000)
@@ -39,6 +45,7 @@ namespace nes
         else if (addr >= 0x8000)
         {
             bank_select = value;
+            update_memory_map();
             return true;
         }
         return false;
@@ -13,6 +13,12 @@ namespace nes
     MAPPER_DEFINE_RESET(mapper003_t);
     MAPPER_DEFINE_NAME(mapper003_t, "CNROM");
 
+    void mapper003_t::serialize(state_t& state)
+    {
+        mapper_t::serialize(state);
+        state.value(bank_select);
+    }
+
     bool mapper003_t::cpu_write(uint16_t addr, uint8_t value)
     {
         if (addr >= 0x6000 && addr < 0x8000)
@@ -23,6 +29,7 @@ namespace nes
         else if (addr >= 0x8000)
         {
             bank_select = value;
+            update_memory_map();
             return true;
         }
         return false;
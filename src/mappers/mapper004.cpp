@@ -18,6 +18,17 @@ namespace nes
     MAPPER_DEFINE_RESET(mapper004_t);
     MAPPER_DEFINE_NAME(mapper004_t, "MMC3");
 
+    void mapper004_t::serialize(state_t& state)
+    {
+        mapper_t::serialize(state);
+        state.value(bank_select);
+        state.value(map_regs);
+        state.value(irq_latch);
+        state.value(irq_counter);
+        state.value(irq_enabled);
+        state.value(irq_reload);
+    }
+
     bool mapper004_t::cpu_read(uint16_t addr, uint8_t& value, bool readonly)
     {
         if (addr >= 0x6000 && addr < 0x8000)
@@ -52,6 +63,7 @@ namespace nes
                 // Bank data
                 map_regs[bank_select.select] = value;
             }
+            update_memory_map();
         }
         else if (addr >= 0xA000 && addr <= 0xBFFF)
         {
@@ -135,6 +147,11 @@ namespace nes
         }
     }
 
+    bool mapper004_t::has_scanline_irq() const
+    {
+        return irq_enabled;
+    }
+
     size_t mapper004_t::map_prg(uint16_t addr)
     {
         size_t slot = (addr - 0x8000) / 0x2000;
@@ -9,11 +9,13 @@ namespace nes
         mapper004_t(cart_t& cart);
         void reset() override;
         const char* get_name() const override;
+        void serialize(state_t& state) override;
         bool cpu_read(uint16_t addr, uint8_t& value, bool readonly) override;
         bool cpu_write(uint16_t addr, uint8_t value) override;
         bool ppu_read(uint16_t addr, uint8_t& value, bool readonly) override;
         bool ppu_write(uint16_t addr, uint8_t value) override;
         void on_scanline() override;
+        bool has_scanline_irq() const override;
 
         union
         {
@@ -34,7 +36,7 @@ namespace nes
         bool irq_reload;
 
     private:
-        size_t map_prg(uint16_t addr);
-        size_t map_chr(uint16_t addr);
+        size_t map_prg(uint16_t addr) override;
+        size_t map_chr(uint16_t addr) override;
     };
 }
@@ -13,6 +13,12 @@ namespace nes
     MAPPER_DEFINE_RESET(mapper007_t);
     MAPPER_DEFINE_NAME(mapper007_t, "AxROM");
 
+    void mapper007_t::serialize(state_t& state)
+    {
+        mapper_t::serialize(state);
+        state.value(bank_select);
+    }
+
     bool mapper007_t::cpu_read(uint16_t addr, uint8_t& value, bool readonly)
     {
         if (addr >= 0x6000 && addr < 0x8000)
@@ -40,6 +46,7 @@ namespace nes
         {
             bank_select = value;
             mirroring = (value & 0x10) ? mirroring_t::one_screen_low : mirroring_t::one_screen_high;
+            update_memory_map();
             return true;
         }
         return false;
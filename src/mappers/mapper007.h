@@ -9,12 +9,13 @@ namespace nes
         mapper007_t(cart_t& cart);
         void reset() override;
         const char* get_name() const override;
+        void serialize(state_t& state) override;
         bool cpu_read(uint16_t addr, uint8_t& value, bool readonly) override;
         bool cpu_write(uint16_t addr, uint8_t value) override;
 
         uint8_t bank_select;
 
     private:
-        size_t map_prg(uint16_t addr);
+        size_t map_prg(uint16_t addr) override;
     };
 }
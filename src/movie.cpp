@@ -0,0 +1,223 @@
+#include "pch.h"
+#include "movie.h"
+#include "hash.h"
+
+namespace nes
+{
+    movie_t::movie_t(uint32_t keyframe_interval)
+        : rom_hash(0),
+          keyframe_interval(keyframe_interval)
+    {
+    }
+
+    // Resets the machine, as the movie starts from power on
+    void movie_t::start_recording(nes_t& nes)
+    {
+        nes.reset();
+        rom_hash = hash_rom(nes);
+        frames.clear();
+        keyframes.clear();
+    }
+
+    // Runs one frame with the current controller input and records it
+    void movie_t::record_frame(nes_t& nes, uint8_t events)
+    {
+        if (frames.size() % keyframe_interval == 0)
+        {
+            keyframes.emplace_back();
+            nes.save_state(keyframes.back());
+        }
+
+        frame_t frame{};
+        frame.controller[0] = nes.controller.status[0].reg;
+        frame.controller[1] = nes.controller.status[1].reg;
+        frame.events = events;
+        run_frame(nes, frame);
+        frame.hash = nes.hash_state(false);
+        frames.push_back(frame);
+    }
+
+    // Runs the given frame, which must be the next one after the current
+    // state. Returns false if the state afterwards differs from the
+    // recording.
+    bool movie_t::play_frame(nes_t& nes, uint64_t frame)
+    {
+        if (frame >= frames.size())
+        {
+            return false;
+        }
+        run_frame(nes, frames[frame]);
+        return nes.hash_state(false) == frames[frame].hash;
+    }
+
+    // Puts the machine at the start of the given frame by loading the
+    // nearest keyframe before it and replaying from there. The replayed
+    // frames are not drawn.
+    bool movie_t::seek(nes_t& nes, uint64_t frame)
+    {
+        if (frame > frames.size() || keyframes.empty())
+        {
+            return false;
+        }
+        uint64_t keyframe = std::min<uint64_t>(frame / keyframe_interval, keyframes.size() - 1);
+        if (!nes.load_state(keyframes[keyframe].data(), keyframes[keyframe].size()))
+        {
+            return false;
+        }
+
+        bool video_output = nes.ppu.output_enabled;
+        nes.set_video_output(false);
+        for (uint64_t i = keyframe * keyframe_interval; i < frame; i++)
+        {
+            run_frame(nes, frames[i]);
+        }
+        nes.set_video_output(video_output);
+        return true;
+    }
+
+    // Whether the movie was recorded with the loaded ROM
+    bool movie_t::matches(const nes_t& nes) const
+    {
+        return nes.cart && hash_rom(nes) == rom_hash;
+    }
+
+    uint64_t movie_t::frame_count() const
+    {
+        return frames.size();
+    }
+
+    // Appends the movie to the buffer and returns its size
+    size_t movie_t::save(std::vector<uint8_t>& buffer) const
+    {
+        size_t begin = buffer.size();
+        state_t state(buffer);
+        uint32_t magic = MAGIC;
+        uint32_t version = VERSION;
+        state.value(magic);
+        state.value(version);
+
+        size_t section = state.begin_section(make_state_tag("HEAD"));
+        uint64_t rom_hash = this->rom_hash;
+        uint32_t keyframe_interval = this->keyframe_interval;
+        uint32_t state_version = state_t::VERSION;
+        state.value(rom_hash);
+        state.value(keyframe_interval);
+        state.value(state_version);
+        state.end_section(section);
+
+        // Fields are written one at a time so padding never reaches the file
+        section = state.begin_section(make_state_tag("FRAM"));
+        for (frame_t frame : frames)
+        {
+            state.value(frame.controller);
+            state.value(frame.events);
+            state.value(frame.hash);
+        }
+        state.end_section(section);
+
+        for (const auto& keyframe : keyframes)
+        {
+            section = state.begin_section(make_state_tag("KEYF"));
+            uint32_t keyframe_size = (uint32_t)keyframe.size();
+            state.value(keyframe_size);
+            state.bytes((void*)keyframe.data(), keyframe.size());
+            state.end_section(section);
+        }
+        return buffer.size() - begin;
+    }
+
+    bool movie_t::load(const uint8_t* data, size_t size)
+    {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        state_t header(data, size);
+        header.value(magic);
+        header.value(version);
+        if (!header.ok() || magic != MAGIC)
+        {
+            SPDLOG_ERROR("Invalid movie");
+            return false;
+        }
+        if (version != VERSION)
+        {
+            SPDLOG_ERROR("Unsupported movie version: {}", version);
+            return false;
+        }
+
+        movie_t movie;
+        uint32_t state_version = 0;
+        uint32_t tag;
+        state_t section(data, 0);
+        bool valid = true;
+        while (valid && header.next_section(tag, section))
+        {
+            switch (tag)
+            {
+            case make_state_tag("HEAD"):
+                section.value(movie.rom_hash);
+                section.value(movie.keyframe_interval);
+                section.value(state_version);
+                break;
+            case make_state_tag("FRAM"):
+                while (section.ok() && !section.at_end())
+                {
+                    frame_t frame{};
+                    section.value(frame.controller);
+                    section.value(frame.events);
+                    section.value(frame.hash);
+                    movie.frames.push_back(frame);
+                }
+                break;
+            case make_state_tag("KEYF"):
+            {
+                uint32_t keyframe_size = 0;
+                section.value(keyframe_size);
+                if (keyframe_size > size)
+                {
+                    valid = false;
+                    break;
+                }
+                auto& keyframe = movie.keyframes.emplace_back(keyframe_size);
+                section.bytes(keyframe.data(), keyframe.size());
+                break;
+            }
+            default:
+                break;
+            }
+            valid = valid && section.ok();
+        }
+        if (!valid || !header.ok() || movie.keyframe_interval == 0 || movie.keyframes.empty())
+        {
+            SPDLOG_ERROR("Invalid movie");
+            return false;
+        }
+        if (state_version != state_t::VERSION)
+        {
+            SPDLOG_ERROR("Movie was recorded with save state version {}, which this build can't replay (expected {})",
+                state_version, state_t::VERSION);
+            return false;
+        }
+
+        rom_hash = movie.rom_hash;
+        keyframe_interval = movie.keyframe_interval;
+        frames = std::move(movie.frames);
+        keyframes = std::move(movie.keyframes);
+        return true;
+    }
+
+    uint64_t movie_t::hash_rom(const nes_t& nes)
+    {
+        return nes.cart ? hash_bytes(nes.cart->rom->data(), nes.cart->rom->size()) : 0;
+    }
+
+    void movie_t::run_frame(nes_t& nes, const frame_t& frame)
+    {
+        if (frame.events & EVENT_RESET)
+        {
+            nes.reset();
+        }
+        nes.controller.status[0].reg = frame.controller[0];
+        nes.controller.status[1].reg = frame.controller[1];
+        nes.clock_frame();
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "pch.h"
+#include "nes.h"
+#include "state.h"
+
+#include <vector>
+
+namespace nes
+{
+    // Records the controller input of every frame from power on, so that a
+    // session can be replayed exactly. A save state is kept every
+    // keyframe_interval frames so that playback can seek without replaying
+    // from the start, and nes_t::hash_state() after every frame detects
+    // playback that has diverged from the recording. The screen is left
+    // out of the hash so that frames can be played without drawing.
+    //
+    // Movies are saved in the same sectioned format as save states. The
+    // frame hashes and keyframes depend on the save state format, so the
+    // header records its version and movies from other versions are
+    // rejected.
+    struct movie_t
+    {
+        static constexpr uint32_t MAGIC = make_state_tag("NESM");
+        static constexpr uint32_t VERSION = 3;
+
+        // Events applied at the start of a frame, before it is run
+        static constexpr uint8_t EVENT_RESET = 1 << 0;
+
+        struct frame_t
+        {
+            uint8_t controller[2];
+            uint8_t events;
+            uint64_t hash;
+        };
+
+        movie_t(uint32_t keyframe_interval = 600);
+        void start_recording(nes_t& nes);
+        void record_frame(nes_t& nes, uint8_t events = 0);
+        bool play_frame(nes_t& nes, uint64_t frame);
+        bool seek(nes_t& nes, uint64_t frame);
+        bool matches(const nes_t& nes) const;
+        uint64_t frame_count() const;
+        size_t save(std::vector<uint8_t>& buffer) const;
+        bool load(const uint8_t* data, size_t size);
+
+        uint64_t rom_hash;
+        uint32_t keyframe_interval;
+        std::vector<frame_t> frames;
+        // keyframes[i] is the state at the start of frame i * keyframe_interval
+        std::vector<std::vector<uint8_t>> keyframes;
+
+    private:
+        static uint64_t hash_rom(const nes_t& nes);
+        void run_frame(nes_t& nes, const frame_t& frame);
+    };
+}
@@ -1,31 +1,58 @@
-
 #include "pch.h"
 #include "nes.h"
+#include "hash.h"
 
 namespace nes
 {
-    nes_t::nes_t(std::function<void()> on_clock)
-        : cpu(cpu_bus),
+    static constexpr uint32_t STATE_SECTIONS[] = {
+        make_state_tag("NES "),
+        make_state_tag("CPU "),
+        make_state_tag("PPU "),
+        make_state_tag("APU "),
+        make_state_tag("RAM "),
+        make_state_tag("DMA "),
+        make_state_tag("CTRL"),
+        make_state_tag("CART"),
+    };
+
+    nes_t::nes_t()
+        : cpu_bus(0xFFFF, "CPU"),
+          ppu_bus(0x3FFF, "PPU"),
+          cpu(cpu_bus),
           ppu(ppu_bus, oam_dma, screen_buffer),
-          apu(cpu_bus),
+          apu(cpu_bus, scheduler),
           oam_dma(cpu_bus),
-          ppu_clock_count(0),
-          on_clock(on_clock),
-          cpu_bus(0xFFFF, "CPU"),
-          ppu_bus(0x3FFF, "PPU")
+          ppu_catch_up(false),
+          ppu_sync_count(0),
+          idle_skip(false),
+          idle_cycles_skipped(0),
+          idle_loop(cpu, cpu_bus),
+          idle_status_deadline(0),
+          last_state_size(0)
     {
-        cpu_bus.connect_read<&ram_t::read>(&ram);
-        cpu_bus.connect_write<&ram_t::write>(&ram);
-        cpu_bus.connect_read<&ppu_t::cpu_read>(&ppu);
-        cpu_bus.connect_write<&ppu_t::cpu_write>(&ppu);
-        cpu_bus.connect_read<&apu_t::read>(&apu);
-        cpu_bus.connect_write<&apu_t::write>(&apu);
-        cpu_bus.connect_read<&controller_t::read>(&controller);
-        cpu_bus.connect_write<&controller_t::write>(&controller);
+        cpu_bus.connect_read<&ram_t::read>(&ram, 0x0000, 0x1FFF);
+        cpu_bus.connect_write<&ram_t::write>(&ram, 0x0000, 0x1FFF);
+        cpu_bus.connect_read<&nes_t::ppu_cpu_read>(this, 0x2000, 0x3FFF);
+        cpu_bus.connect_write<&nes_t::ppu_cpu_write>(this, 0x2000, 0x3FFF);
+        cpu_bus.connect_write<&nes_t::ppu_cpu_write>(this, 0x4014, 0x4014);
+        cpu_bus.connect_read<&apu_t::read>(&apu, 0x4015, 0x4015);
+        cpu_bus.connect_write<&apu_t::write>(&apu, 0x4000, 0x4017);
+        cpu_bus.connect_read<&controller_t::read>(&controller, 0x4016, 0x4017);
+        cpu_bus.connect_write<&controller_t::write>(&controller, 0x4016, 0x4016);
+        cpu_bus.connect_write<&nes_t::cart_cpu_write>(this, 0x4020, 0xFFFF);
+        for (uint16_t addr = 0x0000; addr < 0x2000; addr += ram_t::RAM_SIZE)
+        {
+            cpu_bus.map_memory(addr, addr + ram_t::RAM_SIZE - 1, ram.data, true);
+        }
+        apu.schedule_frame_counter();
     }
 
     void nes_t::reset()
     {
+        // Components schedule their first events during reset
+        scheduler.reset();
+        ppu_sync_count = 0;
+        idle_loop.reset();
         ram.reset();
         cpu.reset();
         ppu.reset();
@@ -36,49 +63,116 @@ namespace nes
         {
             cart->reset();
         }
-        ppu_clock_count = 0;
+        schedule_ppu_sync();
         memset(screen_buffer, 0x0F, sizeof(screen_buffer));
     }
 
     void nes_t::clock()
     {
-        if (ppu_clock_count % 3 == 0)
+        if (scheduler.time % 3 == 0)
+        {
+            clock_cpu_cycle();
+        }
+        if (!ppu_catch_up)
+        {
+            ppu.clock();
+            ppu_sync_count++;
+        }
+        scheduler.time++;
+        if (scheduler.time >= scheduler.next_time)
+        {
+            run_events();
+        }
+    }
+
+    // In catch-up mode nothing happens between CPU cycles except scheduled
+    // events, so instead of a dot at a time this runs straight on to the
+    // next CPU cycle or event, whichever is first. Otherwise it is clock().
+    void nes_t::clock_to_next_event()
+    {
+        if (!ppu_catch_up)
         {
-            if (oam_dma.cycles_remaining == 0)
+            clock();
+            return;
+        }
+        if (scheduler.time % 3 == 0)
+        {
+            clock_cpu_cycle();
+        }
+        uint64_t next_cycle = scheduler.time - scheduler.time % 3 + 3;
+        scheduler.time = std::max(scheduler.time + 1, std::min(next_cycle, scheduler.next_time));
+        if (scheduler.time >= scheduler.next_time)
+        {
+            run_events();
+        }
+    }
+
+    // The CPU, OAM DMA and APU, which all run on CPU cycles. Interrupts are
+    // taken between instructions.
+    void nes_t::clock_cpu_cycle()
+    {
+        if (oam_dma.cycles_remaining == 0)
+        {
+            int block_cycles = jit && !cpu.trace && cpu.cycles_until_next_instruction == 0
+                ? jit->next_block_cycles()
+                : 0;
+            if (block_cycles == 0 || !run_jit(block_cycles))
             {
                 cpu.clock();
-                if (cpu.cycles_until_next_instruction == 0)
+            }
+            if (cpu.cycles_until_next_instruction == 0)
+            {
+                if (ppu.nmi)
                 {
-                    if (ppu.nmi)
-                    {
-                        cpu.nmi();
-                        ppu.nmi = false;
-                    }
-                    else if (apu.dmc.irq || apu.frame_irq || (cart && cart->mapper->irq))
-                    {
-                        cpu.irq();
-                        // IRQ will be cleared by the program
-                    }
+                    cpu.nmi();
+                    ppu.nmi = false;
+                    idle_loop.reset();
+                }
+                else if (!cpu.status.i && (apu.dmc.irq || apu.frame_irq || (cart && cart->mapper->irq)))
+                {
+                    cpu.irq();
+                    idle_loop.reset();
+                    // IRQ will be cleared by the program
                 }
             }
-            oam_dma.clock();
-            apu.clock();
         }
-        ppu.clock();
-        ppu_clock_count++;
-        on_clock();
+        oam_dma.clock();
+        apu.clock();
+    }
+
+    void nes_t::run_events()
+    {
+        event_t event;
+        while (scheduler.pop_due(event))
+        {
+            switch (event)
+            {
+            case event_t::ppu_sync:
+                sync_ppu();
+                break;
+            case event_t::apu_frame_counter:
+                apu.clock_frame_counter();
+                break;
+            case event_t::audio_sample:
+                apu.clock_sample();
+                break;
+            default:
+                break;
+            }
+        }
     }
 
     void nes_t::clock_instruction()
     {
         while (cpu.cycles_until_next_instruction == 0)
         {
-            clock();
+            clock_to_next_event();
         }
         while (cpu.cycles_until_next_instruction > 0)
         {
-            clock();
+            clock_to_next_event();
         }
+        sync_ppu();
     }
 
     void nes_t::clock_scanline()
@@ -87,26 +181,45 @@ namespace nes
         {
             clock();
         }
+        sync_ppu();
     }
 
     void nes_t::clock_frame()
     {
         do
         {
-            clock();
-        } while (!(ppu.scanline == 0 && ppu.dot == 0));
+            if (idle_skip
+                && !cpu.trace
+                && scheduler.time % 3 == 0
+                && cpu.cycles_until_next_instruction == 0
+                && oam_dma.cycles_remaining == 0)
+            {
+                skip_idle_loop();
+            }
+            clock_to_next_event();
+        } while (!(ppu_sync_count == scheduler.time
+            && ppu.scanline == 0
+            && ppu.dot == 0));
     }
 
     void nes_t::unload_cart()
     {
         if (cart)
         {
+            sync_ppu();
             cpu_bus.disconnect_read(&*cart);
-            cpu_bus.disconnect_write(&*cart);
             ppu_bus.disconnect_read(&*cart);
             ppu_bus.disconnect_write(&*cart);
+            cpu_bus.unmap_memory(0x6000, 0xFFFF);
+            ppu_bus.unmap_memory(0x0000, 0x1FFF);
             ppu.set_cart(nullptr);
             cart.reset();
+            // The next ROM may be allocated where this one was
+            cpu.clear_decode_cache();
+            if (jit)
+            {
+                jit->clear();
+            }
         }
     }
 
@@ -114,11 +227,460 @@ namespace nes
     {
         unload_cart();
         this->cart = std::move(cart);
-        cpu_bus.connect_read<&cart_t::cpu_read>(&*this->cart);
-        cpu_bus.connect_write<&cart_t::cpu_write>(&*this->cart);
-        ppu_bus.connect_read<&cart_t::ppu_read>(&*this->cart);
-        ppu_bus.connect_write<&cart_t::ppu_write>(&*this->cart);
+        cpu_bus.connect_read<&cart_t::cpu_read>(&*this->cart, 0x4020, 0xFFFF);
+        ppu_bus.connect_read<&cart_t::ppu_read>(&*this->cart, 0x0000, 0x1FFF);
+        ppu_bus.connect_write<&cart_t::ppu_write>(&*this->cart, 0x0000, 0x1FFF);
+        this->cart->cpu_bus = &cpu_bus;
+        this->cart->ppu_bus = &ppu_bus;
         ppu.set_cart(&*this->cart);
         reset();
     }
+
+    // Brings the PPU up to date with the master clock
+    void nes_t::sync_ppu()
+    {
+        while (ppu_sync_count < scheduler.time)
+        {
+            ppu.clock();
+            ppu_sync_count++;
+        }
+        schedule_ppu_sync();
+    }
+
+    void nes_t::set_ppu_catch_up(bool enabled)
+    {
+        sync_ppu();
+        ppu_catch_up = enabled;
+        schedule_ppu_sync();
+    }
+
+    // The interpreter stays the reference. Switching the JIT off drops the
+    // compiled code.
+    void nes_t::set_jit(jit_mode_t mode)
+    {
+        if (mode == jit_mode_t::off)
+        {
+            jit.reset();
+        }
+        else if (!jit_t::is_supported())
+        {
+            SPDLOG_WARN("The JIT is not supported on this platform");
+        }
+        else if (jit)
+        {
+            jit->mode = mode;
+        }
+        else
+        {
+            jit = std::make_unique<jit_t>(cpu, cpu_bus, mode);
+        }
+    }
+
+    // Idle loops are only skipped by clock_frame(), so that clock() and the
+    // other stepping functions still advance by exactly what they say
+    void nes_t::set_idle_skip(bool enabled)
+    {
+        idle_skip = enabled;
+        idle_loop.reset();
+    }
+
+    // Pass null to stop tracing. The trace must stay alive until then.
+    void nes_t::set_cpu_trace(cpu_trace_t* trace)
+    {
+        if (cpu.trace)
+        {
+            cpu.trace->nes = nullptr;
+        }
+        cpu.trace = trace;
+        if (trace)
+        {
+            trace->nes = this;
+        }
+        // Idle loops aren't followed while tracing
+        idle_loop.reset();
+    }
+
+    // Sample rate is in samples per emulated second. Pass a null output to
+    // stop producing audio.
+    void nes_t::set_audio_output(audio_output_t* output, double sample_rate)
+    {
+        constexpr double DOTS_PER_SECOND = (double)ppu_t::DOTS_PER_SCANLINE
+            * (double)ppu_t::SCANLINES
+            * (double)ppu_t::FRAME_RATE;
+        apu.set_audio_output(output, output ? DOTS_PER_SECOND / sample_rate : 0.0);
+    }
+
+    // Frames run with video output disabled leave the screen buffer as it
+    // was, which makes them cheaper. The machine state is unaffected.
+    void nes_t::set_video_output(bool enabled)
+    {
+        sync_ppu();
+        ppu.output_enabled = enabled;
+    }
+
+    // Appends a save state to the buffer and returns its size. The buffer
+    // can be reused between saves to avoid reallocating. screen_buffer is
+    // output rather than state and is not saved.
+    size_t nes_t::save_state(std::vector<uint8_t>& buffer)
+    {
+        sync_ppu();
+        size_t begin = buffer.size();
+        // States rarely change size, so one allocation is usually enough
+        buffer.reserve(begin + last_state_size);
+        state_t state(buffer);
+        write_state(state);
+        last_state_size = buffer.size() - begin;
+        return last_state_size;
+    }
+
+    // Hashes the same state that a save would contain, plus the screen if
+    // requested, without building the save. Equal states hash equally on
+    // every build and platform, so this can be compared between runs and
+    // is cheap enough to call every frame.
+    uint64_t nes_t::hash_state(bool include_screen)
+    {
+        sync_ppu();
+        hasher_t hasher;
+        state_t state(hasher);
+        write_state(state);
+        if (include_screen)
+        {
+            hasher.update(screen_buffer, sizeof(screen_buffer));
+        }
+        return hasher.digest();
+    }
+
+    // The state must come from the same ROM. It is checked before anything
+    // is loaded, but a state that is corrupt part way through will leave the
+    // machine partially loaded, and it should then be reset.
+    bool nes_t::load_state(const uint8_t* data, size_t size)
+    {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        state_t header(data, size);
+        header.value(magic);
+        header.value(version);
+        if (!header.ok() || magic != state_t::MAGIC)
+        {
+            SPDLOG_ERROR("Invalid save state");
+            return false;
+        }
+        if (version != state_t::VERSION)
+        {
+            SPDLOG_ERROR("Unsupported save state version: {}", version);
+            return false;
+        }
+
+        uint32_t tag;
+        state_t section(data, 0);
+        state_t sections = header;
+        bool has_cart = false;
+        while (sections.next_section(tag, section))
+        {
+            if (tag == make_state_tag("CART"))
+            {
+                has_cart = true;
+                uint8_t mapper_number = 0;
+                uint32_t prg_size = 0;
+                section.value(mapper_number);
+                section.value(prg_size);
+                if (!cart
+                    || mapper_number != cart->header.mapper_number()
+                    || prg_size != cart->prg_rom.size())
+                {
+                    SPDLOG_ERROR("Save state is for a different cartridge");
+                    return false;
+                }
+            }
+        }
+        if (!sections.ok())
+        {
+            SPDLOG_ERROR("Invalid save state: truncated section");
+            return false;
+        }
+        if (has_cart != (cart != nullptr))
+        {
+            SPDLOG_ERROR("Save state is for a different cartridge");
+            return false;
+        }
+
+        sync_ppu();
+        sections = header;
+        while (sections.next_section(tag, section))
+        {
+            if (!serialize_section(tag, section))
+            {
+                continue;
+            }
+            if (!section.ok() || !section.at_end())
+            {
+                SPDLOG_ERROR("Invalid save state: bad section size");
+                return false;
+            }
+        }
+
+        ppu_sync_count = scheduler.time;
+        idle_loop.reset();
+        if (cart)
+        {
+            cart->mapper->update_memory_map();
+        }
+        apu.schedule_events();
+        schedule_ppu_sync();
+        return true;
+    }
+
+    void nes_t::write_state(state_t& state)
+    {
+        uint32_t magic = state_t::MAGIC;
+        uint32_t version = state_t::VERSION;
+        state.value(magic);
+        state.value(version);
+        for (uint32_t tag : STATE_SECTIONS)
+        {
+            if (tag == make_state_tag("CART") && !cart)
+            {
+                continue;
+            }
+            size_t section = state.begin_section(tag);
+            serialize_section(tag, state);
+            state.end_section(section);
+        }
+    }
+
+    // Reads or writes one save state section. Returns false for unknown tags.
+    bool nes_t::serialize_section(uint32_t tag, state_t& state)
+    {
+        switch (tag)
+        {
+        case make_state_tag("NES "):
+            state.value(scheduler.time);
+            cpu_bus.serialize(state);
+            ppu_bus.serialize(state);
+            return true;
+        case make_state_tag("CPU "):
+            cpu.serialize(state);
+            return true;
+        case make_state_tag("PPU "):
+            ppu.serialize(state);
+            return true;
+        case make_state_tag("APU "):
+            apu.serialize(state);
+            return true;
+        case make_state_tag("RAM "):
+            ram.serialize(state);
+            return true;
+        case make_state_tag("DMA "):
+            oam_dma.serialize(state);
+            return true;
+        case make_state_tag("CTRL"):
+            controller.serialize(state);
+            return true;
+        case make_state_tag("CART"):
+        {
+            uint8_t mapper_number = cart->header.mapper_number();
+            uint32_t prg_size = (uint32_t)cart->prg_rom.size();
+            state.value(mapper_number);
+            state.value(prg_size);
+            cart->serialize(state);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    void nes_t::schedule_ppu_sync()
+    {
+        if (!ppu_catch_up)
+        {
+            scheduler.cancel(event_t::ppu_sync);
+            return;
+        }
+
+        scheduler.schedule(event_t::ppu_sync, ppu_sync_count + dots_until_ppu_event());
+    }
+
+    // The PPU must be caught up before the CPU can observe an NMI or mapper
+    // IRQ it raises, and at the end of each frame. Returns the dots from the
+    // PPU's position until the next of these.
+    int nes_t::dots_until_ppu_event()
+    {
+        int dots = std::min(
+            ppu.dots_until(ppu_t::SCANLINES - 1, ppu_t::DOTS_PER_SCANLINE - 1),
+            ppu.dots_until(241, 1));
+        if (cart && cart->mapper->has_scanline_irq())
+        {
+            int scanline = ppu.dot <= 260 ? ppu.scanline : ppu.scanline + 1;
+            if (scanline >= ppu_t::SCREEN_HEIGHT)
+            {
+                scanline = 0;
+            }
+            dots = std::min(dots, ppu.dots_until(scanline, 260));
+        }
+        return dots;
+    }
+
+    // Compiled blocks run as one long instruction, so they only run if no
+    // interrupt the CPU would take can be raised before they end, and no DMC
+    // DMA can steal the bus. Interrupts raised while the I flag is set don't
+    // matter since blocks never clear it. Blocks also end within the frame so
+    // that the state between frames matches the interpreter's. block_cycles
+    // is what jit_t::next_block_cycles() returned.
+    bool nes_t::run_jit(int block_cycles)
+    {
+        bool irq_enabled = !cpu.status.i;
+        if (ppu.nmi
+            || apu.dmc.dma_remaining > 0
+            || (irq_enabled && (apu.dmc.irq || apu.frame_irq || (cart && cart->mapper->irq))))
+        {
+            return false;
+        }
+        uint64_t deadline = ppu_sync_count + dots_until_ppu_event();
+        if (irq_enabled)
+        {
+            deadline = std::min(deadline, scheduler.get_time(event_t::apu_frame_counter));
+        }
+        if (deadline <= scheduler.time)
+        {
+            return false;
+        }
+        uint64_t cycles = (deadline - scheduler.time) / 3;
+        return cycles >= (uint64_t)block_cycles && jit->run(cycles);
+    }
+
+    // Vblank is set and cleared at fixed dots. Sprite overflow is only set
+    // by sprite evaluation at dot 257 of rendered lines, and sprite 0 hit
+    // only on lines where the evaluation before found sprite 0. The PPU must
+    // be up to date.
+    int nes_t::dots_until_ppu_status_change()
+    {
+        bool rendered_line = ppu.scanline < ppu_t::SCREEN_HEIGHT || ppu.scanline == ppu_t::SCANLINES - 1;
+        if (ppu.ppustatus.vblank
+            || (!ppu.ppustatus.sprite_zero_hit && ppu.sprite_zero_found && rendered_line))
+        {
+            // Reading PPUSTATUS would clear vblank, or sprite 0 may be hit
+            return 0;
+        }
+        int dots = std::min(
+            ppu.dots_until(241, 1),
+            ppu.dots_until(ppu_t::SCANLINES - 1, 1));
+        if (!ppu.ppustatus.sprite_overflow || !ppu.ppustatus.sprite_zero_hit)
+        {
+            int scanline = ppu.dot <= 257 ? ppu.scanline : ppu.scanline + 1;
+            if (scanline == ppu_t::SCANLINES)
+            {
+                scanline = 0;
+            }
+            else if (scanline >= ppu_t::SCREEN_HEIGHT)
+            {
+                scanline = ppu_t::SCANLINES - 1;
+            }
+            dots = std::min(dots, ppu.dots_until(scanline, 257));
+        }
+        return dots;
+    }
+
+    // Runs the rest of the machine for as many whole times round an idle
+    // loop as fit before an interrupt could be taken, PPUSTATUS could
+    // change or the frame ends. Since the loop would have done nothing but
+    // come back to the same state, the CPU is left where it is. Called
+    // between instructions.
+    void nes_t::skip_idle_loop()
+    {
+        uint64_t status_deadline = idle_status_deadline;
+        if (!idle_loop.update(scheduler.time))
+        {
+            return;
+        }
+        if (idle_loop.reads_ppu_status)
+        {
+            sync_ppu();
+            idle_status_deadline = ppu_sync_count + dots_until_ppu_status_change();
+        }
+        else
+        {
+            idle_status_deadline = scheduler_t::NEVER;
+        }
+
+        bool irq_enabled = !cpu.status.i;
+        if (!idle_loop.repeated
+            || ppu.nmi
+            || apu.dmc.dma_remaining > 0
+            || (irq_enabled && (apu.dmc.irq || apu.frame_irq || (cart && cart->mapper->irq))))
+        {
+            return;
+        }
+        uint64_t deadline = std::min(ppu_sync_count + dots_until_ppu_event(), status_deadline);
+        if (irq_enabled)
+        {
+            deadline = std::min(deadline, scheduler.get_time(event_t::apu_frame_counter));
+        }
+        // Stop short of the deadline so that clock_frame() still sees the
+        // dot the frame ends on
+        uint64_t round = (uint64_t)idle_loop.cycles * 3;
+        if (deadline <= scheduler.time + round)
+        {
+            return;
+        }
+        uint64_t cycles = (deadline - scheduler.time - 1) / round * idle_loop.cycles;
+        clock_idle(cycles);
+        idle_loop.round_start = scheduler.time;
+        idle_cycles_skipped += cycles;
+    }
+
+    // clock() without the CPU, which stays between instructions, or OAM
+    // DMA, which must not be running
+    void nes_t::clock_idle(uint64_t cycles)
+    {
+        uint64_t end = scheduler.time + cycles * 3;
+        while (scheduler.time < end)
+        {
+            if (scheduler.time % 3 == 0)
+            {
+                apu.clock();
+            }
+            if (!ppu_catch_up)
+            {
+                ppu.clock();
+                ppu_sync_count++;
+                scheduler.time++;
+            }
+            else
+            {
+                uint64_t next_cycle = scheduler.time - scheduler.time % 3 + 3;
+                scheduler.time = std::max(scheduler.time + 1, std::min(next_cycle, scheduler.next_time));
+            }
+            if (scheduler.time >= scheduler.next_time)
+            {
+                run_events();
+            }
+        }
+    }
+
+    bool nes_t::ppu_cpu_read(uint16_t addr, uint8_t& value, bool allow_side_effects)
+    {
+        sync_ppu();
+        return ppu.cpu_read(addr, value, allow_side_effects);
+    }
+
+    bool nes_t::ppu_cpu_write(uint16_t addr, uint8_t value)
+    {
+        sync_ppu();
+        return ppu.cpu_write(addr, value);
+    }
+
+    // Mapper registers can change banking, mirroring and IRQ state that the
+    // PPU depends on, so the PPU is caught up before they are written
+    bool nes_t::cart_cpu_write(uint16_t addr, uint8_t value)
+    {
+        if (!cart)
+        {
+            return false;
+        }
+        sync_ppu();
+        bool handled = cart->cpu_write(addr, value);
+        schedule_ppu_sync();
+        return handled;
+    }
 }
@@ -8,15 +8,18 @@
 #include "controller.h"
 #include "cart.h"
 #include "oam_dma.h"
+#include "scheduler.h"
+#include "jit.h"
+#include "idle_loop.h"
+#include "cpu_trace.h"
 
 #include <memory>
-#include <functional>
 
 namespace nes
 {
     struct nes_t
     {
-        nes_t(std::function<void()> on_clock = []{});
+        nes_t();
         void reset();
         void clock();
         void clock_instruction();
@@ -24,7 +27,18 @@ namespace nes
         void clock_frame();
         void unload_cart();
         void load_cart(std::unique_ptr<cart_t> cart);
+        void sync_ppu();
+        void set_ppu_catch_up(bool enabled);
+        void set_jit(jit_mode_t mode);
+        void set_idle_skip(bool enabled);
+        void set_cpu_trace(cpu_trace_t* trace);
+        void set_audio_output(audio_output_t* output, double sample_rate);
+        void set_video_output(bool enabled);
+        size_t save_state(std::vector<uint8_t>& buffer);
+        bool load_state(const uint8_t* data, size_t size);
+        uint64_t hash_state(bool include_screen = true);
 
+        scheduler_t scheduler;
         bus_t cpu_bus;
         bus_t ppu_bus;
         ram_t ram;
@@ -34,9 +48,43 @@ namespace nes
         oam_dma_t oam_dma;
         controller_t controller;
         std::unique_ptr<cart_t> cart;
+        // Null unless enabled with set_jit()
+        std::unique_ptr<jit_t> jit;
 
-        uint64_t ppu_clock_count;
         uint8_t screen_buffer[ppu_t::SCREEN_WIDTH * ppu_t::SCREEN_HEIGHT];
-        std::function<void()> on_clock;
+
+        // When set, the PPU is not clocked every dot. Instead it lags behind
+        // and is caught up when the CPU accesses the PPU or the cartridge,
+        // when an NMI or mapper IRQ may be raised, and at the end of a frame.
+        bool ppu_catch_up;
+        uint64_t ppu_sync_count;
+
+        // When set, clock_frame() doesn't run the CPU round idle loops,
+        // only the rest of the machine, until something the loop reads
+        // could change or an interrupt is due
+        bool idle_skip;
+        uint64_t idle_cycles_skipped;
+
+    private:
+        void run_events();
+        void clock_to_next_event();
+        void clock_cpu_cycle();
+        void write_state(state_t& state);
+        bool serialize_section(uint32_t tag, state_t& state);
+        bool ppu_cpu_read(uint16_t addr, uint8_t& value, bool allow_side_effects);
+        bool ppu_cpu_write(uint16_t addr, uint8_t value);
+        bool cart_cpu_write(uint16_t addr, uint8_t value);
+        void schedule_ppu_sync();
+        int dots_until_ppu_event();
+        int dots_until_ppu_status_change();
+        bool run_jit(int block_cycles);
+        void skip_idle_loop();
+        void clock_idle(uint64_t cycles);
+
+        idle_loop_t idle_loop;
+        // When PPUSTATUS can next change, as of the start of the last time
+        // round the idle loop
+        uint64_t idle_status_deadline;
+        size_t last_state_size;
     };
 }
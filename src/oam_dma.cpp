@@ -19,6 +19,13 @@ namespace nes
         *this = oam_dma_t(*cpu_bus);
     }
 
+    void oam_dma_t::serialize(state_t& state)
+    {
+        state.value(page);
+        state.value(cycles_remaining);
+        state.value(last_read);
+    }
+
     void oam_dma_t::copy(uint8_t page)
     {
         this->page = page;
@@ -9,6 +9,7 @@ namespace nes
         oam_dma_t(bus_t& cpu_bus);
         ~oam_dma_t();
         void reset();
+        void serialize(state_t& state);
         void copy(uint8_t page);
         void clock();
         uint8_t page;
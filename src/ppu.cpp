@@ -26,6 +26,10 @@ namespace nes
           is_first_frame(true),
           nametable_read(0),
           attribute_read(0),
+          attribute_lo_latch(false),
+          attribute_hi_latch(false),
+          attribute_lo_read_shift_reg(0),
+          attribute_hi_read_shift_reg(0),
           pattern_lo_read(0),
           pattern_hi_read(0),
           pattern_lo_read_shift_reg(0),
@@ -37,13 +41,17 @@ namespace nes
           secondary_oam_count(0),
           sprite_output{},
           sprite_zero_found(false),
-          sprite_zero_found_next(false)
+          sprite_zero_found_next(false),
+          output_enabled(true)
     {
-        ppu_bus.connect_read<&ppu_t::ppu_read>(this);
-        ppu_bus.connect_write<&ppu_t::ppu_write>(this);
+        ppu_bus.connect_read<&ppu_t::ppu_read>(this, 0x2000, 0x3FFF);
+        ppu_bus.connect_write<&ppu_t::ppu_write>(this, 0x2000, 0x3FFF);
         memset(palette, 0x0F, sizeof(palette));
         memset(screen_buffer, 0x0F, SCREEN_WIDTH * SCREEN_HEIGHT);
-        debug.pixel_trace.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+        if constexpr (DEBUG_ENABLED)
+        {
+            debug.pixel_trace.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+        }
     }
 
     ppu_t::~ppu_t()
@@ -56,11 +64,51 @@ namespace nes
     {
         cart_t *cart = this->cart;
         auto ppu_debug = std::move(this->debug);
+        bool output_enabled = this->output_enabled;
         *this = ppu_t(*ppu_bus, *oam_dma, screen_buffer);
         set_cart(cart);
+        this->output_enabled = output_enabled;
         this->debug = std::move(ppu_debug);
-        memset(debug.pixel_trace.data(), 0, debug.pixel_trace.size() * sizeof(debug.pixel_trace[0]));
-        memset(&debug.trace_info, 0, sizeof(debug.trace_info));
+        if constexpr (DEBUG_ENABLED)
+        {
+            memset(debug.pixel_trace.data(), 0, debug.pixel_trace.size() * sizeof(debug.pixel_trace[0]));
+            memset(&debug.trace_info, 0, sizeof(debug.trace_info));
+        }
+    }
+
+    void ppu_t::serialize(state_t& state)
+    {
+        state.value(ppuctrl);
+        state.value(ppumask);
+        state.value(ppustatus);
+        state.value(v_vram_addr);
+        state.value(t_vram_addr);
+        state.value(x_scroll);
+        state.value(nmi);
+        state.value(write_toggle);
+        state.value(ppudata_read_buffer);
+        state.value(nametable_read);
+        state.value(attribute_read);
+        state.value(attribute_lo_latch);
+        state.value(attribute_hi_latch);
+        state.value(attribute_lo_read_shift_reg);
+        state.value(attribute_hi_read_shift_reg);
+        state.value(pattern_lo_read);
+        state.value(pattern_hi_read);
+        state.value(pattern_lo_read_shift_reg);
+        state.value(pattern_hi_read_shift_reg);
+        state.value(oam_addr);
+        state.value(dot);
+        state.value(scanline);
+        state.value(is_first_frame);
+        state.value(nametable);
+        state.value(palette);
+        state.value(oam_bytes);
+        state.value(secondary_oam_bytes);
+        state.value(secondary_oam_count);
+        state.value(sprite_output);
+        state.value(sprite_zero_found);
+        state.value(sprite_zero_found_next);
     }
 
     void ppu_t::set_cart(cart_t* cart)
@@ -329,7 +377,10 @@ namespace nes
                 if (oam_y < 239 && scanline >= oam_y && scanline < oam_y + sprite_size)
                 {
                     secondary_oam[secondary_oam_count] = oam[n];
-                    debug.trace_info.secondary_oam_indices[secondary_oam_count] = n;
+                    if constexpr (DEBUG_ENABLED)
+                    {
+                        debug.trace_info.secondary_oam_indices[secondary_oam_count] = n;
+                    }
                     secondary_oam_count++;
                     if (n == 0)
                     {
@@ -397,15 +448,18 @@ namespace nes
                     output.pattern_lo = reverse_bits(output.pattern_lo);
                     output.pattern_hi = reverse_bits(output.pattern_hi);
                 }
-                auto& debug_sprite = debug.trace_info.sprite_output[i];
-                debug_sprite.oam = oam;
-                if (sprite_size == 16)
+                if constexpr (DEBUG_ENABLED)
                 {
-                    debug_sprite.oam.tile_index &= 0xFE;
+                    auto& debug_sprite = debug.trace_info.sprite_output[i];
+                    debug_sprite.oam = oam;
+                    if (sprite_size == 16)
+                    {
+                        debug_sprite.oam.tile_index &= 0xFE;
+                    }
+                    debug_sprite.pattern_table = pattern_table;
+                    debug_sprite.is_8x16 = sprite_size == 16;
+                    debug_sprite.sprite_index = debug.trace_info.secondary_oam_indices[i];
                 }
-                debug_sprite.pattern_table = pattern_table;
-                debug_sprite.is_8x16 = sprite_size == 16;
-                debug_sprite.sprite_index = debug.trace_info.secondary_oam_indices[i];
             }
         }
 
@@ -502,56 +556,68 @@ namespace nes
                 if (ppustatus.sprite_zero_hit == 0 && sprite_zero_opaque && bg_pattern != 0 && dot - 1 < 255)
                 {
                     ppustatus.sprite_zero_hit = 1;
-                    debug.sprite_zero_hit_dot = dot - 1;
-                    debug.sprite_zero_hit_scanline = scanline;
+                    if constexpr (DEBUG_ENABLED)
+                    {
+                        debug.sprite_zero_hit_dot = dot - 1;
+                        debug.sprite_zero_hit_scanline = scanline;
+                    }
                 }
 
-                bool is_fg_palette = found_sprite != -1
-                    && ((fg_pattern != 0 && !back_priority) || bg_pattern == 0)
-                    && debug.enable_fg;
-                uint8_t final_pattern = is_fg_palette ? fg_pattern : bg_pattern;
-                uint8_t final_attribute = is_fg_palette ? fg_attribute : bg_attribute;
-                uint8_t colour_index = ppu_bus->read(
-                    get_palette_addr(is_fg_palette,
-                        final_attribute,
-                        final_pattern));
-                if (!is_fg_palette && !debug.enable_bg)
+                if (output_enabled)
                 {
-                    colour_index = ppu_bus->read(
-                        get_palette_addr(0, 0, 0),
+                    bool is_fg_palette = found_sprite != -1
+                        && ((fg_pattern != 0 && !back_priority) || bg_pattern == 0)
+                        && (!DEBUG_ENABLED || debug.enable_fg);
+                    uint8_t final_pattern = is_fg_palette ? fg_pattern : bg_pattern;
+                    uint8_t final_attribute = is_fg_palette ? fg_attribute : bg_attribute;
+                    // The palette is internal to the PPU, so looking it up
+                    // does not leave a value on the bus
+                    uint8_t colour_index = ppu_bus->read(
+                        get_palette_addr(is_fg_palette,
+                            final_attribute,
+                            final_pattern),
                         false);
-                }
-                if (ppumask.greyscale || debug.enable_greyscale)
-                {
-                    colour_index &= 0x30;
-                }
-                screen_buffer[scanline * SCREEN_WIDTH + dot - 1] = colour_index;
-
-                auto& trace = debug.pixel_trace[(dot - 1) + scanline * SCREEN_WIDTH];
-                trace.slot = trace.slot == 1 ? 2 : 1;
-                auto& slot = trace.slots[trace.slot - 1];
-
-                slot.bg.tile_index = debug.trace_info.tile_index & 0xFF;
-                slot.bg.pattern_table = debug.trace_info.pattern_table;
-                slot.bg.attribute = debug.trace_info.attribute;
-                slot.bg.pattern = bg_pattern;
-                slot.bg.hidden = bg_hidden;
+                    if (DEBUG_ENABLED && !is_fg_palette && !debug.enable_bg)
+                    {
+                        colour_index = ppu_bus->read(
+                            get_palette_addr(0, 0, 0),
+                            false);
+                    }
+                    if (ppumask.greyscale || (DEBUG_ENABLED && debug.enable_greyscale))
+                    {
+                        colour_index &= 0x30;
+                    }
+                    screen_buffer[scanline * SCREEN_WIDTH + dot - 1] = colour_index;
 
-                slot.fg.exists = found_sprite != -1;
-                if (slot.fg.exists)
-                {
-                    auto& sprite = debug.trace_info.sprite_output[found_sprite];
-                    slot.fg.sprite_index = sprite.sprite_index;
-                    slot.fg.x = sprite.oam.x;
-                    slot.fg.y = sprite.oam.y;
-                    slot.fg.tile_index = sprite.oam.tile_index;
-                    slot.fg.pattern_table = sprite.pattern_table;
-                    slot.fg.attribute = sprite.oam.attribute;
-                    slot.fg.pattern = fg_pattern;
-                    slot.fg.flip_horizontally = sprite.oam.flip_horizontally;
-                    slot.fg.flip_vertically = sprite.oam.flip_vertically;
-                    slot.fg.priority = back_priority;
-                    slot.fg.is_8x16 = sprite.is_8x16;
+                    if constexpr (DEBUG_ENABLED)
+                    {
+                        auto& trace = debug.pixel_trace[(dot - 1) + scanline * SCREEN_WIDTH];
+                        trace.slot = trace.slot == 1 ? 2 : 1;
+                        auto& slot = trace.slots[trace.slot - 1];
+
+                        slot.bg.tile_index = debug.trace_info.tile_index & 0xFF;
+                        slot.bg.pattern_table = debug.trace_info.pattern_table;
+                        slot.bg.attribute = debug.trace_info.attribute;
+                        slot.bg.pattern = bg_pattern;
+                        slot.bg.hidden = bg_hidden;
+
+                        slot.fg.exists = found_sprite != -1;
+                        if (slot.fg.exists)
+                        {
+                            auto& sprite = debug.trace_info.sprite_output[found_sprite];
+                            slot.fg.sprite_index = sprite.sprite_index;
+                            slot.fg.x = sprite.oam.x;
+                            slot.fg.y = sprite.oam.y;
+                            slot.fg.tile_index = sprite.oam.tile_index;
+                            slot.fg.pattern_table = sprite.pattern_table;
+                            slot.fg.attribute = sprite.oam.attribute;
+                            slot.fg.pattern = fg_pattern;
+                            slot.fg.flip_horizontally = sprite.oam.flip_horizontally;
+                            slot.fg.flip_vertically = sprite.oam.flip_vertically;
+                            slot.fg.priority = back_priority;
+                            slot.fg.is_8x16 = sprite.is_8x16;
+                        }
+                    }
                 }
             }
 
@@ -593,10 +659,13 @@ namespace nes
                 attribute_lo_latch = attribute & 1;
                 attribute_hi_latch = (attribute >> 1) & 1;
 
-                debug.trace_info.tile_index >>= 8;
-                debug.trace_info.tile_index |= nametable_read << 8;
-                debug.trace_info.pattern_table = ppuctrl.bg_pattern_table_addr;
-                debug.trace_info.attribute = attribute;
+                if constexpr (DEBUG_ENABLED)
+                {
+                    debug.trace_info.tile_index >>= 8;
+                    debug.trace_info.tile_index |= nametable_read << 8;
+                    debug.trace_info.pattern_table = ppuctrl.bg_pattern_table_addr;
+                    debug.trace_info.attribute = attribute;
+                }
                 break;
             }
             }
@@ -633,7 +702,7 @@ namespace nes
             ppustatus.sprite_overflow = 0;
         }
 
-        if (dot == 128 && scanline == 120)
+        if (DEBUG_ENABLED && dot == 128 && scanline == 120)
         {
             debug.centre_scroll_x = ((t_vram_addr.nametable_select & 1) ? 256 : 0)
                 + (t_vram_addr.coarse_x_scroll * 8)
@@ -654,4 +723,13 @@ namespace nes
             }
         }
     }
+    // Number of dots that must be clocked until the given dot has been
+    // processed, between 1 and a full frame
+    int ppu_t::dots_until(int scanline, int dot) const
+    {
+        constexpr int DOTS_PER_FRAME = DOTS_PER_SCANLINE * SCANLINES;
+        int from = this->scanline * DOTS_PER_SCANLINE + this->dot;
+        int to = scanline * DOTS_PER_SCANLINE + dot;
+        return ((to - from + DOTS_PER_FRAME) % DOTS_PER_FRAME) + 1;
+    }
 }
@@ -3,6 +3,7 @@
 #include "bus.h"
 #include "cart.h"
 #include "oam_dma.h"
+#include "debug.h"
 
 #include <optional>
 
@@ -62,12 +63,14 @@ namespace nes
         ppu_t(bus_t& ppu_bus, oam_dma_t& oam_dma, uint8_t* screen_buffer);
         ~ppu_t();
         void reset();
+        void serialize(state_t& state);
         void set_cart(cart_t* cart);
         bool cpu_read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         bool cpu_write(uint16_t addr, uint8_t value);
         bool ppu_read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         bool ppu_write(uint16_t addr, uint8_t value);
         void clock();
+        int dots_until(int scanline, int dot) const;
 
         static constexpr uint16_t get_nametable_addr(uint8_t nametable)
         {
@@ -258,6 +261,10 @@ namespace nes
         bool sprite_zero_found;
         bool sprite_zero_found_next;
 
+        // When cleared, pixels are not composed or written to the screen
+        // buffer. Sprite 0 hit and sprite overflow are still evaluated.
+        bool output_enabled;
+
         struct
         {
             struct pixel_trace_slots_t
@@ -0,0 +1,81 @@
+#include "pch.h"
+#include "profiler.h"
+
+#include <cstdio>
+
+namespace nes
+{
+    // Small, stable ids make the trace viewer lay threads out in the order
+    // they first recorded a zone
+    static uint32_t get_thread_id()
+    {
+        static std::atomic<uint32_t> next_id = 0;
+        thread_local uint32_t id = next_id++;
+        return id;
+    }
+
+    profiler_t::profiler_t(size_t max_zones)
+        : recording(false),
+          max_zones(max_zones),
+          start_ns(0)
+    {
+    }
+
+    void profiler_t::start()
+    {
+        std::lock_guard lock(mutex);
+        zones.clear();
+        start_ns = now();
+        recording.store(true, std::memory_order_relaxed);
+    }
+
+    void profiler_t::stop()
+    {
+        recording.store(false, std::memory_order_relaxed);
+    }
+
+    bool profiler_t::is_recording() const
+    {
+        return recording.load(std::memory_order_relaxed);
+    }
+
+    size_t profiler_t::zone_count() const
+    {
+        std::lock_guard lock(mutex);
+        return zones.size();
+    }
+
+    void profiler_t::add_zone(const char* name, uint64_t begin_ns, uint64_t end_ns)
+    {
+        uint32_t thread = get_thread_id();
+        std::lock_guard lock(mutex);
+        // Zones that began before start() belong to the previous recording
+        if (zones.size() < max_zones && begin_ns >= start_ns)
+        {
+            zones.push_back(zone_t{name, begin_ns, end_ns, thread});
+        }
+    }
+
+    // Complete ("X") events with times in microseconds relative to start()
+    void profiler_t::save(std::string& json) const
+    {
+        std::lock_guard lock(mutex);
+        json = "{\"traceEvents\":[\n";
+        char line[256];
+        for (size_t i = 0; i < zones.size(); i++)
+        {
+            const zone_t& zone = zones[i];
+            snprintf(
+                line,
+                sizeof(line),
+                "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                zone.name,
+                zone.thread,
+                (zone.begin_ns - start_ns) / 1000.0,
+                (zone.end_ns - zone.begin_ns) / 1000.0,
+                i + 1 < zones.size() ? "," : "");
+            json += line;
+        }
+        json += "],\"displayTimeUnit\":\"ms\"}\n";
+    }
+}
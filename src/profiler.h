@@ -0,0 +1,76 @@
+#pragma once
+#include "pch.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nes
+{
+    // Records named spans of wall-clock time, from any thread, and saves
+    // them in the Chrome trace event format for chrome://tracing or
+    // ui.perfetto.dev. Zones are only recorded between start() and stop(),
+    // so leaving zones in place costs one relaxed load otherwise.
+    struct profiler_t
+    {
+        profiler_t(size_t max_zones = 1024 * 1024);
+        void start();
+        void stop();
+        bool is_recording() const;
+        size_t zone_count() const;
+        void save(std::string& json) const;
+
+        // name must outlive the profiler, normally it is a string literal
+        void add_zone(const char* name, uint64_t begin_ns, uint64_t end_ns);
+
+        static uint64_t now()
+        {
+            auto time = std::chrono::steady_clock::now().time_since_epoch();
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+        }
+
+    private:
+        struct zone_t
+        {
+            const char* name;
+            uint64_t begin_ns;
+            uint64_t end_ns;
+            uint32_t thread;
+        };
+
+        std::atomic<bool> recording;
+        mutable std::mutex mutex;
+        std::vector<zone_t> zones;
+        size_t max_zones;
+        uint64_t start_ns;
+    };
+
+    // Records the lifetime of the object as a zone
+    struct profile_zone_t
+    {
+        profile_zone_t(profiler_t& profiler, const char* name)
+            : profiler(profiler),
+              name(name),
+              begin_ns(profiler.is_recording() ? profiler_t::now() : 0)
+        {
+        }
+
+        ~profile_zone_t()
+        {
+            if (begin_ns && profiler.is_recording())
+            {
+                profiler.add_zone(name, begin_ns, profiler_t::now());
+            }
+        }
+
+        profile_zone_t(const profile_zone_t&) = delete;
+        profile_zone_t& operator=(const profile_zone_t&) = delete;
+
+    private:
+        profiler_t& profiler;
+        const char* name;
+        uint64_t begin_ns;
+    };
+}
@@ -13,6 +13,11 @@ namespace nes
         memset(data, 0, sizeof(data));
     }
 
+    void ram_t::serialize(state_t& state)
+    {
+        state.value(data);
+    }
+
     bool ram_t::read(uint16_t addr, uint8_t& value, bool allow_side_effects)
     {
         if (addr < 0x2000)
@@ -10,6 +10,7 @@ namespace nes
 
         ram_t();
         void reset();
+        void serialize(state_t& state);
         bool read(uint16_t addr, uint8_t& value, bool allow_side_effects);
         bool write(uint16_t addr, uint8_t value);
 
@@ -0,0 +1,233 @@
+#include "pch.h"
+#include "rewind.h"
+
+namespace nes
+{
+    // Runs of unchanged bytes shorter than this are kept in a literal
+    // rather than starting a new run
+    static constexpr size_t MIN_SKIP = 4;
+    static constexpr size_t MAX_RUN = 0xFFFF;
+
+    rewind_t::rewind_t(size_t capacity, int keyframe_interval)
+        : ring(new uint8_t[capacity]),
+          capacity(capacity),
+          keyframe_interval(keyframe_interval),
+          frames_since_keyframe(0)
+    {
+    }
+
+    void rewind_t::clear()
+    {
+        entries.clear();
+        latest.clear();
+        frames_since_keyframe = 0;
+    }
+
+    // Records the current state of the machine. Call once per frame.
+    void rewind_t::push(nes_t& nes)
+    {
+        scratch.clear();
+        nes.save_state(scratch);
+
+        bool keyframe = entries.empty()
+            || frames_since_keyframe + 1 >= keyframe_interval
+            || scratch.size() != latest.size();
+        encoded.clear();
+        encode(keyframe ? nullptr : latest.data(), scratch.data(), scratch.size(), encoded);
+        if (!store(keyframe, scratch.size()))
+        {
+            clear();
+            return;
+        }
+        frames_since_keyframe = keyframe ? 0 : frames_since_keyframe + 1;
+        latest.swap(scratch);
+    }
+
+    // Loads the most recently pushed state and removes it from the history.
+    // Returns false if there is no history left.
+    bool rewind_t::rewind(nes_t& nes)
+    {
+        if (entries.empty())
+        {
+            return false;
+        }
+        bool loaded = nes.load_state(latest.data(), latest.size());
+
+        entry_t entry = entries.back();
+        entries.pop_back();
+        if (entries.empty())
+        {
+            latest.clear();
+        }
+        else if (!entry.keyframe)
+        {
+            // XOR is its own inverse
+            apply(entry, latest);
+            frames_since_keyframe--;
+        }
+        else
+        {
+            rebuild_latest();
+        }
+        return loaded;
+    }
+
+    size_t rewind_t::frame_count() const
+    {
+        return entries.size();
+    }
+
+    size_t rewind_t::memory_used() const
+    {
+        if (entries.empty())
+        {
+            return 0;
+        }
+        size_t begin = entries.front().offset;
+        size_t end = entries.back().offset + entries.back().size;
+        return end > begin ? end - begin : capacity - begin + end;
+    }
+
+    // Each run is a 16-bit count of unchanged bytes, a 16-bit count of
+    // changed bytes, then the changed bytes XORed with the previous state.
+    // Without a previous state every byte counts as changed.
+    void rewind_t::encode(const uint8_t* previous, const uint8_t* state, size_t size, std::vector<uint8_t>& out)
+    {
+        auto diff = [&](size_t i) -> uint8_t
+        {
+            return previous ? state[i] ^ previous[i] : state[i];
+        };
+
+        size_t i = 0;
+        while (i < size)
+        {
+            size_t skip = 0;
+            while (i + skip < size && skip < MAX_RUN && diff(i + skip) == 0)
+            {
+                skip++;
+            }
+            i += skip;
+
+            size_t count = 0;
+            size_t zeros = 0;
+            while (i + count < size && count < MAX_RUN)
+            {
+                if (diff(i + count) == 0)
+                {
+                    zeros++;
+                    if (zeros >= MIN_SKIP)
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    zeros = 0;
+                }
+                count++;
+            }
+            if (zeros >= MIN_SKIP)
+            {
+                count -= zeros - 1;
+            }
+
+            out.push_back((uint8_t)skip);
+            out.push_back((uint8_t)(skip >> 8));
+            out.push_back((uint8_t)count);
+            out.push_back((uint8_t)(count >> 8));
+            for (size_t j = 0; j < count; j++)
+            {
+                out.push_back(diff(i + j));
+            }
+            i += count;
+        }
+    }
+
+    void rewind_t::apply(const entry_t& entry, std::vector<uint8_t>& state) const
+    {
+        const uint8_t* data = &ring[entry.offset];
+        const uint8_t* end = data + entry.size;
+        size_t i = 0;
+        while (data < end)
+        {
+            size_t skip = data[0] | (data[1] << 8);
+            size_t count = data[2] | (data[3] << 8);
+            data += 4;
+            i += skip;
+            for (size_t j = 0; j < count; j++)
+            {
+                state[i + j] ^= data[j];
+            }
+            data += count;
+            i += count;
+        }
+    }
+
+    // Copies the encoded entry into the ring after the newest entry,
+    // dropping the oldest entries to make room
+    bool rewind_t::store(bool keyframe, size_t state_size)
+    {
+        size_t size = encoded.size();
+        if (size > capacity)
+        {
+            return false;
+        }
+
+        size_t offset = 0;
+        if (!entries.empty())
+        {
+            offset = entries.back().offset + entries.back().size;
+            if (offset + size > capacity)
+            {
+                // Entries past this point are older than those before it
+                while (!entries.empty() && entries.front().offset >= offset)
+                {
+                    evict_oldest();
+                }
+                offset = 0;
+            }
+        }
+        while (!entries.empty()
+            && entries.front().offset < offset + size
+            && entries.front().offset + entries.front().size > offset)
+        {
+            evict_oldest();
+        }
+
+        if (entries.empty() && !keyframe)
+        {
+            return false;
+        }
+
+        memcpy(&ring[offset], encoded.data(), size);
+        entries.push_back(entry_t{ offset, size, state_size, keyframe });
+        return true;
+    }
+
+    // Deltas are useless without the keyframe before them, so they go too
+    void rewind_t::evict_oldest()
+    {
+        entries.pop_front();
+        while (!entries.empty() && !entries.front().keyframe)
+        {
+            entries.pop_front();
+        }
+    }
+
+    // Reconstructs the newest state by applying the deltas since the last
+    // keyframe
+    void rewind_t::rebuild_latest()
+    {
+        size_t keyframe = entries.size() - 1;
+        while (!entries[keyframe].keyframe)
+        {
+            keyframe--;
+        }
+        latest.assign(entries[keyframe].state_size, 0);
+        for (size_t i = keyframe; i < entries.size(); i++)
+        {
+            apply(entries[i], latest);
+        }
+        frames_since_keyframe = (int)(entries.size() - 1 - keyframe);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "pch.h"
+#include "nes.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace nes
+{
+    // Keeps the most recent save states in a fixed-size ring buffer so the
+    // machine can be stepped backwards. Every keyframe_interval-th state is
+    // stored whole; the others are stored as their XOR with the previous
+    // state, run-length encoded, since most of the machine is unchanged
+    // from one frame to the next. The oldest states are dropped, a keyframe
+    // at a time, when the buffer is full.
+    struct rewind_t
+    {
+        rewind_t(size_t capacity = 64 * 1024 * 1024, int keyframe_interval = 60);
+        void clear();
+        void push(nes_t& nes);
+        bool rewind(nes_t& nes);
+        size_t frame_count() const;
+        size_t memory_used() const;
+
+    private:
+        struct entry_t
+        {
+            size_t offset;
+            size_t size;
+            size_t state_size;
+            bool keyframe;
+        };
+
+        static void encode(const uint8_t* previous, const uint8_t* state, size_t size, std::vector<uint8_t>& out);
+        void apply(const entry_t& entry, std::vector<uint8_t>& state) const;
+        bool store(bool keyframe, size_t state_size);
+        void evict_oldest();
+        void rebuild_latest();
+
+        // Left uninitialised so that untouched pages cost nothing
+        std::unique_ptr<uint8_t[]> ring;
+        size_t capacity;
+        std::deque<entry_t> entries;
+        int keyframe_interval;
+        int frames_since_keyframe;
+        // The newest state in full, which deltas are applied to
+        std::vector<uint8_t> latest;
+        std::vector<uint8_t> scratch;
+        std::vector<uint8_t> encoded;
+    };
+}
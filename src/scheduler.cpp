@@ -0,0 +1,67 @@
+#include "pch.h"
+#include "scheduler.h"
+
+#include <algorithm>
+
+namespace nes
+{
+    scheduler_t::scheduler_t()
+    {
+        reset();
+    }
+
+    void scheduler_t::reset()
+    {
+        time = 0;
+        for (auto& event_time : event_times)
+        {
+            event_time = NEVER;
+        }
+        next_time = NEVER;
+    }
+
+    void scheduler_t::schedule(event_t event, uint64_t time)
+    {
+        event_times[(size_t)event] = time;
+        update_next_time();
+    }
+
+    uint64_t scheduler_t::get_time(event_t event) const
+    {
+        return event_times[(size_t)event];
+    }
+
+    void scheduler_t::cancel(event_t event)
+    {
+        schedule(event, NEVER);
+    }
+
+    // Removes the earliest event that is due, if any
+    bool scheduler_t::pop_due(event_t& event)
+    {
+        if (next_time > time)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < (size_t)event_t::count; i++)
+        {
+            if (event_times[i] == next_time)
+            {
+                event = (event_t)i;
+                event_times[i] = NEVER;
+                update_next_time();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void scheduler_t::update_next_time()
+    {
+        next_time = NEVER;
+        for (uint64_t event_time : event_times)
+        {
+            next_time = std::min(next_time, event_time);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "pch.h"
+
+namespace nes
+{
+    enum class event_t : uint8_t
+    {
+        ppu_sync,
+        apu_frame_counter,
+        audio_sample,
+        count,
+    };
+
+    // Keeps the master clock (in PPU dots) and the time at which each kind
+    // of event is next due, so the main loop only has to compare the clock
+    // against a single deadline
+    struct scheduler_t
+    {
+        static constexpr uint64_t NEVER = UINT64_MAX;
+
+        scheduler_t();
+        void reset();
+        void schedule(event_t event, uint64_t time);
+        void cancel(event_t event);
+        bool pop_due(event_t& event);
+        uint64_t get_time(event_t event) const;
+
+        uint64_t time;
+        uint64_t next_time;
+
+    private:
+        void update_next_time();
+
+        uint64_t event_times[(size_t)event_t::count];
+    };
+}
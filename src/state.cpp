@@ -0,0 +1,120 @@
+#include "pch.h"
+#include "state.h"
+#include "hash.h"
+
+namespace nes
+{
+    // Appends to the buffer
+    state_t::state_t(std::vector<uint8_t>& buffer)
+        : buffer(&buffer),
+          hasher(nullptr),
+          data(nullptr),
+          size(0),
+          pos(0),
+          failed(false)
+    {
+    }
+
+    state_t::state_t(const uint8_t* data, size_t size)
+        : buffer(nullptr),
+          hasher(nullptr),
+          data(data),
+          size(size),
+          pos(0),
+          failed(false)
+    {
+    }
+
+    state_t::state_t(hasher_t& hasher)
+        : buffer(nullptr),
+          hasher(&hasher),
+          data(nullptr),
+          size(0),
+          pos(0),
+          failed(false)
+    {
+    }
+
+    bool state_t::is_loading() const
+    {
+        return buffer == nullptr && hasher == nullptr;
+    }
+
+    // False once a load has read past the end of its data
+    bool state_t::ok() const
+    {
+        return !failed;
+    }
+
+    bool state_t::at_end() const
+    {
+        return pos == size;
+    }
+
+    void state_t::bytes(void* data, size_t size)
+    {
+        if (hasher)
+        {
+            hasher->update(data, size);
+        }
+        else if (!is_loading())
+        {
+            const uint8_t* bytes = (const uint8_t*)data;
+            buffer->insert(buffer->end(), bytes, bytes + size);
+        }
+        else if (failed || this->size - pos < size)
+        {
+            failed = true;
+            memset(data, 0, size);
+        }
+        else
+        {
+            memcpy(data, this->data + pos, size);
+            pos += size;
+        }
+    }
+
+    // Writes a section header whose size is filled in by end_section().
+    // Hashing only includes the tag, as the size is not known up front.
+    size_t state_t::begin_section(uint32_t tag)
+    {
+        value(tag);
+        if (hasher)
+        {
+            return 0;
+        }
+        uint32_t size = 0;
+        value(size);
+        return buffer->size();
+    }
+
+    void state_t::end_section(size_t start)
+    {
+        if (hasher)
+        {
+            return;
+        }
+        uint32_t size = (uint32_t)(buffer->size() - start);
+        memcpy(buffer->data() + start - sizeof(size), &size, sizeof(size));
+    }
+
+    // Reads the next section header and points section at its payload
+    bool state_t::next_section(uint32_t& tag, state_t& section)
+    {
+        uint32_t section_size = 0;
+        if (at_end())
+        {
+            return false;
+        }
+        value(tag);
+        value(section_size);
+        if (failed || size - pos < section_size)
+        {
+            failed = true;
+            return false;
+        }
+        section = state_t(data + pos, section_size);
+        pos += section_size;
+        return true;
+    }
+}
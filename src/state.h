@@ -0,0 +1,61 @@
+#pragma once
+#include "pch.h"
+
+#include <type_traits>
+#include <vector>
+
+namespace nes
+{
+    struct hasher_t;
+
+    constexpr uint32_t make_state_tag(const char (&tag)[5])
+    {
+        return (uint32_t)(uint8_t)tag[0]
+            | ((uint32_t)(uint8_t)tag[1] << 8)
+            | ((uint32_t)(uint8_t)tag[2] << 16)
+            | ((uint32_t)(uint8_t)tag[3] << 24);
+    }
+
+    // Reads or writes a save state. Components describe their state once in
+    // serialize(), which is used in both directions.
+    //
+    // A save state is a header (magic, version) followed by sections, each
+    // a 4 character tag and a payload size. Unknown sections are skipped
+    // on load.
+    //
+    // A state can also be fed to a hasher instead of a buffer, which hashes
+    // the same bytes a save would write without building the save.
+    struct state_t
+    {
+        static constexpr uint32_t MAGIC = make_state_tag("NESS");
+        static constexpr uint32_t VERSION = 3;
+
+        state_t(std::vector<uint8_t>& buffer);
+        state_t(const uint8_t* data, size_t size);
+        state_t(hasher_t& hasher);
+
+        bool is_loading() const;
+        bool ok() const;
+        bool at_end() const;
+        void bytes(void* data, size_t size);
+
+        template <typename T>
+        void value(T& value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "State values must be trivially copyable");
+            bytes(&value, sizeof(T));
+        }
+
+        size_t begin_section(uint32_t tag);
+        void end_section(size_t start);
+        bool next_section(uint32_t& tag, state_t& section);
+
+    private:
+        std::vector<uint8_t>* buffer;
+        hasher_t* hasher;
+        const uint8_t* data;
+        size_t size;
+        size_t pos;
+        bool failed;
+    };
+}
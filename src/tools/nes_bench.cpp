@@ -0,0 +1,580 @@
+// Measures the throughput of the core components and of whole frames, and
+// prints the results as JSON. Given a baseline from an earlier run, fails
+// if any benchmark has become slower by more than the threshold.
+//
+// Usage: nes_bench [<rom>...] [options]
+//   --output <file>     Write the JSON results to a file instead of stdout
+//   --baseline <file>   Compare against the results of an earlier run
+//   --threshold <pct>   Allowed slowdown against the baseline (default 10)
+//   --filter <text>     Only run benchmarks whose name contains the text
+//   --min-time <s>      Time spent on each benchmark (default 0.5)
+//   --instances <n>     Instances of each ROM run together by batch_t
+//                       (default one per hardware thread)
+//
+// Each benchmark is run in several batches and the fastest batch is kept,
+// which is the most stable measure on a machine doing other work.
+
+#include "pch.h"
+#include "nes.h"
+#include "batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr int BATCHES = 5;
+// Exit code when a benchmark regressed against the baseline
+static constexpr int EXIT_REGRESSION = 3;
+
+struct options_t
+{
+    std::vector<const char*> rom_files;
+    const char* output_file = nullptr;
+    const char* baseline_file = nullptr;
+    double threshold = 10.0;
+    std::string filter;
+    double min_time = 0.5;
+    int instances = std::max(1, (int)std::thread::hardware_concurrency());
+};
+
+struct result_t
+{
+    std::string name;
+    double ns_per_op;
+    // Only set for whole-frame benchmarks
+    double fps;
+};
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "Usage: nes_bench [<rom>...] [options]\n"
+        "  --output <file>     Write the JSON results to a file instead of stdout\n"
+        "  --baseline <file>   Compare against the results of an earlier run\n"
+        "  --threshold <pct>   Allowed slowdown against the baseline (default 10)\n"
+        "  --filter <text>     Only run benchmarks whose name contains the text\n"
+        "  --min-time <s>      Time spent on each benchmark (default 0.5)\n"
+        "  --instances <n>     Instances of each ROM run together (default one per thread)\n");
+}
+
+static bool parse_options(int argc, char** argv, options_t& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--output" && has_value)
+        {
+            options.output_file = argv[++i];
+        }
+        else if (arg == "--baseline" && has_value)
+        {
+            options.baseline_file = argv[++i];
+        }
+        else if (arg == "--threshold" && has_value)
+        {
+            options.threshold = strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--filter" && has_value)
+        {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--min-time" && has_value)
+        {
+            options.min_time = strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--instances" && has_value)
+        {
+            options.instances = atoi(argv[++i]);
+        }
+        else if (arg[0] != '-')
+        {
+            options.rom_files.push_back(argv[i]);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return options.min_time > 0.0 && options.instances > 0;
+}
+
+// Keeps the compiler from removing benchmarked reads
+static volatile uint8_t sink;
+
+struct bench_t
+{
+    const options_t& options;
+    std::vector<result_t> results;
+
+    // Calls batch(ops) repeatedly with a growing op count until a batch
+    // takes long enough to time, then keeps the fastest of BATCHES batches.
+    // Each op batch() is asked for may do the work of op_scale ops.
+    void run(const std::string& name, const std::function<void(uint64_t)>& batch, bool per_frame = false, int op_scale = 1)
+    {
+        if (name.find(options.filter) == std::string::npos)
+        {
+            return;
+        }
+
+        using clock = std::chrono::steady_clock;
+        double batch_time = options.min_time / BATCHES;
+        uint64_t ops = 1;
+        double best = 0.0;
+        int batches = 0;
+        while (batches < BATCHES)
+        {
+            auto start = clock::now();
+            batch(ops);
+            double seconds = std::chrono::duration<double>(clock::now() - start).count();
+            if (seconds < batch_time && batches == 0)
+            {
+                ops = seconds > 0.0
+                    ? std::max(ops * 2, (uint64_t)(ops * batch_time / seconds))
+                    : ops * 2;
+                continue;
+            }
+            double ns = seconds * 1e9 / (ops * op_scale);
+            best = batches == 0 ? ns : std::min(best, ns);
+            batches++;
+        }
+
+        result_t result{ name, best, per_frame ? 1e9 / best : 0.0 };
+        if (per_frame)
+        {
+            fprintf(stderr, "%-32s %12.1f ns/frame %9.1f fps\n", name.c_str(), result.ns_per_op, result.fps);
+        }
+        else
+        {
+            fprintf(stderr, "%-32s %12.2f ns/op\n", name.c_str(), result.ns_per_op);
+        }
+        results.push_back(result);
+    }
+};
+
+// Builds an NROM image with the program at $8000, all vectors pointing at
+// it, and random CHR
+static std::vector<uint8_t> make_rom(const std::vector<uint8_t>& program)
+{
+    static constexpr size_t PRG_SIZE = 0x8000;
+    static constexpr size_t CHR_SIZE = 0x2000;
+    std::vector<uint8_t> rom(16 + PRG_SIZE + CHR_SIZE, 0xEA);
+    const uint8_t header[16] = { 'N', 'E', 'S', 0x1A, 2, 1 };
+    memcpy(rom.data(), header, sizeof(header));
+    memcpy(rom.data() + 16, program.data(), program.size());
+    uint8_t* vectors = rom.data() + 16 + PRG_SIZE - 6;
+    for (int i = 0; i < 3; i++)
+    {
+        vectors[i * 2] = 0x00;
+        vectors[i * 2 + 1] = 0x80;
+    }
+    std::mt19937 random(1);
+    for (size_t i = 0; i < CHR_SIZE; i++)
+    {
+        rom[16 + PRG_SIZE + i] = (uint8_t)random();
+    }
+    return rom;
+}
+
+static std::unique_ptr<nes::nes_t> make_nes(const std::vector<uint8_t>& program)
+{
+    auto nes = std::make_unique<nes::nes_t>();
+    nes->load_cart(nes::cart_t::load(make_rom(program)));
+    return nes;
+}
+
+static void bench_bus(bench_t& bench)
+{
+    auto nes = make_nes({ 0x4C, 0x00, 0x80 });
+    auto& bus = nes->cpu_bus;
+
+    bench.run("bus/read_ram", [&](uint64_t ops)
+    {
+        uint8_t value = 0;
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            value += bus.read((uint16_t)(i & 0x7FF));
+        }
+        sink = value;
+    });
+    bench.run("bus/read_rom", [&](uint64_t ops)
+    {
+        uint8_t value = 0;
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            value += bus.read((uint16_t)(0x8000 | (i & 0x7FFF)));
+        }
+        sink = value;
+    });
+    bench.run("bus/read_handler", [&](uint64_t ops)
+    {
+        uint8_t value = 0;
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            value += bus.read(0x4015);
+        }
+        sink = value;
+    });
+    bench.run("bus/write_ram", [&](uint64_t ops)
+    {
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            bus.write((uint16_t)(i & 0x7FF), (uint8_t)i);
+        }
+    });
+    bench.run("bus/write_handler", [&](uint64_t ops)
+    {
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            bus.write(0x4011, (uint8_t)(i & 0x7F));
+        }
+    });
+}
+
+// Each program loops forever from $8000, with and without the decode
+// cache. ns/op is per CPU cycle.
+static void bench_cpu(bench_t& bench)
+{
+    struct mix_t
+    {
+        const char* name;
+        std::vector<uint8_t> program;
+    };
+    const mix_t mixes[] = {
+        // LDA #1; CLC; loop: ADC #3; STA $10; EOR $10; AND #$7F; ORA #1;
+        // INX; DEY; JMP loop
+        { "cpu/alu", { 0xA9, 0x01, 0x18, 0x69, 0x03, 0x85, 0x10, 0x45, 0x10,
+            0x29, 0x7F, 0x09, 0x01, 0xE8, 0x88, 0x4C, 0x03, 0x80 } },
+        // LDA $0200,X; STA $0300,Y; LDA ($20),Y; STA $40,X; INX; INY; JMP $8000
+        { "cpu/memory", { 0xBD, 0x00, 0x02, 0x99, 0x00, 0x03, 0xB1, 0x20,
+            0x95, 0x40, 0xE8, 0xC8, 0x4C, 0x00, 0x80 } },
+        // loop: INX; BNE loop; INY; BNE loop; JMP loop
+        { "cpu/branch", { 0xE8, 0xD0, 0xFD, 0xC8, 0xD0, 0xFA, 0x4C, 0x00, 0x80 } },
+        // JSR $800A; PHA; PLA; PHP; PLP; JMP $8000; ...; RTS at $800A
+        { "cpu/stack", { 0x20, 0x0A, 0x80, 0x48, 0x68, 0x08, 0x28, 0x4C,
+            0x00, 0x80, 0x60 } },
+    };
+
+    for (const auto& mix : mixes)
+    {
+        for (bool decode_cache : { false, true })
+        {
+            auto nes = make_nes(mix.program);
+            auto& cpu = nes->cpu;
+            cpu.set_decode_cache(decode_cache);
+            std::string name = mix.name;
+            bench.run(decode_cache ? name + "_cached" : name, [&](uint64_t ops)
+            {
+                for (uint64_t i = 0; i < ops; i++)
+                {
+                    cpu.clock();
+                }
+            });
+        }
+    }
+}
+
+// ns/op is per scanline
+static void bench_ppu(bench_t& bench)
+{
+    struct mask_t
+    {
+        const char* name;
+        uint8_t ppumask;
+        bool output;
+    };
+    const mask_t masks[] = {
+        { "ppu/off", 0x00, true },
+        { "ppu/background", 0x0A, true },
+        { "ppu/sprites", 0x14, true },
+        { "ppu/all", 0x1E, true },
+        { "ppu/all_no_output", 0x1E, false },
+    };
+
+    std::mt19937 random(2);
+    for (const auto& mask : masks)
+    {
+        auto nes = make_nes({ 0x4C, 0x00, 0x80 });
+        auto& ppu = nes->ppu;
+        for (auto& byte : ppu.nametable)
+        {
+            byte = (uint8_t)random();
+        }
+        for (auto& byte : ppu.oam_bytes)
+        {
+            byte = (uint8_t)random();
+        }
+        for (auto& byte : ppu.palette)
+        {
+            byte = (uint8_t)(random() & 0x3F);
+        }
+        ppu.ppumask.reg = mask.ppumask;
+        ppu.output_enabled = mask.output;
+        bench.run(mask.name, [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; i++)
+            {
+                for (int dot = 0; dot < nes::ppu_t::DOTS_PER_SCANLINE; dot++)
+                {
+                    ppu.clock();
+                }
+            }
+        });
+    }
+}
+
+// ns/op is per CPU cycle with every channel playing
+static void bench_apu(bench_t& bench)
+{
+    auto nes = make_nes({ 0x4C, 0x00, 0x80 });
+    auto& bus = nes->cpu_bus;
+    const uint8_t registers[][2] = {
+        { 0x15, 0x0F },
+        { 0x00, 0xBF }, { 0x02, 0x80 }, { 0x03, 0x01 },
+        { 0x04, 0x7F }, { 0x05, 0x8F }, { 0x06, 0x40 }, { 0x07, 0x02 },
+        { 0x08, 0xFF }, { 0x0A, 0x20 }, { 0x0B, 0x01 },
+        { 0x0C, 0x3F }, { 0x0E, 0x04 }, { 0x0F, 0x08 },
+    };
+    for (const auto& reg : registers)
+    {
+        bus.write(0x4000 | reg[0], reg[1]);
+    }
+
+    auto& apu = nes->apu;
+    bench.run("apu/clock", [&](uint64_t ops)
+    {
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            apu.clock();
+        }
+    });
+}
+
+static bool read_file(const char* file, std::vector<uint8_t>& data)
+{
+    std::ifstream stream(file, std::ios::binary | std::ios::ate);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    size_t size = stream.tellg();
+    stream.seekg(0, std::ios::beg);
+    data.resize(size);
+    stream.read((char*)data.data(), size);
+    return size > 0;
+}
+
+static bool bench_frames(bench_t& bench, const char* rom_file)
+{
+    std::vector<uint8_t> data;
+    std::shared_ptr<const std::vector<uint8_t>> rom;
+    std::unique_ptr<nes::cart_t> cart;
+    if (read_file(rom_file, data))
+    {
+        rom = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+        cart = nes::cart_t::load(rom);
+    }
+    if (!cart)
+    {
+        SPDLOG_ERROR("Failed to load ROM file: {}", rom_file);
+        return false;
+    }
+
+    auto nes = std::make_unique<nes::nes_t>();
+    nes->load_cart(std::move(cart));
+    // Get past the power on state, which is often a busy wait
+    for (int i = 0; i < 60; i++)
+    {
+        nes->clock_frame();
+    }
+
+    // With the PPU clocked every dot, and caught up only when needed
+    std::string name = "frame/" + std::filesystem::path(rom_file).stem().string();
+    for (bool ppu_catch_up : { false, true })
+    {
+        nes->set_ppu_catch_up(ppu_catch_up);
+        bench.run(ppu_catch_up ? name + "_catch_up" : name, [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; i++)
+            {
+                nes->clock_frame();
+            }
+        }, true);
+    }
+
+    // With hot code compiled as well, which relies on the PPU being caught
+    // up to give it long enough stretches between events
+    if (nes::jit_t::is_supported())
+    {
+        nes->set_jit(nes::jit_mode_t::on);
+        bench.run(name + "_catch_up_jit", [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; i++)
+            {
+                nes->clock_frame();
+            }
+        }, true);
+        nes->set_jit(nes::jit_mode_t::off);
+    }
+
+    // Many instances at once on batch_t's thread pool. fps counts the
+    // frames of every instance.
+    nes::batch_t batch;
+    for (int i = 0; i < bench.options.instances; i++)
+    {
+        batch.add(rom);
+    }
+    batch.run_frames(60);
+    int instances = bench.options.instances;
+    bench.run(name + "_batch" + std::to_string(instances), [&](uint64_t ops)
+    {
+        batch.run_frames((int)ops);
+    }, true, instances);
+    return true;
+}
+
+static std::string to_json(const std::vector<result_t>& results)
+{
+    // One benchmark per line so that load_baseline() can stay simple
+    std::string json = "{\n  \"benchmarks\": [\n";
+    char line[256];
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const auto& result = results[i];
+        if (result.fps > 0.0)
+        {
+            snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"fps\": %.1f}",
+                result.name.c_str(), result.ns_per_op, result.fps);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"ns_per_op\": %.3f}",
+                result.name.c_str(), result.ns_per_op);
+        }
+        json += line;
+        json += i + 1 < results.size() ? ",\n" : "\n";
+    }
+    json += "  ]\n}\n";
+    return json;
+}
+
+// Reads the output of an earlier run. Only the fields written by to_json()
+// are understood.
+static bool load_baseline(const char* file, std::vector<result_t>& results)
+{
+    std::ifstream stream(file);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        static const std::string NAME = "\"name\": \"";
+        static const std::string NS_PER_OP = "\"ns_per_op\": ";
+        size_t name = line.find(NAME);
+        size_t ns_per_op = line.find(NS_PER_OP);
+        if (name == std::string::npos || ns_per_op == std::string::npos)
+        {
+            continue;
+        }
+        name += NAME.size();
+        size_t name_end = line.find('"', name);
+        if (name_end == std::string::npos)
+        {
+            continue;
+        }
+        result_t result{};
+        result.name = line.substr(name, name_end - name);
+        result.ns_per_op = strtod(line.c_str() + ns_per_op + NS_PER_OP.size(), nullptr);
+        results.push_back(result);
+    }
+    return true;
+}
+
+// Returns the number of benchmarks slower than the baseline by more than
+// the threshold
+static int compare(const std::vector<result_t>& results, const std::vector<result_t>& baseline, double threshold)
+{
+    int regressions = 0;
+    for (const auto& result : results)
+    {
+        auto base = std::find_if(baseline.begin(), baseline.end(),
+            [&](const result_t& b) { return b.name == result.name; });
+        if (base == baseline.end() || base->ns_per_op <= 0.0)
+        {
+            continue;
+        }
+        double change = (result.ns_per_op / base->ns_per_op - 1.0) * 100.0;
+        bool regressed = change > threshold;
+        fprintf(stderr, "%-32s %+7.1f%%%s\n", result.name.c_str(), change, regressed ? "  REGRESSED" : "");
+        regressions += regressed;
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    options_t options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+    spdlog::set_level(spdlog::level::err);
+
+    std::vector<result_t> baseline;
+    if (options.baseline_file && !load_baseline(options.baseline_file, baseline))
+    {
+        SPDLOG_ERROR("Failed to open baseline: {}", options.baseline_file);
+        return 1;
+    }
+
+    bench_t bench{ options };
+    bench_bus(bench);
+    bench_cpu(bench);
+    bench_ppu(bench);
+    bench_apu(bench);
+    for (const char* rom_file : options.rom_files)
+    {
+        if (!bench_frames(bench, rom_file))
+        {
+            return 1;
+        }
+    }
+
+    std::string json = to_json(bench.results);
+    if (options.output_file)
+    {
+        std::ofstream stream(options.output_file);
+        stream << json;
+        if (!stream.good())
+        {
+            SPDLOG_ERROR("Failed to write results: {}", options.output_file);
+            return 1;
+        }
+    }
+    else
+    {
+        fputs(json.c_str(), stdout);
+    }
+
+    if (options.baseline_file)
+    {
+        int regressions = compare(bench.results, baseline, options.threshold);
+        if (regressions > 0)
+        {
+            fprintf(stderr, "%d benchmark(s) regressed by more than %.1f%%\n", regressions, options.threshold);
+            return EXIT_REGRESSION;
+        }
+    }
+    return 0;
+}
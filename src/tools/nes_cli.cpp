@@ -0,0 +1,499 @@
+// Runs a ROM without a window or audio device, as fast as possible, and
+// prints hashes of the screen, RAM, audio and whole machine state so runs
+// can be compared.
+//
+// Usage: nes_cli <rom> [options]
+//   --frames <n>        Number of frames to run (default 600, or the
+//                       whole movie when playing one)
+//   --input <file>      Input script (see load_input_script)
+//   --audio-rate <hz>   Audio sample rate, 0 to disable (default 48000)
+//   --every-frame       Print hashes after every frame, not just the last
+//   --turbo             Only draw the last frame
+//   --decode-cache      Run code in ROM from the CPU's decode cache
+//   --jit               Run hot code in ROM as compiled x86-64 code
+//   --jit-check         Run compiled code and the interpreter side by side
+//                       and exit with 3 if they ever differ
+//   --idle-skip         Skip the CPU through loops that wait for vblank or
+//                       an interrupt
+//   --ppu-catch-up      Run the PPU in bursts when the CPU reaches it, rather
+//                       than every dot
+//   --cpu-trace <file>  Record every instruction to a binary trace file,
+//                       which nes_trace converts to a nestest-style log
+//   --record <file>     Record the run to a movie file
+//   --play <file>       Play a movie instead of an input script and
+//                       report the first frame that desyncs
+//   --seek <n>          Start movie playback at frame n
+//   --state-check <n>   Every n frames, load a save state into a second
+//                       machine, run it alongside and exit with 4 if the
+//                       two ever differ
+//   --log-level <name>  spdlog level, e.g. warn or off (default info)
+
+#include "pch.h"
+#include "nes.h"
+#include "hash.h"
+#include "movie.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct input_event_t
+{
+    uint64_t frame;
+    uint8_t status[2];
+};
+
+struct options_t
+{
+    const char* rom_file = nullptr;
+    const char* input_file = nullptr;
+    const char* record_file = nullptr;
+    const char* play_file = nullptr;
+    const char* cpu_trace_file = nullptr;
+    uint64_t frames = 0;
+    uint64_t seek = 0;
+    uint64_t state_check = 0;
+    double audio_rate = 48000.0;
+    bool every_frame = false;
+    bool turbo = false;
+    bool decode_cache = false;
+    nes::jit_mode_t jit = nes::jit_mode_t::off;
+    bool idle_skip = false;
+    bool ppu_catch_up = false;
+};
+
+struct hashes_t
+{
+    uint64_t screen = nes::HASH_SEED;
+    uint64_t ram = nes::HASH_SEED;
+    uint64_t audio = nes::HASH_SEED;
+    uint64_t state = 0;
+};
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "Usage: nes_cli <rom> [options]\n"
+        "  --frames <n>        Number of frames to run (default 600, or the whole movie)\n"
+        "  --input <file>      Input script\n"
+        "  --audio-rate <hz>   Audio sample rate, 0 to disable (default 48000)\n"
+        "  --every-frame       Print hashes after every frame\n"
+        "  --turbo             Only draw the last frame\n"
+        "  --decode-cache      Run code in ROM from the CPU's decode cache\n"
+        "  --jit               Run hot code in ROM as compiled x86-64 code\n"
+        "  --jit-check         Compare compiled code against the interpreter\n"
+        "  --idle-skip         Skip the CPU through loops that wait for vblank\n"
+        "  --ppu-catch-up      Run the PPU in bursts when the CPU reaches it\n"
+        "  --cpu-trace <file>  Record every instruction to a binary trace file\n"
+        "  --record <file>     Record the run to a movie file\n"
+        "  --play <file>       Play a movie and report the first desync\n"
+        "  --seek <n>          Start movie playback at frame n\n"
+        "  --state-check <n>   Check that save states restore everything, every n frames\n"
+        "  --log-level <name>  spdlog level, e.g. warn or off (default info)\n");
+}
+
+static bool parse_options(int argc, char** argv, options_t& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--frames" && has_value)
+        {
+            options.frames = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--input" && has_value)
+        {
+            options.input_file = argv[++i];
+        }
+        else if (arg == "--audio-rate" && has_value)
+        {
+            options.audio_rate = strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--every-frame")
+        {
+            options.every_frame = true;
+        }
+        else if (arg == "--turbo")
+        {
+            options.turbo = true;
+        }
+        else if (arg == "--decode-cache")
+        {
+            options.decode_cache = true;
+        }
+        else if (arg == "--jit")
+        {
+            options.jit = nes::jit_mode_t::on;
+        }
+        else if (arg == "--jit-check")
+        {
+            options.jit = nes::jit_mode_t::differential;
+        }
+        else if (arg == "--idle-skip")
+        {
+            options.idle_skip = true;
+        }
+        else if (arg == "--ppu-catch-up")
+        {
+            options.ppu_catch_up = true;
+        }
+        else if (arg == "--cpu-trace" && has_value)
+        {
+            options.cpu_trace_file = argv[++i];
+        }
+        else if (arg == "--record" && has_value)
+        {
+            options.record_file = argv[++i];
+        }
+        else if (arg == "--play" && has_value)
+        {
+            options.play_file = argv[++i];
+        }
+        else if (arg == "--seek" && has_value)
+        {
+            options.seek = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--state-check" && has_value)
+        {
+            options.state_check = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--log-level" && has_value)
+        {
+            spdlog::set_level(spdlog::level::from_str(argv[++i]));
+        }
+        else if (arg[0] != '-' && options.rom_file == nullptr)
+        {
+            options.rom_file = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (options.play_file && (options.input_file || options.record_file))
+    {
+        return false;
+    }
+    return options.rom_file != nullptr;
+}
+
+static bool read_file(const char* file, std::vector<uint8_t>& data)
+{
+    std::ifstream stream(file, std::ios::binary | std::ios::ate);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    size_t size = stream.tellg();
+    stream.seekg(0, std::ios::beg);
+    data.resize(size);
+    stream.read((char*)data.data(), size);
+    return size > 0;
+}
+
+static bool write_file(const char* file, const std::vector<uint8_t>& data)
+{
+    std::ofstream stream(file, std::ios::binary);
+    stream.write((const char*)data.data(), data.size());
+    return stream.good();
+}
+
+// Each non-empty line that does not start with '#' is
+//   <frame> <player 1 buttons> [<player 2 buttons>]
+// where the buttons are a hex byte in controller_t::button_state_t layout
+// (bit 0 = A, B, select, start, up, down, left, bit 7 = right). The
+// buttons are held from that frame until the next event.
+static bool load_input_script(const char* file, std::vector<input_event_t>& events)
+{
+    std::ifstream stream(file);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(stream, line))
+    {
+        line_number++;
+        if (line.empty() || line[0] == '#' || line[0] == '\r')
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        input_event_t event{};
+        unsigned int p1 = 0;
+        unsigned int p2 = 0;
+        if (!(fields >> event.frame >> std::hex >> p1))
+        {
+            SPDLOG_ERROR("{}:{}: expected <frame> <buttons> [<buttons>]", file, line_number);
+            return false;
+        }
+        fields >> p2;
+        event.status[0] = (uint8_t)p1;
+        event.status[1] = (uint8_t)p2;
+        if (!events.empty() && event.frame < events.back().frame)
+        {
+            SPDLOG_ERROR("{}:{}: frames must be in increasing order", file, line_number);
+            return false;
+        }
+        events.push_back(event);
+    }
+    return true;
+}
+
+static void print_hashes(const char* label, uint64_t frame, const hashes_t& hashes)
+{
+    printf("%s %llu screen %016llx ram %016llx audio %016llx state %016llx\n",
+        label,
+        (unsigned long long)frame,
+        (unsigned long long)hashes.screen,
+        (unsigned long long)hashes.ram,
+        (unsigned long long)hashes.audio,
+        (unsigned long long)hashes.state);
+}
+
+int main(int argc, char** argv)
+{
+    options_t options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<uint8_t> rom;
+    if (!read_file(options.rom_file, rom))
+    {
+        SPDLOG_ERROR("Failed to open ROM file: {}", options.rom_file);
+        return 1;
+    }
+    auto image = std::make_shared<const std::vector<uint8_t>>(std::move(rom));
+    auto cart = nes::cart_t::load(image);
+    if (!cart)
+    {
+        SPDLOG_ERROR("Failed to load ROM file: {}", options.rom_file);
+        return 1;
+    }
+
+    std::vector<input_event_t> input;
+    if (options.input_file && !load_input_script(options.input_file, input))
+    {
+        SPDLOG_ERROR("Failed to load input script: {}", options.input_file);
+        return 1;
+    }
+
+    auto nes = std::make_unique<nes::nes_t>();
+    nes->cpu.set_decode_cache(options.decode_cache);
+    nes->set_jit(options.jit);
+    nes->set_idle_skip(options.idle_skip);
+    nes->set_ppu_catch_up(options.ppu_catch_up);
+    nes->load_cart(std::move(cart));
+
+    nes::movie_t movie;
+    std::vector<uint8_t> movie_data;
+    if (options.play_file)
+    {
+        if (!read_file(options.play_file, movie_data)
+            || !movie.load(movie_data.data(), movie_data.size()))
+        {
+            SPDLOG_ERROR("Failed to load movie: {}", options.play_file);
+            return 1;
+        }
+        if (!movie.matches(*nes))
+        {
+            SPDLOG_ERROR("Movie was recorded with a different ROM");
+            return 1;
+        }
+        if (options.frames == 0 || options.frames > movie.frame_count())
+        {
+            options.frames = movie.frame_count();
+        }
+        if (!movie.seek(*nes, std::min(options.seek, options.frames)))
+        {
+            SPDLOG_ERROR("Failed to seek to frame {}", options.seek);
+            return 1;
+        }
+    }
+    else
+    {
+        options.seek = 0;
+        if (options.frames == 0)
+        {
+            options.frames = 600;
+        }
+    }
+    if (options.record_file)
+    {
+        movie.start_recording(*nes);
+    }
+
+    // Drained every frame, so the ring only needs to hold one
+    nes::cpu_trace_t cpu_trace;
+    nes::cpu_trace_file_t cpu_trace_file;
+    if (options.cpu_trace_file)
+    {
+        if (!cpu_trace_file.open(options.cpu_trace_file))
+        {
+            SPDLOG_ERROR("Failed to create CPU trace file: {}", options.cpu_trace_file);
+            return 1;
+        }
+        nes->set_cpu_trace(&cpu_trace);
+    }
+
+    // A frame is slightly longer than 1/60 s of samples, so leave headroom
+    std::vector<float> samples(options.audio_rate > 0.0
+        ? (size_t)(options.audio_rate / nes::ppu_t::FRAME_RATE) * 2 + 1
+        : 0);
+    nes::audio_output_t audio;
+    audio.mixed = samples.data();
+    audio.capacity = samples.size();
+    if (options.audio_rate > 0.0)
+    {
+        nes->set_audio_output(&audio, options.audio_rate);
+    }
+
+    // Every state_check frames, a new machine is restored from a save
+    // state of the main one and then given the same input. Anything the
+    // state leaves out shows up as a difference.
+    std::unique_ptr<nes::nes_t> shadow;
+    std::vector<uint8_t> shadow_state;
+    std::optional<uint64_t> state_mismatch;
+
+    hashes_t hashes;
+    size_t next_input = 0;
+    std::optional<uint64_t> desync;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t frame = options.seek; frame < options.frames; frame++)
+    {
+        if (options.state_check > 0 && (frame - options.seek) % options.state_check == 0)
+        {
+            shadow_state.clear();
+            nes->save_state(shadow_state);
+            shadow = std::make_unique<nes::nes_t>();
+            shadow->load_cart(nes::cart_t::load(image));
+            shadow->load_state(shadow_state.data(), shadow_state.size());
+        }
+        while (next_input < input.size() && input[next_input].frame <= frame)
+        {
+            nes->controller.status[0].reg = input[next_input].status[0];
+            nes->controller.status[1].reg = input[next_input].status[1];
+            next_input++;
+        }
+
+        // Skipping the pixel output of frames whose screen is not needed
+        // leaves the rest of the machine state unchanged
+        bool video_output = !options.turbo || frame + 1 == options.frames;
+        nes->set_video_output(video_output);
+        if (options.play_file)
+        {
+            if (!movie.play_frame(*nes, frame) && !desync)
+            {
+                desync = frame;
+            }
+        }
+        else if (options.record_file)
+        {
+            movie.record_frame(*nes);
+        }
+        else
+        {
+            nes->clock_frame();
+        }
+
+        if (shadow && !state_mismatch)
+        {
+            // The screen isn't saved, so it only matches once redrawn
+            shadow->set_video_output(video_output);
+            if (options.play_file || options.record_file)
+            {
+                movie.play_frame(*shadow, frame);
+            }
+            else
+            {
+                shadow->controller.status[0] = nes->controller.status[0];
+                shadow->controller.status[1] = nes->controller.status[1];
+                shadow->clock_frame();
+            }
+            if (shadow->hash_state(video_output) != nes->hash_state(video_output))
+            {
+                state_mismatch = frame;
+            }
+        }
+
+        hashes.audio = nes::hash_bytes(samples.data(), audio.count * sizeof(float), hashes.audio);
+        audio.count = 0;
+        if (options.cpu_trace_file)
+        {
+            cpu_trace.drain(cpu_trace_file);
+        }
+        if (options.every_frame)
+        {
+            hashes.screen = nes::hash_bytes(nes->screen_buffer, sizeof(nes->screen_buffer));
+            hashes.ram = nes::hash_bytes(nes->ram.data, sizeof(nes->ram.data));
+            hashes.state = nes->hash_state(false);
+            print_hashes("frame", frame, hashes);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    hashes.screen = nes::hash_bytes(nes->screen_buffer, sizeof(nes->screen_buffer));
+    hashes.ram = nes::hash_bytes(nes->ram.data, sizeof(nes->ram.data));
+    hashes.state = nes->hash_state(false);
+    print_hashes("final", options.frames, hashes);
+
+    uint64_t frames_run = options.frames - options.seek;
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("time %.3f s fps %.1f\n", seconds, seconds > 0.0 ? frames_run / seconds : 0.0);
+    if (nes->jit)
+    {
+        printf("jit blocks %llu runs %llu mismatches %llu\n",
+            (unsigned long long)nes->jit->blocks_compiled,
+            (unsigned long long)nes->jit->blocks_run,
+            (unsigned long long)nes->jit->mismatches);
+    }
+    if (nes->idle_skip)
+    {
+        printf("idle cycles skipped %llu\n", (unsigned long long)nes->idle_cycles_skipped);
+    }
+    if (options.cpu_trace_file)
+    {
+        nes->set_cpu_trace(nullptr);
+        printf("cpu trace records %llu dropped %llu\n",
+            (unsigned long long)cpu_trace_file.count(),
+            (unsigned long long)cpu_trace.dropped.load(std::memory_order_relaxed));
+        cpu_trace_file.close();
+    }
+
+    if (options.record_file)
+    {
+        std::vector<uint8_t> data;
+        movie.save(data);
+        if (!write_file(options.record_file, data))
+        {
+            SPDLOG_ERROR("Failed to write movie: {}", options.record_file);
+            return 1;
+        }
+    }
+    if (desync)
+    {
+        printf("desync at frame %llu\n", (unsigned long long)*desync);
+        return 2;
+    }
+    if (nes->jit && nes->jit->mismatches > 0)
+    {
+        return 3;
+    }
+    if (state_mismatch)
+    {
+        printf("state mismatch at frame %llu\n", (unsigned long long)*state_mismatch);
+        return 4;
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Converts a binary CPU trace, as recorded by nes_cli --cpu-trace, into the
+// text format of nestest.log so it can be diffed against logs from other
+// emulators. The memory values nestest.log shows after operands are left
+// out, since the trace doesn't hold them.
+//
+// Usage: nes_trace <trace file> [output file]
+//   Writes to stdout when no output file is given.
+
+#include "pch.h"
+#include "cpu_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "Usage: nes_trace <trace file> [output file]\n"
+        "  Converts a CPU trace from nes_cli --cpu-trace to a nestest-style log\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::ifstream input(argv[1], std::ios::binary);
+    if (!input.is_open())
+    {
+        SPDLOG_ERROR("Failed to open trace file: {}", argv[1]);
+        return 1;
+    }
+    nes::cpu_trace_file_t::header_t header{};
+    input.read((char*)&header, sizeof(header));
+    if (!input
+        || header.magic != nes::cpu_trace_file_t::MAGIC
+        || header.version != nes::cpu_trace_file_t::VERSION
+        || header.record_size != sizeof(nes::cpu_trace_record_t))
+    {
+        SPDLOG_ERROR("Not a CPU trace file: {}", argv[1]);
+        return 1;
+    }
+
+    FILE* output = stdout;
+    if (argc == 3)
+    {
+        output = fopen(argv[2], "w");
+        if (!output)
+        {
+            SPDLOG_ERROR("Failed to create output file: {}", argv[2]);
+            return 1;
+        }
+    }
+
+    std::vector<nes::cpu_trace_record_t> records(64 * 1024);
+    uint64_t remaining = header.count;
+    while (remaining > 0)
+    {
+        size_t count = (size_t)std::min<uint64_t>(remaining, records.size());
+        input.read((char*)records.data(), count * sizeof(nes::cpu_trace_record_t));
+        if (!input)
+        {
+            SPDLOG_ERROR("Trace file is shorter than its header says");
+            break;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            std::string line = nes::format_nestest(records[i]);
+            fputs(line.c_str(), output);
+            fputc('\n', output);
+        }
+        remaining -= count;
+    }
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+    return remaining == 0 ? 0 : 1;
+}